@@ -0,0 +1,87 @@
+#ifndef _BROKERLIST_H_
+#define _BROKERLIST_H_
+
+#define MAX_BROKERS 4
+#define BROKER_HEALTH_MAX 8         // health of a broker with no recent failures
+#define BROKER_CONNECT_PENALTY 3    // TCP connect or CONNECT failed
+#define BROKER_LOST_PENALTY 2       // an established session died (missed keepalive, ack timeout)
+#define BROKER_CONNECTED_CREDIT 2   // a session was established
+
+struct BrokerAddress {
+    const char* host;
+    int port;
+};
+
+/** Ordered list of MQTT brokers with a health score each.
+ *
+ * Failures lower a broker's health, sessions established raise it and every broker slowly recovers
+ * (recover(), called periodically). The broker to connect to is the healthiest, the earlier one in the
+ * list on a tie, so the primary is used while it is as healthy as any, and taken back after its failures
+ * have been recovered from.
+ */
+class BrokerList {
+public:
+    BrokerList(const BrokerAddress* list, int count) : brokers(list), num(count < MAX_BROKERS ? count : MAX_BROKERS) {
+        for (int i = 0; i < num; i++) {
+            health[i] = BROKER_HEALTH_MAX;
+        }
+    }
+
+    /** The broker to connect to next
+     *  @param exclude a broker not to pick (the one in use, when picking a standby), -1 = none
+     *  @return its index, -1 if there is no other broker
+     */
+    int pick(int exclude = -1) const {
+        int best = -1;
+        for (int i = 0; i < num; i++) {
+            if (i != exclude && (best < 0 || health[i] > health[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    void connected(int i) {
+        adjust(i, BROKER_CONNECTED_CREDIT);
+    }
+
+    void connectFailed(int i) {
+        adjust(i, -BROKER_CONNECT_PENALTY);
+    }
+
+    void lost(int i) {
+        adjust(i, -BROKER_LOST_PENALTY);
+    }
+
+    /** Raise every broker's health one step
+     */
+    void recover() {
+        for (int i = 0; i < num; i++) {
+            adjust(i, 1);
+        }
+    }
+
+    const BrokerAddress& operator[](int i) const {
+        return brokers[i];
+    }
+
+    int healthOf(int i) const {
+        return health[i];
+    }
+
+    int count() const {
+        return num;
+    }
+
+private:
+    void adjust(int i, int delta) {
+        int h = health[i] + delta;
+        health[i] = h < 0 ? 0 : h > BROKER_HEALTH_MAX ? BROKER_HEALTH_MAX : h;
+    }
+
+    const BrokerAddress* brokers;
+    int num;
+    int8_t health[MAX_BROKERS];
+};
+
+#endif // _BROKERLIST_H_
@@ -0,0 +1,78 @@
+#ifndef _COMMANDQUEUE_H_
+#define _COMMANDQUEUE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "MQTTPacket.h"
+
+/** Fixed size FIFO of received MQTT messages (topic and payload copies).
+ *
+ * The MQTT message handler runs inside MQTT::Client::cycle(), while the client may be waiting
+ * for an ack of its own. Pushing the message here and returning lets the client send the PUBACK
+ * straight away; the application pops the messages at a point of its choosing in the main loop,
+ * where handlers are free to publish or do slow IO.
+ *
+ * Pushed from and popped by the same (main loop) context, so there is no locking.
+ */
+template<int DEPTH, int MAX_TOPIC_LEN, int MAX_PAYLOAD_LEN>
+class CommandQueue {
+    static_assert(MAX_TOPIC_LEN < 256 && MAX_PAYLOAD_LEN < 256 && DEPTH < 256, "lengths are held in a byte");
+public:
+    struct Entry {
+        char topic[MAX_TOPIC_LEN];
+        char payload[MAX_PAYLOAD_LEN];
+        uint8_t topiclen;
+        uint8_t payloadlen;
+    };
+
+    CommandQueue() : head(0), count(0), dropped(0) {
+    }
+
+    /** Copy a received message into the queue
+     *  @return false if the queue is full or the message doesn't fit an entry (it is dropped)
+     */
+    bool push(MQTTString &topic, const void* payload, int payloadlen) {
+        const char* name = topic.cstring ? topic.cstring : topic.lenstring.data;
+        int len = topic.cstring ? strlen(topic.cstring) : topic.lenstring.len;
+        if (count == DEPTH || len > MAX_TOPIC_LEN || payloadlen > MAX_PAYLOAD_LEN) {
+            dropped++;
+            return false;
+        }
+        Entry &e = entries[(head + count) % DEPTH];
+        memcpy(e.topic, name, len);
+        memcpy(e.payload, payload, payloadlen);
+        e.topiclen = len;
+        e.payloadlen = payloadlen;
+        count++;
+        return true;
+    }
+
+    /** Oldest queued message, NULL if the queue is empty (valid until pop())
+     */
+    const Entry* front() const {
+        return count ? &entries[head] : NULL;
+    }
+
+    void pop() {
+        if (count) {
+            head = (head + 1) % DEPTH;
+            count--;
+        }
+    }
+
+    /** Messages dropped since the last call (queue full or too long)
+     */
+    int takeDropped() {
+        int n = dropped;
+        dropped = 0;
+        return n;
+    }
+
+private:
+    Entry entries[DEPTH];
+    uint8_t head;
+    uint8_t count;
+    uint16_t dropped;
+};
+
+#endif // _COMMANDQUEUE_H_
@@ -0,0 +1,162 @@
+#ifndef _COMMANDROUTER_H_
+#define _COMMANDROUTER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "MQTTPacket.h"
+
+#define COMMAND_MAX_VALUES 4
+
+/** Arguments of a received command, parsed in place from the MQTT receive buffer
+ */
+struct CommandArgs {
+    int index;                          // number from a %u in the pattern, -1 if none
+    const char* payload;                // raw payload (not null terminated)
+    int payloadlen;
+    uint32_t values[COMMAND_MAX_VALUES];// numbers parsed from the payload
+    int count;                          // how many values were parsed
+};
+
+typedef bool (*CommandParser)(const char* payload, int len, CommandArgs &args);
+typedef void (*CommandHandler)(const CommandArgs &args);
+
+/** One entry of a command table.
+ *  pattern is the sub-topic after the router prefix, a %u in it matches a decimal index
+ *  (eg: "output%u" matches output0 .. output99, but not outputs).
+ */
+struct Command {
+    const char* pattern;
+    CommandParser parse;                // NULL = payload not parsed
+    CommandHandler handler;
+};
+
+enum CommandResult {COMMAND_OK, COMMAND_NOT_FOUND, COMMAND_BAD_ARGS};
+
+/** Payload parser: "1" or "0" (first char only, as 1/ON style payloads start with it) into values[0]
+ */
+inline bool command_parse_bool(const char* payload, int len, CommandArgs &args) {
+    if (len < 1 || (payload[0] != '0' && payload[0] != '1')) {
+        return false;
+    }
+    args.values[0] = payload[0] == '1';
+    args.count = 1;
+    return true;
+}
+
+/** Payload parser: comma separated unsigned numbers (decimal or 0x hex) into values[],
+ *  a number over 32 bits is rejected rather than wrapped
+ */
+inline bool command_parse_numbers(const char* payload, int len, CommandArgs &args) {
+    const char* p = payload;
+    const char* end = payload + len;
+    args.count = 0;
+    while (args.count < COMMAND_MAX_VALUES) {
+        uint32_t value = 0;
+        int base = 10;
+        const char* start;
+        if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+            base = 16;
+            p += 2;
+        }
+        start = p;
+        for (; p < end; p++) {
+            int digit;
+            if (*p >= '0' && *p <= '9') {
+                digit = *p - '0';
+            }
+            else if (base == 16 && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+                digit = (*p | 0x20) - 'a' + 10;
+            }
+            else {
+                break;
+            }
+            if (value > (UINT32_MAX - digit) / base) {
+                return false;
+            }
+            value = value * base + digit;
+        }
+        if (p == start) {
+            return false;
+        }
+        args.values[args.count++] = value;
+        if (p == end) {
+            return true;
+        }
+        if (*p++ != ',') {
+            return false;
+        }
+    }
+    return false;   // too many values
+}
+
+/** Routes commands received under a topic prefix (eg: cmnd/<name>/) to the handlers of a
+ *  static command table. Topic and payload are parsed where they sit in the MQTT receive
+ *  buffer, nothing is copied or allocated.
+ */
+class CommandRouter {
+public:
+    CommandRouter(const char* prefix, const Command* table, int count) :
+        prefix(prefix), prefix_len(strlen(prefix)), table(table), count(count) {
+    }
+
+    /** Find and run the command for a received message
+     *  @return COMMAND_OK, COMMAND_NOT_FOUND (no pattern matches) or COMMAND_BAD_ARGS (payload rejected)
+     */
+    CommandResult dispatch(MQTTString &topic, const void* payload, int payloadlen) {
+        const char* name = topic.cstring ? topic.cstring : topic.lenstring.data;
+        int len = topic.cstring ? strlen(topic.cstring) : topic.lenstring.len;
+        if (len < prefix_len || memcmp(name, prefix, prefix_len) != 0) {
+            return COMMAND_NOT_FOUND;
+        }
+        name += prefix_len;
+        len -= prefix_len;
+        for (int i = 0; i < count; i++) {
+            CommandArgs args;
+            if (!match(table[i].pattern, name, len, args.index)) {
+                continue;
+            }
+            args.payload = (const char*)payload;
+            args.payloadlen = payloadlen;
+            args.count = 0;
+            if (table[i].parse && !table[i].parse(args.payload, payloadlen, args)) {
+                return COMMAND_BAD_ARGS;
+            }
+            table[i].handler(args);
+            return COMMAND_OK;
+        }
+        return COMMAND_NOT_FOUND;
+    }
+
+private:
+    static bool match(const char* pattern, const char* name, int len, int &index) {
+        const char* end = name + len;
+        index = -1;
+        while (*pattern) {
+            if (pattern[0] == '%' && pattern[1] == 'u') {
+                if (name == end || *name < '0' || *name > '9') {
+                    return false;
+                }
+                index = 0;
+                while (name < end && *name >= '0' && *name <= '9' && index < 10000) {
+                    index = index * 10 + (*name++ - '0');
+                }
+                pattern += 2;
+            }
+            else if (name < end && *pattern == *name) {
+                pattern++;
+                name++;
+            }
+            else {
+                return false;
+            }
+        }
+        return name == end;
+    }
+
+    const char* prefix;
+    int prefix_len;
+    const Command* table;
+    int count;
+};
+
+#endif // _COMMANDROUTER_H_
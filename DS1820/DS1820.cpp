@@ -415,6 +415,24 @@ float DS1820::temperature(char scale) {
     return answer;
 }
  
+int DS1820::temperatureRaw() {
+    int reading, remaining_count, count_per_degree;
+    read_RAM();
+    if (RAM_checksum_error())
+        // Indicate we got a CRC error
+        return invalid_raw;
+    reading = (int16_t)(((unsigned char)RAM[1] << 8) | (unsigned char)RAM[0]);
+    if ((FAMILY_CODE == FAMILY_CODE_DS18B20 ) || (FAMILY_CODE == FAMILY_CODE_DS1822 ))
+        return reading;
+    // 1/2 deg C reading, truncated and extended by count_remain as in temperature()
+    remaining_count = (unsigned char)RAM[6];
+    count_per_degree = (unsigned char)RAM[7];
+    reading = (reading >> 1) * 16 - 4;
+    if (count_per_degree)
+        reading += ((count_per_degree - remaining_count) * 16 + count_per_degree / 2) / count_per_degree;
+    return reading;
+}
+
 bool DS1820::read_power_supply(devices device) {
 // This will return true if the device (or all devices) are Vcc powered
 // This will return false if the device (or ANY device) is parasite powered
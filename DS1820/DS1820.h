@@ -56,7 +56,8 @@ public:
         all_devices };   // command applies to all devices
     
     enum {
-        invalid_conversion = -1000
+        invalid_conversion = -1000,
+        invalid_raw = -32768
     };
 
     /** Create a probe object connected to the specified pins
@@ -99,6 +100,15 @@ public:
       */
     float temperature(char scale='c');
 
+    /** This function will return the probe temperature in its native fixed point
+      * form, 1/16ths of a degree C, without any floating point math.
+      * A DS18S20 (family 0x10) reading is rescaled from its count_remain extended
+      * resolution to the nearest 1/16th.
+      *
+      * @returns temperature in 1/16 deg C, or DS1820::invalid_raw if CRC error detected.
+      */
+    int temperatureRaw();
+
     /** This function sets the temperature resolution for the DS18B20
       * in the configuration register.
       *
@@ -0,0 +1,460 @@
+#ifndef _EDGEBROKER_H_
+#define _EDGEBROKER_H_
+
+#include "mbed.h"
+#include <string.h>
+#include "TCPSocketServer.h"
+#include "TCPSocketConnection.h"
+#include "MQTTPacket.h"
+#include "MQTTTopicTrie.h"
+
+#define EDGE_MAX_ROUTES 4           // local handlers of client publishes (commands, bridging)
+#define EDGE_MAX_FILTER_LEN 48      // longest topic filter a client can subscribe to
+#define EDGE_SUBSCRIBE_FILTERS 4    // filters taken from one SUBSCRIBE / UNSUBSCRIBE
+#define EDGE_SEND_TIMEOUT_MS 100    // longest wait for a client's TCP window, then it is dropped
+#define EDGE_CONNECT_TIMEOUT_SEC 10 // a new connection must send CONNECT within this
+
+/** TCP connection of a broker client, with the W5500 socket state the broker polls on
+ */
+class EdgeConnection : public TCPSocketConnection {
+public:
+    /** Bytes received and waiting to be read (never waits)
+     */
+    int readable() {
+        int size, size2;
+        if (_sock_fd < 0) {
+            return 0;
+        }
+        do {    // the register can change while it is read, so read it until it is stable
+            size = eth->sreg<uint16_t>(_sock_fd, Sn_RX_RSR);
+            size2 = eth->sreg<uint16_t>(_sock_fd, Sn_RX_RSR);
+        } while (size != size2);
+        return size;
+    }
+
+    /** The peer has closed (or the connection is gone) and everything it sent has been read
+     */
+    bool closed() {
+        if (_sock_fd < 0) {
+            return true;
+        }
+        uint8_t state = eth->sreg<uint8_t>(_sock_fd, Sn_SR);
+        return state != WIZnet_Chip::SOCK_ESTABLISHED && readable() == 0;
+    }
+};
+
+/** Listening socket of the broker, accepts only when a connection is waiting
+ */
+class EdgeServer : public TCPSocketServer {
+public:
+    /** A connection is established on the listening socket, so accept() won't wait
+     */
+    bool pending() {
+        return _sock_fd >= 0 && eth->sreg<uint8_t>(_sock_fd, Sn_SR) == WIZnet_Chip::SOCK_ESTABLISHED;
+    }
+
+    /** A W5500 socket is free for accept() to listen on again
+     */
+    bool spareSocket() {
+        return eth->new_socket() >= 0;
+    }
+};
+
+/** Minimal MQTT 3.1.1 broker for the local network segment.
+ *
+ * Sibling controllers and HMIs connect to it on the spare W5500 sockets and exchange messages at LAN
+ * latency, without the round trip through the central broker. Publishes are routed through a topic trie
+ * to the subscribed clients and to local routes: handlers in the application that take client publishes
+ * on a topic filter (the controller's own commands, topics bridged to the central broker). The
+ * application injects its own messages (and topics bridged down from the central broker) with publish().
+ *
+ * Kept small on purpose: subscriptions are granted QoS 0 and messages delivered at QoS 0 (QoS 1 and 2
+ * publishes are acked when routed), sessions are clean, and there are no retained messages or wills.
+ * One packet per client is buffered, so a packet bigger than PACKET_SIZE drops its client.
+ *
+ * Runs from the main loop with poll(), which never waits for the network. Each client takes a W5500
+ * socket and accept() needs a free one to listen on again, so MAX_CLIENTS has to leave sockets for the
+ * listener, the central MQTT connection and DHCP/DNS (5 of the 8).
+ * @param MAX_CLIENTS connected clients
+ * @param MAX_FILTERS different topic filters subscribed (or routed) at once, over all clients
+ * @param PACKET_SIZE largest packet a client can send
+ */
+template<int MAX_CLIENTS, int MAX_FILTERS, int PACKET_SIZE>
+class EdgeBroker {
+    static_assert(MAX_CLIENTS + EDGE_MAX_ROUTES <= 16, "subscribers are held in a 16 bit mask");
+    static_assert(MAX_FILTERS <= 128, "filter ids are held in the topic trie's handler id");
+public:
+    typedef void (*RouteHandler)(MQTTString &topic, const void* payload, int payloadlen);
+
+    EdgeBroker() : server(NULL), port(0), connected(0) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            clients[i].conn = NULL;
+            clients[i].state = CLIENT_FREE;
+        }
+        for (int i = 0; i < MAX_FILTERS; i++) {
+            filters[i] = 0;
+        }
+        for (int i = 0; i < EDGE_MAX_ROUTES; i++) {
+            routes[i] = NULL;
+        }
+    }
+
+    /** Start (or restart, after the W5500 was reset) listening. Drops any connected clients, routes stay.
+     *  Call once the network is up.
+     *  @return false if the listening socket could not be opened
+     */
+    bool begin(int listen_port) {
+        if (server == NULL) {     // sockets need the W5500 driver, which doesn't exist at static init
+            server = new EdgeServer();
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                clients[i].conn = new EdgeConnection();
+            }
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].state != CLIENT_FREE) {
+                drop(i);
+            }
+        }
+        port = listen_port;
+        server->close();
+        return server->bind(port) == 0 && server->listen() == 0;
+    }
+
+    /** Give client publishes on a topic filter to a local handler too (subscribed clients still get them)
+     *  @return false if there is no room for another route or filter
+     */
+    bool route(const char* topicFilter, RouteHandler handler) {
+        for (int r = 0; r < EDGE_MAX_ROUTES; r++) {
+            if (routes[r] == NULL) {
+                if (!subscribe(MAX_CLIENTS + r, topicFilter)) {
+                    return false;
+                }
+                routes[r] = handler;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Deliver a message to the clients subscribed to its topic (local routes don't get it)
+     *  @return false if it doesn't fit a packet
+     */
+    bool publish(MQTTString &topic, const void* payload, int payloadlen) {
+        return deliver(topic, payload, payloadlen, false);
+    }
+
+    bool publish(const char* topic, int topiclen, const void* payload, int payloadlen) {
+        MQTTString name = MQTTString_initializer;
+        name.lenstring.data = (char*)topic;
+        name.lenstring.len = topiclen;
+        return deliver(name, payload, payloadlen, false);
+    }
+
+    /** Accept connections, read and route what the clients sent, drop dead clients. Never waits for the
+     *  network (only for a client's TCP window when sending to it).
+     *  @param now time in seconds, for keepalives
+     */
+    void poll(unsigned long now) {
+        if (server == NULL || port == 0) {
+            return;
+        }
+        if (server->pending()) {
+            accept(now);
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].state != CLIENT_FREE) {
+                service(i, now);
+            }
+        }
+    }
+
+    /** Clients connected (TCP), for status reports
+     */
+    int clientCount() const {
+        return connected;
+    }
+
+private:
+    enum {CLIENT_FREE, CLIENT_CONNECTING, CLIENT_CONNECTED};
+
+    struct Client {
+        EdgeConnection* conn;
+        unsigned char buf[PACKET_SIZE];     // the packet being received, and any bytes after it
+        int have;                           // bytes in buf
+        unsigned long last;                 // time of the last packet (or the TCP connect)
+        uint16_t keepalive;                 // seconds, 0 = none
+        uint8_t state;
+    };
+
+    void accept(unsigned long now) {
+        int c = 0;
+        while (c < MAX_CLIENTS && clients[c].state != CLIENT_FREE) {
+            c++;
+        }
+        if (c == MAX_CLIENTS || !server->spareSocket()) {
+            // no room: reset the waiting connection by reopening the listening socket
+            server->close();
+            server->bind(port);
+            server->listen();
+            return;
+        }
+        Client &cl = clients[c];
+        if (server->accept(*cl.conn) != 0) {
+            return;
+        }
+        cl.conn->set_blocking(false, EDGE_SEND_TIMEOUT_MS);
+        cl.have = 0;
+        cl.last = now;
+        cl.keepalive = 0;
+        cl.state = CLIENT_CONNECTING;
+        connected++;
+    }
+
+    void service(int c, unsigned long now) {
+        Client &cl = clients[c];
+        int len;
+        if (cl.conn->closed()) {
+            drop(c);
+            return;
+        }
+        if (cl.conn->readable() > 0) {
+            int n = cl.conn->receive((char*)cl.buf + cl.have, PACKET_SIZE - cl.have, 0);
+            if (n < 0) {
+                drop(c);
+                return;
+            }
+            cl.have += n;
+        }
+        while ((len = packetLen(cl)) > 0 && len <= cl.have) {
+            cl.last = now;
+            if (!handle(c, len)) {
+                drop(c);
+                return;
+            }
+            cl.have -= len;
+            memmove(cl.buf, cl.buf + len, cl.have);
+        }
+        if (len < 0 || len > PACKET_SIZE) {
+            drop(c);    // malformed, or will never fit the buffer
+        }
+        else if (cl.state == CLIENT_CONNECTING ? now - cl.last > EDGE_CONNECT_TIMEOUT_SEC :
+                 cl.keepalive && now - cl.last > cl.keepalive + cl.keepalive / 2u) {
+            drop(c);
+        }
+    }
+
+    // length of the packet at the start of the buffer, 0 if its header isn't in yet, -1 if malformed
+    int packetLen(Client &cl) {
+        int rem = 0;
+        int multiplier = 1;
+        for (int i = 1; i < cl.have; i++) {
+            rem += (cl.buf[i] & 0x7F) * multiplier;
+            if ((cl.buf[i] & 0x80) == 0) {
+                return 1 + i + rem;
+            }
+            if (i == 4) {
+                return -1;
+            }
+            multiplier *= 128;
+        }
+        return 0;
+    }
+
+    // returns false if the client is to be dropped
+    bool handle(int c, int len) {
+        Client &cl = clients[c];
+        unsigned char* packet = cl.buf;
+        MQTTHeader header = {0};
+        header.byte = packet[0];
+        if (cl.state == CLIENT_CONNECTING) {
+            return header.bits.type == CONNECT && connect(c, len);
+        }
+        switch (header.bits.type) {
+            case PUBLISH: {
+                unsigned char dup, retained;
+                unsigned short id;
+                int qos, payloadlen;
+                unsigned char* payload;
+                MQTTString topic = MQTTString_initializer;
+                if (MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadlen, packet, len) != 1) {
+                    return false;
+                }
+                if (qos == 1) {
+                    len = MQTTSerialize_puback(sendbuf, PACKET_SIZE, id);
+                }
+                else if (qos == 2) {
+                    len = MQTTSerialize_ack(sendbuf, PACKET_SIZE, PUBREC, 0, id);
+                }
+                if (qos && !sendTo(c, len)) {
+                    return false;
+                }
+                deliver(topic, payload, payloadlen, true);
+                return clients[c].state != CLIENT_FREE;     // a failed delivery may have dropped it
+            }
+            case PUBREL: {
+                unsigned char type, dup;
+                unsigned short id;
+                if (MQTTDeserialize_ack(&type, &dup, &id, packet, len) != 1) {
+                    return false;
+                }
+                return sendTo(c, MQTTSerialize_pubcomp(sendbuf, PACKET_SIZE, id));
+            }
+            case SUBSCRIBE:
+                return subscribePacket(c, len);
+            case UNSUBSCRIBE:
+                return unsubscribePacket(c, len);
+            case PINGREQ:
+                return sendTo(c, MQTTSerialize_pingresp(sendbuf, PACKET_SIZE));
+            case PUBACK:
+            case PUBREC:
+            case PUBCOMP:
+                return true;    // everything goes out at QoS 0, nothing to ack
+            default:
+                return false;   // DISCONNECT, or not a client packet
+        }
+    }
+
+    bool connect(int c, int len) {
+        MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+        if (MQTTDeserialize_connect(&data, clients[c].buf, len) != 1) {
+            // unknown protocol level (eg: MQTT 5): refuse it, with the 3.1.1 return code
+            sendTo(c, MQTTSerialize_connack(sendbuf, PACKET_SIZE, 1, 0));
+            return false;
+        }
+        clients[c].keepalive = data.keepAliveInterval;
+        clients[c].state = CLIENT_CONNECTED;
+        return sendTo(c, MQTTSerialize_connack(sendbuf, PACKET_SIZE, 0, 0));
+    }
+
+    bool subscribePacket(int c, int len) {
+        unsigned char dup;
+        unsigned short id;
+        int count;
+        MQTTString topics[EDGE_SUBSCRIBE_FILTERS];
+        int qos[EDGE_SUBSCRIBE_FILTERS];
+        char filter[EDGE_MAX_FILTER_LEN + 1];
+        if (MQTTDeserialize_subscribe(&dup, &id, EDGE_SUBSCRIBE_FILTERS, &count, topics, qos, clients[c].buf, len) != 1) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            qos[i] = copyFilter(filter, topics[i]) && subscribe(c, filter) ? 0 : 0x80;   // granted QoS 0, or failure
+        }
+        return sendTo(c, MQTTSerialize_suback(sendbuf, PACKET_SIZE, id, count, qos));
+    }
+
+    bool unsubscribePacket(int c, int len) {
+        unsigned char dup;
+        unsigned short id;
+        int count;
+        MQTTString topics[EDGE_SUBSCRIBE_FILTERS];
+        char filter[EDGE_MAX_FILTER_LEN + 1];
+        if (MQTTDeserialize_unsubscribe(&dup, &id, EDGE_SUBSCRIBE_FILTERS, &count, topics, clients[c].buf, len) != 1) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            if (copyFilter(filter, topics[i])) {
+                int f = trie.find(filter);
+                if (f >= 0) {
+                    unsubscribe(c, f);
+                }
+            }
+        }
+        return sendTo(c, MQTTSerialize_unsuback(sendbuf, PACKET_SIZE, id));
+    }
+
+    bool copyFilter(char* filter, MQTTString &topic) {
+        int len = topic.lenstring.len;
+        if (len == 0 || len > EDGE_MAX_FILTER_LEN) {
+            return false;
+        }
+        memcpy(filter, topic.lenstring.data, len);
+        filter[len] = '\0';
+        return true;
+    }
+
+    // add a subscriber (client, or MAX_CLIENTS + route) to a filter, sharing the filter's trie entry
+    bool subscribe(int subscriber, const char* topicFilter) {
+        int f = trie.find(topicFilter);
+        if (f < 0) {
+            f = 0;
+            while (f < MAX_FILTERS && filters[f] != 0) {
+                f++;
+            }
+            if (f == MAX_FILTERS || !trie.insert(topicFilter, f)) {
+                return false;
+            }
+        }
+        filters[f] |= 1u << subscriber;
+        return true;
+    }
+
+    void unsubscribe(int subscriber, int f) {
+        filters[f] &= ~(1u << subscriber);
+        if (filters[f] == 0) {
+            trie.removeHandler(f);
+        }
+    }
+
+    // send to every subscribed client (routes too for client publishes), at QoS 0
+    bool deliver(MQTTString &topic, const void* payload, int payloadlen, bool from_client) {
+        int matched[MAX_FILTERS];
+        uint16_t subscribers = 0;
+        const char* name = topic.cstring ? topic.cstring : topic.lenstring.data;
+        int count = trie.match(name, topic.cstring ? strlen(topic.cstring) : topic.lenstring.len, matched, MAX_FILTERS);
+        for (int i = 0; i < count; i++) {
+            subscribers |= filters[matched[i]];     // a client gets a message once, however many filters match
+        }
+        if (subscribers & ((1u << MAX_CLIENTS) - 1)) {
+            int len = MQTTSerialize_publish(sendbuf, PACKET_SIZE, 0, 0, 0, 0, topic, (unsigned char*)payload, payloadlen);
+            if (len <= 0) {
+                return false;
+            }
+            for (int c = 0; c < MAX_CLIENTS; c++) {
+                if ((subscribers & (1u << c)) && clients[c].state == CLIENT_CONNECTED) {
+                    sendTo(c, len);
+                }
+            }
+        }
+        for (int r = 0; from_client && r < EDGE_MAX_ROUTES; r++) {
+            if (subscribers & (1u << (MAX_CLIENTS + r))) {
+                routes[r](topic, payload, payloadlen);
+            }
+        }
+        return true;
+    }
+
+    // send the packet in sendbuf, a client that can't take it is dropped
+    bool sendTo(int c, int len) {
+        if (len <= 0 || clients[c].conn->send_all((char*)sendbuf, len) != len) {
+            drop(c);
+            return false;
+        }
+        return true;
+    }
+
+    void drop(int c) {
+        Client &cl = clients[c];
+        if (cl.state == CLIENT_FREE) {
+            return;
+        }
+        cl.conn->close();
+        cl.state = CLIENT_FREE;
+        connected--;
+        for (int f = 0; f < MAX_FILTERS; f++) {
+            if (filters[f] & (1u << c)) {
+                unsubscribe(c, f);
+            }
+        }
+    }
+
+    EdgeServer* server;
+    int port;
+    int connected;
+    Client clients[MAX_CLIENTS];
+    uint16_t filters[MAX_FILTERS];          // subscribers of each filter: bit per client, then per route
+    RouteHandler routes[EDGE_MAX_ROUTES];
+    MQTT::TopicTrie<MAX_FILTERS * 4, MAX_FILTERS * 12> trie;    // filter -> index in filters
+    unsigned char sendbuf[PACKET_SIZE];
+};
+
+#endif // _EDGEBROKER_H_
@@ -0,0 +1,74 @@
+#ifndef _EDGEQUEUE_H_
+#define _EDGEQUEUE_H_
+
+#include <stdint.h>
+#include <atomic>
+
+/** Timestamped input edges from interrupts to the main loop.
+ *
+ * Lock-free ring for one producer (the input interrupts, which don't preempt each other at the same
+ * priority) and one consumer (the main loop): the producer only writes head, the consumer only tail.
+ * When it is full an edge is dropped and counted, the consumer then has to read the pins to catch up.
+ *
+ * SIZE has to be a power of 2.
+ */
+template<int SIZE>
+class EdgeQueue {
+public:
+    struct Edge {
+        uint8_t pin;
+        uint8_t level;          // level after the edge
+        uint32_t us;            // when it was seen, us clock of the producer
+    };
+
+    EdgeQueue() : head(0), tail(0), lost(0) {
+        static_assert((SIZE & (SIZE - 1)) == 0, "EdgeQueue SIZE has to be a power of 2");
+    }
+
+    /** Queue an edge (producer)
+     *  @return false if the queue was full and the edge was dropped
+     */
+    bool push(uint8_t pin, uint8_t level, uint32_t us) {
+        uint32_t h = head;
+        if (h - tail == SIZE) {
+            lost = lost + 1;
+            return false;
+        }
+        Edge &e = ring[h & (SIZE - 1)];
+        e.pin = pin;
+        e.level = level;
+        e.us = us;
+        std::atomic_signal_fence(std::memory_order_release);   // the edge is written before it is published
+        head = h + 1;
+        return true;
+    }
+
+    /** Take the oldest edge (consumer)
+     *  @return false if there is none
+     */
+    bool pop(Edge &e) {
+        uint32_t t = tail;
+        if (t == head) {
+            return false;
+        }
+        std::atomic_signal_fence(std::memory_order_acquire);
+        e = ring[t & (SIZE - 1)];
+        std::atomic_signal_fence(std::memory_order_release);   // read before the slot is handed back
+        tail = t + 1;
+        return true;
+    }
+
+    /** Edges dropped since the start, compare with the count last seen
+     */
+    uint32_t dropped() const {
+        return lost;
+    }
+
+private:
+    Edge ring[SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t lost;
+};
+
+#endif // _EDGEQUEUE_H_
@@ -0,0 +1,384 @@
+#ifndef _FIRMWAREUPDATE_H_
+#define _FIRMWAREUPDATE_H_
+
+#include "mbed.h"
+#include <stdio.h>
+#include <string.h>
+
+#define OTA_PROGRAM_BUF 64          // bytes gathered per flash program, a multiple of the flash program unit
+#define OTA_MAGIC 0x3141544FU       // "OTA1", marks a verified image waiting to be installed
+
+#if defined(TARGET_STM32F1)
+// Copy the staged image over the running firmware, then reset. Runs from RAM (.data is copied there at
+// startup) with interrupts off, as it erases the flash everything else runs from: registers only, no calls.
+__attribute__((noinline, long_call, section(".data.ota_install")))
+static void ota_install(uint32_t dst, uint32_t src, uint32_t size, uint32_t page, uint32_t record) {
+    FLASH->KEYR = 0x45670123;
+    FLASH->KEYR = 0xCDEF89AB;
+    for (uint32_t addr = dst; addr < dst + size; addr += page) {
+        FLASH->CR |= FLASH_CR_PER;
+        FLASH->AR = addr;
+        FLASH->CR |= FLASH_CR_STRT;
+        while (FLASH->SR & FLASH_SR_BSY) {
+            IWDG->KR = 0xAAAA;      // keep a running watchdog quiet
+        }
+        FLASH->CR &= ~FLASH_CR_PER;
+    }
+    FLASH->CR |= FLASH_CR_PG;
+    for (uint32_t i = 0; i < size; i += 2) {
+        *(volatile uint16_t*)(dst + i) = *(const uint16_t*)(src + i);
+        while (FLASH->SR & FLASH_SR_BSY) {
+        }
+        IWDG->KR = 0xAAAA;
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    // the image is in, forget it
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = record;
+    FLASH->CR |= FLASH_CR_STRT;
+    while (FLASH->SR & FLASH_SR_BSY) {
+        IWDG->KR = 0xAAAA;
+    }
+    FLASH->CR &= ~FLASH_CR_PER;
+    __DSB();
+    SCB->AIRCR = (0x5FAUL << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+    for (;;) {
+    }
+}
+#endif
+
+// where the linker put the running firmware's code, and the initial values of .data right after it
+#if defined(__ARMCC_VERSION)
+extern "C" uint32_t Load$$LR$$LR_IROM1$$Limit[];
+#else
+extern "C" uint32_t __etext[], __data_start__[], __data_end__[];
+#endif
+
+/** Firmware update received over MQTT and programmed straight into flash.
+ *
+ * Flash is split in two halves: the running firmware in the first, the new image is staged in the second
+ * (so an image can be at most half the flash, less the last sector, which holds the install record, and
+ * the running firmware has to fit in the first half, begin fails if it doesn't).
+ * The image arrives as a sequence of frames, each frame's data is programmed as it arrives with a running
+ * CRC-32, so the image is never held in RAM. A frame too big for the MQTT read buffer is fed in pieces as
+ * it comes off the socket, when the client has a stream handler for the topic: set before connecting, so
+ * the client doesn't limit the broker to its read buffer (MQTT 5 Maximum Packet Size). Otherwise a chunk
+ * has to fit in the read buffer with its topic. Frames, numbers big endian:
+ *
+ *   'B' <size:4> <crc32:4> <chunk:2> <window:1>    begin: image size and CRC-32 (as zlib's crc32), data bytes
+ *                                                  per chunk, chunks the sender may send ahead of a status
+ *   'D' <seq:2> <data>                             data: chunk seq (0, 1, ...), only the next seq is taken
+ *   'E'                                            end: verify, and install at the next boot
+ *   'A'                                            abort
+ *
+ * Progress goes back as a status "<state>,<next seq>": "ready" after a begin, "receiving" every window
+ * chunks (and after the last), "resend" when a chunk is missing (the sender goes back to next seq),
+ * "verified", "failed" or "idle" (aborted).
+ *
+ * A verified image is installed by applyPending() at the next boot, copying it over the running firmware
+ * from RAM. The copy is not power fail safe (that needs a bootloader).
+ */
+class FirmwareUpdate {
+public:
+    enum State {OTA_IDLE, OTA_RECEIVING, OTA_VERIFIED, OTA_FAILED};
+
+    FirmwareUpdate() : state_(OTA_IDLE), flash_ready(false), frame_state(FRAME_HEADER), status_ready(false) {
+    }
+
+    /** Install a verified image staged by a previous update, if there is one. Call first thing in main():
+     *  it does not return when an image is installed (the controller resets into it).
+     */
+    static void applyPending() {
+#if defined(TARGET_STM32F1)
+        FlashIAP flash;
+        uint32_t stage_addr, record_addr;
+        flash.init();
+        uint32_t size = pending(flash, stage_addr, record_addr);
+        uint32_t start = flash.get_flash_start();
+        uint32_t page = flash.get_sector_size(start);
+        flash.deinit();
+        if (size == 0) {
+            return;
+        }
+        core_util_critical_section_enter();
+        ota_install(start, stage_addr, size, page, record_addr);
+#endif
+    }
+
+    /** Size of the verified image staged for install, 0 if there is none (a corrupt one is forgotten)
+     *  @param flash initialized
+     *  @param stage_addr set to where the image is staged
+     *  @param record_addr set to its install record
+     */
+    static uint32_t pending(FlashIAP &flash, uint32_t &stage_addr, uint32_t &record_addr) {
+        MbedCRC<POLY_32BIT_ANSI, 32> crc32;
+        uint32_t check;
+        regions(flash, stage_addr, record_addr);
+        const uint32_t* record = (const uint32_t*)record_addr;
+        if (record[0] != OTA_MAGIC || record[3] != ~OTA_MAGIC || record[1] == 0 ||
+            record[1] > record_addr - stage_addr) {
+            return 0;
+        }
+        crc32.compute((void*)stage_addr, record[1], &check);
+        if (check != record[2]) {
+            flash.erase(record_addr, flash.get_sector_size(record_addr));   // corrupt, forget it
+            return 0;
+        }
+        return record[1];
+    }
+
+    /** Feed (a piece of) a received OTA frame, in order
+     *  @param data the piece
+     *  @param len length of the piece
+     *  @param offset position of the piece in the frame
+     *  @param total length of the whole frame
+     */
+    void receive(const uint8_t* data, int len, int offset, int total) {
+        bool last = offset + len >= total;
+        if (offset == 0) {
+            frame_state = FRAME_HEADER;
+            header_len = 0;
+        }
+        if (frame_state == FRAME_HEADER) {
+            while (len > 0 && header_len < frameHeaderLen()) {
+                header[header_len++] = *data++;
+                len--;
+            }
+            if (header_len < frameHeaderLen()) {
+                return;     // more of the header to come
+            }
+            frame_state = startFrame(total) ? FRAME_DATA : FRAME_SKIP;
+        }
+        if (frame_state != FRAME_DATA) {
+            return;
+        }
+        if (len > 0 && !program(data, len)) {
+            fail();
+            return;
+        }
+        if (last) {
+            next_seq++;
+            if (next_seq % window == 0 || received == image_size) {
+                report("receiving");
+            }
+        }
+    }
+
+    /** Status to report since the last call, NULL if none
+     */
+    const char* takeStatus() {
+        if (!status_ready) {
+            return NULL;
+        }
+        status_ready = false;
+        return status;
+    }
+
+    State state() {
+        return state_;
+    }
+
+private:
+    enum {FRAME_HEADER, FRAME_DATA, FRAME_SKIP};
+
+    static void regions(FlashIAP &flash, uint32_t &stage_addr, uint32_t &record_addr) {
+        uint32_t start = flash.get_flash_start();
+        uint32_t size = flash.get_flash_size();
+        stage_addr = start + size / 2;
+        record_addr = start + size - flash.get_sector_size(start + size - 1);
+    }
+
+    // end of the running firmware in flash
+    static uint32_t imageEnd() {
+#if defined(__ARMCC_VERSION)
+        return (uint32_t)(uintptr_t)Load$$LR$$LR_IROM1$$Limit;
+#else
+        return (uint32_t)(uintptr_t)__etext + (uint32_t)((uintptr_t)__data_end__ - (uintptr_t)__data_start__);
+#endif
+    }
+
+    int frameHeaderLen() {
+        if (header_len == 0) {
+            return 1;
+        }
+        switch (header[0]) {
+            case 'B':
+                return 12;
+            case 'D':
+                return 3;
+            default:
+                return 1;
+        }
+    }
+
+    // a frame's header is in, returns true if its data is to be programmed
+    bool startFrame(int total) {
+        switch (header[0]) {
+            case 'B':
+                begin();
+                return false;
+            case 'D': {
+                if (state_ != OTA_RECEIVING || received == image_size) {
+                    return false;
+                }
+                uint16_t seq = (header[1] << 8) | header[2];
+                uint32_t left = image_size - (uint32_t)next_seq * chunk_size;
+                if (seq != next_seq || total - 3 != (int)(left < chunk_size ? left : chunk_size)) {
+                    if (!resend_reported) {
+                        report("resend");   // once, the sender goes back to next_seq
+                        resend_reported = true;
+                    }
+                    return false;
+                }
+                resend_reported = false;
+                return true;
+            }
+            case 'E':
+                finish();
+                return false;
+            case 'A':
+                state_ = OTA_IDLE;
+                report("idle");
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    void begin() {
+        uint32_t size = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) | (header[3] << 8) | header[4];
+        if (!flash_ready) {
+            flash.init();
+            flash_ready = true;
+        }
+        regions(flash, stage_addr, record_addr);
+        image_crc = ((uint32_t)header[5] << 24) | ((uint32_t)header[6] << 16) | (header[7] << 8) | header[8];
+        chunk_size = (header[9] << 8) | header[10];
+        window = header[11];
+        next_seq = 0;
+        // the staging half must not reach into the running firmware
+        if (imageEnd() > stage_addr || size == 0 || size > record_addr - stage_addr || chunk_size == 0 ||
+            window == 0 || (size + chunk_size - 1) / chunk_size > 0xFFFF) {
+            fail();
+            return;
+        }
+        // an older staged image is no longer valid
+        if (flash.erase(record_addr, flash.get_sector_size(record_addr)) != 0) {
+            fail();
+            return;
+        }
+        image_size = size;
+        write_addr = erased_to = stage_addr;
+        received = 0;
+        buffered = 0;
+        resend_reported = false;
+        crc32.compute_partial_start(&crc);
+        state_ = OTA_RECEIVING;
+        report("ready");
+    }
+
+    bool program(const uint8_t* data, int len) {
+        if (received + len > image_size) {
+            return false;
+        }
+        crc32.compute_partial(data, len, &crc);
+        received += len;
+        while (len > 0) {
+            int n = OTA_PROGRAM_BUF - buffered;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(program_buf + buffered, data, n);
+            buffered += n;
+            data += n;
+            len -= n;
+            if (buffered == OTA_PROGRAM_BUF && !flush()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // program the gathered bytes, erasing each sector as the writes reach it
+    bool flush() {
+        if (buffered == 0) {
+            return true;
+        }
+        uint32_t unit = flash.get_page_size();
+        uint32_t size = (buffered + unit - 1) / unit * unit;
+        memset(program_buf + buffered, 0xFF, size - buffered);
+        while (write_addr + size > erased_to) {
+            uint32_t sector = flash.get_sector_size(erased_to);
+            if (flash.erase(erased_to, sector) != 0) {
+                return false;
+            }
+            erased_to += sector;
+        }
+        if (flash.program(program_buf, write_addr, size) != 0) {
+            return false;
+        }
+        write_addr += size;
+        buffered = 0;
+        return true;
+    }
+
+    void finish() {
+        uint32_t check;
+        if (state_ != OTA_RECEIVING) {
+            return;
+        }
+        if (!flush() || received != image_size) {
+            fail();
+            return;
+        }
+        crc32.compute_partial_stop(&crc);
+        crc32.compute((void*)stage_addr, image_size, &check);   // and what actually landed in flash
+        if (crc != image_crc || check != image_crc) {
+            fail();
+            return;
+        }
+        uint32_t record[4] = {OTA_MAGIC, image_size, image_crc, ~OTA_MAGIC};
+        if (flash.program(record, record_addr, sizeof(record)) != 0) {
+            fail();
+            return;
+        }
+        state_ = OTA_VERIFIED;
+        report("verified");
+    }
+
+    void fail() {
+        state_ = OTA_FAILED;
+        report("failed");
+    }
+
+    void report(const char* state) {
+        snprintf(status, sizeof(status), "%s,%u", state, next_seq);
+        status_ready = true;
+    }
+
+    FlashIAP flash;
+    MbedCRC<POLY_32BIT_ANSI, 32> crc32;
+    State state_;
+    bool flash_ready;
+    uint32_t stage_addr;        // where the image is staged
+    uint32_t record_addr;       // install record of a verified image
+    uint32_t write_addr;        // next flash address to program
+    uint32_t erased_to;         // end of the sectors erased so far
+    uint32_t image_size;
+    uint32_t image_crc;
+    uint32_t received;          // image bytes taken so far
+    uint32_t crc;               // running CRC-32 of them
+    uint16_t chunk_size;
+    uint8_t window;
+    uint16_t next_seq;
+    bool resend_reported;
+    uint8_t frame_state;
+    uint8_t header[12];
+    int header_len;
+    uint8_t program_buf[OTA_PROGRAM_BUF];
+    int buffered;
+    char status[24];
+    bool status_ready;
+};
+
+#endif // _FIRMWAREUPDATE_H_
@@ -0,0 +1,142 @@
+#ifndef _GPIOBANK_H_
+#define _GPIOBANK_H_
+
+#include "mbed.h"
+
+/** A bank of pins read and written as a bitmask (bit N = pins[N]).
+ *
+ * The pin table is turned into a map at compile time (declare the bank constexpr): the ports it uses, and
+ * runs of bank bits that sit on consecutive pins of one port, in either order. A bank bit is then found in
+ * the port register with a shift and a mask per run, not per pin, and a pin table laid out along a port
+ * (eg: PA_0 - PA_7) is a single run. Pins in descending order are a run too, bit reversed (RBIT).
+ * Changing the pin assignment only changes the table.
+ *
+ * sample() reads each port's IDR once, back-to-back, so the bank is a snapshot with no skew between the
+ * pins of a port. write() builds one BSRR word per port and then stores them back-to-back with interrupts
+ * off, so every pin on a port switches on the same clock edge and pins on different ports follow within a
+ * couple of bus cycles. The pins must already be configured (eg: by DigitalIn / DigitalOut).
+ */
+template<int N>
+class GpioBank {
+public:
+    constexpr GpioBank(const PinName (&pins)[N]) : runs(), num_runs(0), ports(), num_ports(0) {
+        for (int i = 0; i < N; i++) {
+            uint8_t port = STM_PORT(pins[i]);
+            uint8_t pin = STM_PIN(pins[i]);
+            int p = 0;
+            while (p < num_ports && ports[p] != port) {
+                p++;
+            }
+            if (p == num_ports) {
+                ports[num_ports++] = port;
+            }
+            // carry on the last run if the pin is next to its last one on the same port
+            if (num_runs) {
+                Run &r = runs[num_runs - 1];
+                int last = r.reversed ? 31 - r.shift - (r.width - 1) : r.shift + r.width - 1;
+                if (r.slot == p && ((pin == last + 1 && (!r.reversed || r.width == 1)) ||
+                                    (pin == last - 1 && (r.reversed || r.width == 1)))) {
+                    if (pin < last && !r.reversed) {
+                        r.reversed = true;      // a second pin, below the first
+                        r.shift = 31 - last;
+                    }
+                    r.width++;
+                    continue;
+                }
+            }
+            Run &r = runs[num_runs++];
+            r.slot = p;
+            r.first = i;
+            r.shift = pin;
+            r.width = 1;
+            r.reversed = false;
+        }
+    }
+
+    /** Drive the pins selected by mask to the matching bits of value, all at once.
+     *  Safe to call from interrupt context.
+     */
+    void write(uint32_t mask, uint32_t value) const {
+        uint32_t set[N] = {0};
+        uint32_t selected[N] = {0};
+        for (int i = 0; i < num_runs; i++) {
+            const Run &r = runs[i];
+            set[r.slot] |= toPort(r, value & mask);
+            selected[r.slot] |= toPort(r, mask);
+        }
+        core_util_critical_section_enter();
+        for (int p = 0; p < num_ports; p++) {
+            if (selected[p]) {
+                gpio(ports[p])->BSRR = set[p] | (selected[p] & ~set[p]) << 16;
+            }
+        }
+        core_util_critical_section_exit();
+    }
+
+    /** Current output state of the bank as a bitmask (ODR)
+     */
+    uint32_t read() const {
+        uint32_t odr[N];
+        for (int p = 0; p < num_ports; p++) {
+            odr[p] = gpio(ports[p])->ODR;
+        }
+        return fromPorts(odr);
+    }
+
+    /** Input levels of the bank as a bitmask, one IDR read per port
+     */
+    uint32_t sample() const {
+        uint32_t idr[N];
+        for (int p = 0; p < num_ports; p++) {
+            idr[p] = gpio(ports[p])->IDR;
+        }
+        return fromPorts(idr);
+    }
+
+    /** Bitmask with a bit set for every pin in the bank
+     */
+    constexpr uint32_t all() const {
+        return N == 32 ? 0xFFFFFFFFUL : (1UL << N) - 1;
+    }
+
+private:
+    // bank bits first .. first+width-1 on consecutive pins of a port, ascending from pin shift, or descending
+    // (then shift is into the bit reversed port word)
+    struct Run {
+        uint8_t slot = 0;       // index in ports
+        uint8_t first = 0;
+        uint8_t shift = 0;
+        uint8_t width = 0;
+        bool reversed = false;
+    };
+
+    static GPIO_TypeDef* gpio(uint8_t port) {
+        return (GPIO_TypeDef*)(GPIOA_BASE + port * (GPIOB_BASE - GPIOA_BASE));
+    }
+
+    static uint32_t bits(const Run &r) {
+        return r.width == 32 ? 0xFFFFFFFFUL : (1UL << r.width) - 1;
+    }
+
+    static uint32_t toPort(const Run &r, uint32_t value) {
+        uint32_t word = ((value >> r.first) & bits(r)) << r.shift;
+        return r.reversed ? __RBIT(word) : word;
+    }
+
+    uint32_t fromPorts(const uint32_t* words) const {
+        uint32_t value = 0;
+        for (int i = 0; i < num_runs; i++) {
+            const Run &r = runs[i];
+            uint32_t word = r.reversed ? __RBIT(words[r.slot]) : words[r.slot];
+            value |= ((word >> r.shift) & bits(r)) << r.first;
+        }
+        return value;
+    }
+
+    Run runs[N];
+    int num_runs;
+    uint8_t ports[N];
+    int num_ports;
+};
+
+#endif // _GPIOBANK_H_
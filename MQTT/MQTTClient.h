@@ -26,6 +26,9 @@
 
 #include "FP.h"
 #include "MQTTPacket.h"
+#include "MQTTV5Packet.h"
+#include "MQTTTopicTrie.h"
+#include "MQTTPacketArena.h"
 #include <stdio.h>
 #include "MQTTLogging.h"
 
@@ -36,6 +39,21 @@
     #define MQTTCLIENT_QOS2 0
 #endif
 
+#if !defined(MQTTCLIENT_TRIE_NODES_PER_HANDLER)
+    #define MQTTCLIENT_TRIE_NODES_PER_HANDLER 4     // subscription trie size, in topic levels per message handler
+#endif
+#if !defined(MQTTCLIENT_TRIE_POOL_PER_HANDLER)
+    #define MQTTCLIENT_TRIE_POOL_PER_HANDLER 16     // subscription trie level text, in bytes per message handler
+#endif
+
+#if !defined(MQTTCLIENT_TOPIC_ALIASES)
+    #define MQTTCLIENT_TOPIC_ALIASES 16     // MQTT 5 topic aliases kept for PublishTopic publishes, 0 = none
+#endif
+
+#if !defined(MQTTCLIENT_MAX_PENDING)
+    #define MQTTCLIENT_MAX_PENDING 8        // operations started with the non-blocking API awaiting their ack
+#endif
+
 namespace MQTT
 {
 
@@ -43,7 +61,7 @@ namespace MQTT
 enum QoS { QOS0, QOS1, QOS2 };
 
 // all failure return codes must be negative
-enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+enum returnCode { BUSY = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
 
 struct Message
@@ -57,6 +75,51 @@ struct Message
 };
 
 
+/**
+ * @class PublishTopic
+ * @brief a publish topic serialized at compile time
+ *
+ * Holds the PUBLISH fixed header byte (QoS and retained flag) followed by the length-prefixed topic,
+ * exactly as they go on the wire.  Declared constexpr the bytes live in flash and a publish only has to
+ * fill in the remaining length, packet id and payload around them.
+ * On an MQTT 5 session the client gives each PublishTopic a topic alias (keyed by its address, so the
+ * topic must be static, eg: in a constexpr table) and sends only the 2 byte alias after the first publish.
+ * @param MAX_TOPIC_LEN the longest topic the table can hold (checked at compile time)
+ */
+template<int MAX_TOPIC_LEN>
+struct PublishTopic
+{
+    template<int N>
+    constexpr PublishTopic(const char (&topic)[N], enum QoS qos = QOS0, bool retained = false) : data(), len(N + 2)
+    {
+        static_assert(N - 1 <= MAX_TOPIC_LEN, "topic longer than MAX_TOPIC_LEN");
+        data[0] = (unsigned char)(0x30 | (qos << 1) | (retained ? 1 : 0));    // PUBLISH
+        data[1] = (unsigned char)((N - 1) >> 8);
+        data[2] = (unsigned char)((N - 1) & 0xFF);
+        for (int i = 0; i < N - 1; i++)
+            data[3 + i] = (unsigned char)topic[i];
+    }
+
+    enum QoS qos() const
+    {
+        return (enum QoS)((data[0] >> 1) & 0x03);
+    }
+
+    const char* name() const    // not null terminated, see nameLen()
+    {
+        return (const char*)&data[3];
+    }
+
+    int nameLen() const
+    {
+        return len - 3;
+    }
+
+    unsigned char data[3 + MAX_TOPIC_LEN];  // fixed header byte, topic length MSB/LSB, topic
+    int len;                                // bytes of data in use
+};
+
+
 struct MessageData
 {
     MessageData(MQTTString &aTopicName, struct Message &aMessage)  : message(aMessage), topicName(aTopicName)
@@ -67,6 +130,19 @@ struct MessageData
 };
 
 
+struct StreamData
+{
+    StreamData(MQTTString &aTopicName, struct Message &aMessage, int aOffset, int aTotal)  : message(aMessage), topicName(aTopicName),
+        offset(aOffset), total(aTotal)
+    { }
+
+    struct Message &message;    // payload and payloadlen are this chunk
+    MQTTString &topicName;
+    int offset;                 // position of the chunk in the payload
+    int total;                  // length of the whole payload
+};
+
+
 struct connackData
 {
     int rc;
@@ -80,6 +156,15 @@ struct subackData
 };
 
 
+struct ResultData
+{
+    int packetType;         // the operation: CONNECT, PUBLISH or SUBSCRIBE
+    unsigned short id;      // packet id of the operation, 0 for CONNECT and QoS 0 publishes
+    int rc;                 // SUCCESS, FAILURE (refused, timed out or connection lost) or the CONNACK return code
+    int value;              // CONNACK session present flag, SUBACK granted QoS
+};
+
+
 class PacketId
 {
 public:
@@ -105,16 +190,27 @@ private:
  *
  * This version of the API blocks on all method calls, until they are complete.  This means that only one
  * MQTT request can be in process at any one time.
+ *
+ * The start... methods are the non-blocking alternative: they send the packet and return, poll() reads
+ * whatever has arrived (partial packets are kept for the next call) and reports completions through the
+ * result handlers.  The blocking methods and yield() may only be used while no started operation is pending
+ * (eg: connect and subscribe blocking, then publish with startPublish() and poll()).
  * @param Network a network class which supports send, receive
  * @param Timer a timer class with the methods:
+ * @param MAX_MQTT_PACKET_SIZE the read and send buffer size of the default Arena
+ * @param Arena the packet buffers, a PacketArena - to size the read buffer, send buffer and in-flight store separately
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5>
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5,
+         class Arena = PacketArena<MAX_MQTT_PACKET_SIZE, MAX_MQTT_PACKET_SIZE,
+                                   (MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2) ? MAX_MQTT_PACKET_SIZE + MQTTPACKETARENA_ENTRY_HEADER : 0> >
 class Client
 {
 
 public:
 
     typedef void (*messageHandler)(MessageData&);
+    typedef void (*resultHandler)(ResultData&);
+    typedef void (*streamHandler)(StreamData&);
 
     /** Construct the client
      *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
@@ -134,12 +230,45 @@ public:
             defaultMessageHandler.detach();
     }
 
+    /** Set the default result callback - used for completed operations started without a result handler of their own
+     *  @param rh - pointer to the callback function.  Set to 0 to remove.
+     */
+    void setDefaultResultHandler(resultHandler rh)
+    {
+        if (rh != 0)
+            defaultResultHandler.attach(rh);
+        else
+            defaultResultHandler.detach();
+    }
+
+    /** Set the default result callback to a member function
+     *  @param item - the object
+     *  @param method - the member function to call
+     */
+    template<class T>
+    void setDefaultResultHandler(T* item, void (T::*method)(ResultData&))
+    {
+        defaultResultHandler.attach(item, method);
+    }
+
     /** Set a message handling callback.  This can be used outside of the the subscribe method.
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param mh - pointer to the callback function. If 0, removes the callback if any
      */
     int setMessageHandler(const char* topicFilter, messageHandler mh);
 
+    /** Set a stream handling callback for a subscription (subscribe, or setMessageHandler, first).  A publish
+     *  too big for the read buffer is passed to it in chunks as the payload arrives, instead of being dropped,
+     *  so a payload of any size can be handled without a buffer as large as the message.  Smaller publishes
+     *  still go to the message handler.  The topic name is valid for all the chunks, each chunk only until the
+     *  next one.  While a stream handler is set, an MQTT 5 CONNECT doesn't limit the packet size to the read
+     *  buffer (the broker would drop the large publishes), so set it before connecting.
+     *  @param topicFilter - the topic filter, as subscribed
+     *  @param sh - pointer to the callback function. If 0, oversized publishes are dropped again
+     *  @return success code - FAILURE if there is no message handler for topicFilter
+     */
+    int setStreamHandler(const char* topicFilter, streamHandler sh);
+
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
      *  Default connect options are used
@@ -190,6 +319,16 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish to a precompiled topic - the topic, QoS and retained flag come from the
+     *  PublishTopic, only the remaining length, packet id and payload are written per call
+     *  @param topic - the precompiled topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @return success code -
+     */
+    template<int MAX_TOPIC_LEN>
+    int publish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen);
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
@@ -226,6 +365,64 @@ public:
      */
     int yield(unsigned long timeout_ms = 1000L);
 
+    /** Non-blocking MQTT Connect - send an MQTT connect packet, poll() completes it when the connack arrives
+     *  The nework object must be connected to the network endpoint before calling this
+     *  @param options - connect options
+     *  @param rh - called with the result (rc is the CONNACK return code), can be 0
+     *  @return success code - of sending the connect packet
+     */
+    int startConnect(MQTTPacket_connectData& options, resultHandler rh = 0);
+
+    /** Non-blocking MQTT Subscribe - send an MQTT subscribe packet, poll() completes it when the suback arrives
+     *  @param topicFilter - a topic pattern which can include wildcards, must stay valid while subscribed
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param mh - the callback function to be invoked when a message is received for this subscription
+     *  @param rh - called with the result (value is the granted QoS), can be 0
+     *  @return the packet id, or a failure code - BUSY if no pending operation slot is free
+     */
+    int startSubscribe(const char* topicFilter, enum QoS qos, messageHandler mh, resultHandler rh = 0);
+
+    /** Non-blocking MQTT Publish to a precompiled topic - send an MQTT publish packet without waiting for its ack
+     *  QoS 1 and 2 publishes are complete when poll() sees the PUBACK/PUBCOMP, a QoS 0 publish as soon as it is sent
+     *  @param topic - the precompiled topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param rh - called with the result, can be 0
+     *  @return the packet id (0 for QoS 0), or a failure code - BUSY if getReceiveMaximum() publishes
+     *      are already in flight, no pending operation slot is free or (cleansession 0) the arena's
+     *      in-flight store has no room to keep it for resending
+     */
+    template<int MAX_TOPIC_LEN>
+    int startPublish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen, resultHandler rh = 0);
+
+    /** Non-blocking MQTT Publish - send an MQTT publish packet without waiting for its ack
+     *  @param topicName - the topic to publish to
+     *  @param message - the message to send, its id is set to the packet id used
+     *  @param rh - called with the result, can be 0
+     *  @return the packet id (0 for QoS 0), or a failure code - BUSY as for the precompiled topic version
+     */
+    int startPublish(const char* topicName, Message& message, resultHandler rh = 0);
+
+    /** Non-blocking MQTT Unsubscribe - send an MQTT unsubscribe packet, poll() completes it when the unsuback arrives
+     *  @param topicFilter - a topic pattern which can include wildcards, as it was subscribed
+     *  @param rh - called with the result, can be 0
+     *  @return the packet id, or a failure code - BUSY if no pending operation slot is free
+     */
+    int startUnsubscribe(const char* topicFilter, resultHandler rh = 0);
+
+    /** Make progress without blocking - read what has arrived (completing acks, delivering messages and
+     *  acknowledging them), time out operations and keep the connection alive.  Call it as often as possible.
+     *  @return success code - on failure, this means the client has disconnected and the pending operations failed
+     */
+    int poll();
+
+    /** Operations started with the non-blocking API that are still waiting for their ack
+     */
+    int getPendingCount()
+    {
+        return pendingCount;
+    }
+
     /** Is the client connected?
      *  @return flag - is the client connected or not?
      */
@@ -234,28 +431,57 @@ public:
         return isconnected;
     }
 
+    /** How many QoS 1 and 2 publishes the broker accepts in flight (MQTT 5 Receive Maximum, 65535 for
+     *  MQTT 3.1.1).  The blocking API waits for each ack, so it never has more than one outstanding,
+     *  startPublish() keeps at most this many (and at most MQTTCLIENT_MAX_PENDING) in flight.
+     *  @return the broker's receive maximum
+     */
+    int getReceiveMaximum()
+    {
+        return serverReceiveMax;
+    }
+
 private:
 
     void closeSession();
     void cleanSession();
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
+    int waitforAck(int packet_type, unsigned short id, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(int len, Timer& timer, enum QoS qos, unsigned short id);
 
     int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
     int sendPacket(int length, Timer& timer);
     int deliverMessage(MQTTString& topicName, Message& message);
-    bool isTopicMatched(char* topicFilter, MQTTString& topicName);
+    int findTopicAlias(const void* topic);
+    template<int MAX_TOPIC_LEN>
+    int serializePublish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen, unsigned short id);
+    int serializeConnect(MQTTPacket_connectData& options);
+    int readConnack(connackData& data);
+    int readSuback(subackData& data, unsigned short& mypacketid);
+    int handlePacket(int packet_type, Timer& timer);
+    int addPending(int packetType, unsigned short id, resultHandler rh);
+    int findPending(int packetType, unsigned short id);
+    void completePending(int i, int rc, int value = 0);
+    void notifyResult(ResultData& result, resultHandler rh);
+    int sendStarted(int len, Timer& timer, int packetType, unsigned short id, resultHandler rh);
+    bool keepInflight(int len, unsigned short id);
+    int resendInflight(Timer& timer, bool wait);
+    void failPending();
+    static int transportRead(void* network, unsigned char* buf, int len);
+    void startStream(int fixedLen, int remLen);
+    int streamHeaderLen();
+    int readStream(Timer& timer, bool wait);
 
     Network& ipstack;
     unsigned long command_timeout_ms;
 
-    unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
-    unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    Arena arena;    // read and send buffers, and the publishes to resend on reconnect
 
     Timer last_sent, last_received;
+    Timer ping_sent;                // per client, a second connection (warm standby) has its own
     unsigned int keepAliveInterval;
     bool ping_outstanding;
     bool cleansession;
@@ -266,21 +492,56 @@ private:
     {
         const char* topicFilter;
         FP<void, MessageData&> fp;
+        streamHandler sh;
     } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
 
+    // subscription topic filters, matched to the index of their message handler
+    TopicTrie<MAX_MESSAGE_HANDLERS * MQTTCLIENT_TRIE_NODES_PER_HANDLER,
+              MAX_MESSAGE_HANDLERS * MQTTCLIENT_TRIE_POOL_PER_HANDLER> topicTrie;
+
     FP<void, MessageData&> defaultMessageHandler;
+    FP<void, ResultData&> defaultResultHandler;
 
     bool isconnected;
 
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    unsigned char pubbuf[MAX_MQTT_PACKET_SIZE];  // store the last publish for sending on reconnect
-    int inflightLen;
-    unsigned short inflightMsgid;
-    enum QoS inflightQoS;
+    unsigned char mqttVersion;          // protocol level of the session, 5 = MQTT 5
+    unsigned short serverReceiveMax;    // MQTT 5 CONNACK Receive Maximum
+    unsigned int serverMaxPacketSize;   // MQTT 5 CONNACK Maximum Packet Size, 0 = no limit
+#if MQTTCLIENT_TOPIC_ALIASES
+    unsigned short serverTopicAliasMax; // MQTT 5 CONNACK Topic Alias Maximum
+    int topicAliasCount;
+    const void* topicAliases[MQTTCLIENT_TOPIC_ALIASES];    // alias N is the PublishTopic at [N - 1]
 #endif
 
+    // operations started with the non-blocking API, waiting for their ack
+    struct PendingOp
+    {
+        unsigned char packetType;   // 0 = free slot
+        unsigned short id;
+        resultHandler rh;
+        const char* topicFilter;    // SUBSCRIBE/UNSUBSCRIBE: handler set/removed when the ack arrives
+        messageHandler mh;
+    } pending[MQTTCLIENT_MAX_PENDING];
+    int pendingCount;
+    int inflightPublishes;          // QoS 1 and 2 publishes among the pending operations
+    Timer ackTimer;                 // no ack for command_timeout_ms while operations are pending = connection lost
+    MQTTTransport transport;        // poll()'s partially read packet
+
+    // a received packet too big for the read buffer, read in pieces: a PUBLISH payload goes to its stream handler
+    struct Stream
+    {
+        int left;                   // bytes still to read, 0 = none in progress
+        int have;                   // bytes of the header in the read buffer, while reading it
+        int fixedLen;               // fixed header length
+        int headerLen;              // fixed and variable header length, 0 while reading it
+        int total;                  // payload length
+        int offset;                 // payload bytes delivered
+        int handler;                // message handler slot with the stream handler, -1 = payload skipped
+        unsigned char qos;          // ack once read, QoS 0 = no ack
+        unsigned short id;
+    } stream;
+
 #if MQTTCLIENT_QOS2
-    bool pubrel;
     #if !defined(MAX_INCOMING_QOS2_MESSAGES)
         #define MAX_INCOMING_QOS2_MESSAGES 10
     #endif
@@ -295,47 +556,63 @@ private:
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::cleanSession()
 {
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
         messageHandlers[i].topicFilter = 0;
+        messageHandlers[i].sh = 0;
+    }
+    topicTrie.clear();
 
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    inflightMsgid = 0;
-    inflightQoS = QOS0;
-#endif
+    arena.clearInflight();
 
 #if MQTTCLIENT_QOS2
-    pubrel = false;
     for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
         incomingQoS2messages[i] = 0;
 #endif
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::closeSession()
 {
     ping_outstanding = false;
     isconnected = false;
     if (cleansession)
         cleanSession();
+    failPending();
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
     cleansession = true;
+    mqttVersion = 4;
+    serverReceiveMax = 65535;
+    serverMaxPacketSize = 0;
+#if MQTTCLIENT_TOPIC_ALIASES
+    serverTopicAliasMax = 0;
+    topicAliasCount = 0;
+#endif
+    for (int i = 0; i < MQTTCLIENT_MAX_PENDING; ++i)
+        pending[i].packetType = 0;
+    pendingCount = 0;
+    inflightPublishes = 0;
+    transport.getfn = transportRead;
+    transport.sck = &ipstack;
+    transport.state = 0;
+    stream.left = 0;
       closeSession();
 }
 
 
 #if MQTTCLIENT_QOS2
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
+template<class Network, class Timer, int a, int b, class Arena>
+bool MQTT::Client<Network, Timer, a, b, Arena>::isQoS2msgidFree(unsigned short id)
 {
     for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
     {
@@ -346,8 +623,8 @@ bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
 }
 
 
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+template<class Network, class Timer, int a, int b, class Arena>
+bool MQTT::Client<Network, Timer, a, b, Arena>::useQoS2msgid(unsigned short id)
 {
     for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
     {
@@ -361,8 +638,8 @@ bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
 }
 
 
-template<class Network, class Timer, int a, int b>
-void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
+template<class Network, class Timer, int a, int b, class Arena>
+void MQTT::Client<Network, Timer, a, b, Arena>::freeQoS2msgid(unsigned short id)
 {
     for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
     {
@@ -376,15 +653,15 @@ void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
 #endif
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::sendPacket(int length, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
 
     while (sent < length)
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        rc = ipstack.write(&arena.sendbuf[sent], length - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -403,14 +680,14 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
 #if defined(MQTT_DEBUG)
     char printbuf[150];
     DEBUG("Rc %d from sending packet %s\r\n", rc, 
-        MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
+        MQTTFormat_toServerString(printbuf, sizeof(printbuf), arena.sendbuf, length));
 #endif
     return rc;
 }
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::decodePacket(int* value, int timeout)
 {
     unsigned char c;
     int multiplier = 1;
@@ -444,8 +721,8 @@ exit:
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
  * @return the MQTT packet type, 0 if none, -1 if error
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::readPacket(Timer& timer)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
@@ -453,26 +730,29 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
     int rem_len = 0;
 
     /* 1. read the header byte.  This has the packet type in it */
-    rc = ipstack.read(readbuf, 1, timer.left_ms());
+    rc = ipstack.read(arena.readbuf, 1, timer.left_ms());
     if (rc != 1)
         goto exit;
 
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    len += MQTTPacket_encode(arena.readbuf + 1, rem_len); /* put the original remaining length into the buffer */
 
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    if (rem_len > (Arena::READ_BUFFER_SIZE - len))
     {
-        rc = BUFFER_OVERFLOW;
+        // read it in pieces, so the connection stays in step: a PUBLISH payload goes to its stream handler
+        Timer stream_timer(command_timeout_ms);     // timer may be short, it only had to see the packet start
+        startStream(len, rem_len);
+        rc = (readStream(stream_timer, true) == SUCCESS) ? 0 : FAILURE;
         goto exit;
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
+    if (rem_len > 0 && (ipstack.read(arena.readbuf + len, rem_len, timer.left_ms()) != rem_len))
         goto exit;
 
-    header.byte = readbuf[0];
+    header.byte = arena.readbuf[0];
     rc = header.bits.type;
     if (this->keepAliveInterval > 0)
         last_received.countdown(this->keepAliveInterval); // record the fact that we have successfully received a packet
@@ -483,7 +763,7 @@ exit:
     {
         char printbuf[50];
         DEBUG("Rc %d receiving packet %s\r\n", rc, 
-            MQTTFormat_toClientString(printbuf, sizeof(printbuf), readbuf, len));
+            MQTTFormat_toClientString(printbuf, sizeof(printbuf), arena.readbuf, len));
     }
 #endif
     return rc;
@@ -493,53 +773,25 @@ exit:
 // assume topic filter and name is in correct format
 // # can only be at end
 // + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
-{
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
-
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
-}
-
-
-
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::deliverMessage(MQTTString& topicName, Message& message)
 {
     int rc = FAILURE;
+    int handlers[MAX_MESSAGE_HANDLERS];
+    int count;
 
-    // we have to find the right message handler - indexed by topic
-    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    // we have to find the right message handlers - one walk down the subscription trie
+    if (topicName.cstring)
+        count = topicTrie.match(topicName.cstring, strlen(topicName.cstring), handlers, MAX_MESSAGE_HANDLERS);
+    else
+        count = topicTrie.match(topicName.lenstring.data, topicName.lenstring.len, handlers, MAX_MESSAGE_HANDLERS);
+    for (int i = 0; i < count; ++i)
     {
-        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName)))
+        if (messageHandlers[handlers[i]].fp.attached())
         {
-            if (messageHandlers[i].fp.attached())
-            {
-                MessageData md(topicName, message);
-                messageHandlers[i].fp(md);
-                rc = SUCCESS;
-            }
+            MessageData md(topicName, message);
+            messageHandlers[handlers[i]].fp(md);
+            rc = SUCCESS;
         }
     }
 
@@ -554,8 +806,8 @@ int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTSt
 
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::yield(unsigned long timeout_ms)
 {
     int rc = SUCCESS;
     Timer timer;
@@ -575,160 +827,669 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
+// MQTTPacket_readnb() source: the network read with a zero timeout must return 0 when nothing is waiting
+// (as TCPSocketConnection::receive does), -1 when the connection is gone
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::transportRead(void* network, unsigned char* buf, int len)
 {
-    // get one piece of work off the wire and one pass through
-    int len = 0,
-        rc = SUCCESS;
+    return static_cast<Network*>(network)->read(buf, len, 0);
+}
 
-    int packet_type = readPacket(timer);    // read the socket, see what work is due
 
-    switch (packet_type)
+// a packet too big for the read buffer: its fixed header (fixedLen bytes) is in the read buffer, remLen bytes follow
+template<class Network, class Timer, int a, int b, class Arena>
+void MQTT::Client<Network, Timer, a, b, Arena>::startStream(int fixedLen, int remLen)
+{
+    stream.left = remLen;
+    stream.have = fixedLen;
+    stream.fixedLen = fixedLen;
+    stream.headerLen = ((arena.readbuf[0] >> 4) == PUBLISH) ? 0 : fixedLen;     // anything else is skipped
+    stream.total = 0;
+    stream.offset = 0;
+    stream.handler = -1;
+    stream.qos = QOS0;
+    stream.id = 0;
+}
+
+
+// length of the PUBLISH header (fixed header, topic, packet id, MQTT 5 properties) as far as the bytes
+// read so far tell - it is complete once that many bytes are in the read buffer
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::streamHeaderLen()
+{
+    unsigned char* buf = arena.readbuf;
+    int need = stream.fixedLen + 2;     // topic length
+
+    if (stream.have >= need)
+        need += ((buf[need - 2] << 8) | buf[need - 1]) + ((buf[0] & 0x06) ? 2 : 0);
+    if (mqttVersion == 5 && stream.have >= need)
     {
-        default:
-            // no more data to read, unrecoverable. Or read packet fails due to unexpected network error
-            rc = packet_type;
-            goto exit;
-        case 0: // timed out reading packet
-            break;
-        case CONNACK:
-        case PUBACK:
-        case SUBACK:
-            break;
-        case PUBLISH:
+        int i = need;
+        int multiplier = 1;
+        int proplen = 0;
+        do
         {
-            MQTTString topicName = MQTTString_initializer;
-            Message msg;
-            int intQoS;
-            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
-            if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                goto exit;
-            msg.qos = (enum QoS)intQoS;
-#if MQTTCLIENT_QOS2
-            if (msg.qos != QOS2)
-#endif
-                deliverMessage(topicName, msg);
-#if MQTTCLIENT_QOS2
-            else if (isQoS2msgidFree(msg.id))
-            {
-                if (useQoS2msgid(msg.id))
-                    deliverMessage(topicName, msg);
-                else
-                    WARN("Maximum number of incoming QoS2 messages exceeded");
-            }
-#endif
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-            if (msg.qos != QOS0)
+            if (i == stream.have)
+                return i + 1;           // more of the property length to come
+            proplen += (buf[i] & 127) * multiplier;
+            multiplier *= 128;
+        } while ((buf[i++] & 128) && i - need < 4);
+        need = i + proplen;
+    }
+    return need;
+}
+
+
+// read what has arrived of the packet started by startStream().  wait: read until the packet is complete,
+// or nothing arrives before the timer expires.  returns SUCCESS when the packet is complete (and acked), BUSY if (not waiting)
+// the rest hasn't arrived yet, FAILURE if the connection is gone
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::readStream(Timer& timer, bool wait)
+{
+    MQTTString topicName = MQTTString_initializer;
+    int rc, len = 0;
+
+    while (stream.left > 0)
+    {
+        unsigned char* buf;
+        int want;
+        if (stream.headerLen == 0)
+        {
+            int need = streamHeaderLen();
+            if (need >= Arena::READ_BUFFER_SIZE || need - stream.have > stream.left)
+                stream.headerLen = stream.have;     // no room for the header and a chunk (or malformed): skip it
+            else if (need <= stream.have)
             {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBACK, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREC, 0, msg.id);
-                if (len <= 0)
-                    rc = FAILURE;
-                else
-                    rc = sendPacket(len, timer);
-                if (rc == FAILURE)
-                    goto exit; // there was a problem
+                int handlers[MAX_MESSAGE_HANDLERS];
+                unsigned char* ptr = arena.readbuf + stream.fixedLen;
+                topicName.lenstring.len = readInt(&ptr);
+                topicName.lenstring.data = (char*)ptr;
+                stream.headerLen = need;
+                stream.total = stream.left;
+                stream.qos = (arena.readbuf[0] >> 1) & 0x03;
+                if (stream.qos != QOS0)
+                    stream.id = (ptr[topicName.lenstring.len] << 8) | ptr[topicName.lenstring.len + 1];
+                int count = topicTrie.match(topicName.lenstring.data, topicName.lenstring.len, handlers, MAX_MESSAGE_HANDLERS);
+                for (int i = 0; i < count && stream.handler < 0; ++i)
+                {
+                    if (messageHandlers[handlers[i]].sh)
+                        stream.handler = handlers[i];
+                }
             }
-            break;
-#endif
+            if (stream.headerLen > 0)
+                continue;
+            buf = arena.readbuf + stream.have;
+            want = need - stream.have;
+        }
+        else
+        {
+            // payload chunks go after the header, skipped bytes over it
+            buf = arena.readbuf + ((stream.handler >= 0) ? stream.headerLen : stream.fixedLen);
+            want = Arena::READ_BUFFER_SIZE - (buf - arena.readbuf);
+            if (want > stream.left)
+                want = stream.left;
         }
-#if MQTTCLIENT_QOS2
-        case PUBREC:
-        case PUBREL:
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE,
-                                 (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
-                rc = FAILURE;
-            else if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
-                rc = FAILURE; // there was a problem
-            if (rc == FAILURE)
-                goto exit; // there was a problem
-            if (packet_type == PUBREL)
-                freeQoS2msgid(mypacketid);
-            break;
 
-        case PUBCOMP:
-            break;
-#endif
-        case PINGRESP:
-            ping_outstanding = false;
-            break;
+        if ((rc = ipstack.read(buf, want, wait ? timer.left_ms() : 0)) < 0)
+            return FAILURE;
+        if (rc == 0)
+        {
+            if (!wait)
+                return BUSY;
+            if (timer.expired())
+                return FAILURE;
+            continue;
+        }
+        stream.left -= rc;
+        timer.countdown_ms(command_timeout_ms);     // still arriving, a long payload can take any time
+        if (this->keepAliveInterval > 0)
+            last_received.countdown(this->keepAliveInterval);
+        if (stream.headerLen == 0)
+            stream.have += rc;
+        else if (stream.handler >= 0 && messageHandlers[stream.handler].sh)
+        {
+            Message msg;
+            unsigned char* ptr = arena.readbuf + stream.fixedLen;
+            topicName.lenstring.len = readInt(&ptr);
+            topicName.lenstring.data = (char*)ptr;
+            msg.qos = (enum QoS)stream.qos;
+            msg.retained = arena.readbuf[0] & 0x01;
+            msg.dup = (arena.readbuf[0] & 0x08) != 0;
+            msg.id = stream.id;
+            msg.payload = buf;
+            msg.payloadlen = rc;
+            StreamData sd(topicName, msg, stream.offset, stream.total);
+            stream.offset += rc;
+            messageHandlers[stream.handler].sh(sd);
+        }
     }
 
-    if (keepalive() != SUCCESS)
-        //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
-        rc = FAILURE;
-
-exit:
-    if (rc == SUCCESS)
-        rc = packet_type;
-    else if (isconnected)
-        closeSession();
-    return rc;
+    if (stream.qos == QOS1)
+        len = MQTTSerialize_ack(arena.sendbuf, Arena::SEND_BUFFER_SIZE, PUBACK, 0, stream.id);
+#if MQTTCLIENT_QOS2
+    else if (stream.qos == QOS2)
+        len = MQTTSerialize_ack(arena.sendbuf, Arena::SEND_BUFFER_SIZE, PUBREC, 0, stream.id);
+#endif
+    return (len > 0) ? sendPacket(len, timer) : SUCCESS;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::poll()
 {
+    const int MAX_PACKETS_PER_POLL = 8;     // don't let a flood of incoming messages starve the caller
     int rc = SUCCESS;
-    static Timer ping_sent;
+    Timer timer(command_timeout_ms);        // for sending acks
 
-    if (keepAliveInterval == 0)
-        goto exit;
-    
-    if (ping_outstanding)
+    for (int n = 0; n < MAX_PACKETS_PER_POLL; ++n)
     {
-        if (ping_sent.expired())
+        int packet_type;
+        if (stream.left > 0)
         {
-            rc = FAILURE; // session failure
-            #if defined(MQTT_DEBUG)
-                DEBUG("PINGRESP not received in keepalive interval\r\n");
-            #endif
+            if ((rc = readStream(timer, false)) == BUSY)
+            {
+                rc = SUCCESS;   // the rest of the oversized packet hasn't arrived yet
+                break;
+            }
+            if (rc != SUCCESS)
+                break;
+            continue;
         }
-    }
-    else if (last_sent.expired() || last_received.expired())
-    {
-        Timer timer(1000);
-        int len = MQTTSerialize_pingreq(sendbuf, MAX_MQTT_PACKET_SIZE);
-        if (len > 0 && (rc = sendPacket(len, timer)) == SUCCESS) // send the ping packet
+        packet_type = MQTTPacket_readnb(arena.readbuf, Arena::READ_BUFFER_SIZE, &transport);
+        if (packet_type == 0)
+            break;      // nothing more has arrived, or only part of a packet (kept in transport)
+        if (packet_type == MQTTPACKET_BUFFER_TOO_SHORT)
         {
-            ping_outstanding = true;
-            ping_sent.countdown(this->keepAliveInterval);
+            startStream(transport.len, transport.rem_len);  // too big for the read buffer, read it in pieces
+            continue;
+        }
+        if (packet_type < 0)
+        {
+            rc = FAILURE;   // connection gone
+            break;
+        }
+        if (this->keepAliveInterval > 0)
+            last_received.countdown(this->keepAliveInterval); // record the fact that we have successfully received a packet
+        if ((rc = handlePacket(packet_type, timer)) != SUCCESS)
+        {
+            rc = FAILURE;
+            break;
         }
     }
-exit:
+
+    if (rc == SUCCESS && pendingCount > 0 && ackTimer.expired())
+        rc = FAILURE;   // nothing acked for command_timeout_ms, the broker is gone
+    if (rc == SUCCESS && (isconnected || pendingCount > 0) && keepalive() != SUCCESS)
+        rc = FAILURE;
+    if (rc != SUCCESS)
+        closeSession();     // fails the pending operations
     return rc;
 }
 
 
-// only used in single-threaded mode where one command at a time is in process
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::addPending(int packetType, unsigned short id, resultHandler rh)
 {
-    int rc = FAILURE;
+    // the caller has checked there is a free slot
+    for (int i = 0; i < MQTTCLIENT_MAX_PENDING; ++i)
+    {
+        if (pending[i].packetType == 0)
+        {
+            pending[i].packetType = packetType;
+            pending[i].id = id;
+            pending[i].rh = rh;
+            pending[i].topicFilter = 0;
+            pending[i].mh = 0;
+            if (pendingCount++ == 0)
+                ackTimer.countdown_ms(command_timeout_ms);
+            if (packetType == PUBLISH)
+                ++inflightPublishes;
+            return i;
+        }
+    }
+    return BUSY;
+}
 
-    do
+
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::findPending(int packetType, unsigned short id)
+{
+    for (int i = 0; i < MQTTCLIENT_MAX_PENDING; ++i)
     {
-        if (timer.expired())
-            break; // we timed out
-        rc = cycle(timer);
+        if (pending[i].packetType == packetType && pending[i].id == id)
+            return i;
     }
-    while (rc != packet_type && rc >= 0);
+    return -1;
+}
 
-    return rc;
+
+template<class Network, class Timer, int a, int b, class Arena>
+void MQTT::Client<Network, Timer, a, b, Arena>::completePending(int i, int rc, int value)
+{
+    ResultData result = {pending[i].packetType, pending[i].id, rc, value};
+    resultHandler rh = pending[i].rh;
+
+    // free the slot first, the result handler may start the next operation
+    if (pending[i].packetType == PUBLISH)
+        --inflightPublishes;
+    pending[i].packetType = 0;
+    --pendingCount;
+    ackTimer.countdown_ms(command_timeout_ms);  // the broker is alive, the rest get a fresh timeout
+    notifyResult(result, rh);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options, connackData& data)
+template<class Network, class Timer, int a, int b, class Arena>
+void MQTT::Client<Network, Timer, a, b, Arena>::notifyResult(ResultData& result, resultHandler rh)
+{
+    if (rh)
+        rh(result);
+    else if (defaultResultHandler.attached())
+        defaultResultHandler(result);
+}
+
+
+// send a started operation and hand it to poll(), a QoS 0 publish is complete once sent
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::sendStarted(int len, Timer& timer, int packetType, unsigned short id, resultHandler rh)
+{
+    int rc;
+
+    if (packetType == PUBLISH && id != 0 && !keepInflight(len, id))
+        return BUSY;    // the in-flight store is full, try again once poll() has seen an ack
+    if ((rc = sendPacket(len, timer)) != SUCCESS)
+    {
+        closeSession();
+        return rc;
+    }
+    if (packetType == PUBLISH && id == 0)
+    {
+        ResultData result = {PUBLISH, 0, SUCCESS, 0};
+        notifyResult(result, rh);
+        return SUCCESS;
+    }
+    addPending(packetType, id, rh);
+    return id;
+}
+
+
+// keep a copy of the QoS 1 or 2 publish in the send buffer for resending, if the session outlives the connection
+template<class Network, class Timer, int a, int b, class Arena>
+bool MQTT::Client<Network, Timer, a, b, Arena>::keepInflight(int len, unsigned short id)
+{
+    if (id == 0 || cleansession)
+        return true;
+    return arena.storeInflight(id, arena.sendbuf, len);
+}
+
+
+// resend the publishes kept from the last connection, with the DUP flag set.  wait: block for each ack,
+// otherwise they become pending operations (with the default result handler) completed by poll()
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::resendInflight(Timer& timer, bool wait)
+{
+    int rc = SUCCESS;
+    int count = arena.inflightCount();
+    int i = 0;
+
+    for (int n = 0; n < count && rc == SUCCESS; ++n)
+    {
+        unsigned short id;
+        int len = arena.getInflight(i, arena.sendbuf, Arena::SEND_BUFFER_SIZE, id);
+        if (len <= 0)
+            break;
+        arena.sendbuf[0] |= 0x08;   // DUP
+        if (wait)
+            rc = publish(len, timer, (enum QoS)((arena.sendbuf[0] >> 1) & 0x03), id);  // the ack releases it
+        else if (pendingCount == MQTTCLIENT_MAX_PENDING)
+            break;                  // the rest wait for the next connection
+        else if ((rc = sendPacket(len, timer)) == SUCCESS)
+            addPending(PUBLISH, id, 0);
+        if (arena.hasInflight(id))
+            ++i;
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, class Arena>
+void MQTT::Client<Network, Timer, a, b, Arena>::failPending()
+{
+    for (int i = 0; i < MQTTCLIENT_MAX_PENDING; ++i)
+    {
+        if (pending[i].packetType != 0)
+            completePending(i, FAILURE);
+    }
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::cycle(Timer& timer)
+{
+    // get one piece of work off the wire and one pass through
+    int rc = SUCCESS;
+
+    int packet_type = readPacket(timer);    // read the socket, see what work is due
+
+    if ((rc = handlePacket(packet_type, timer)) != SUCCESS)
+        goto exit;
+
+    if (keepalive() != SUCCESS)
+        //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
+        rc = FAILURE;
+
+exit:
+    if (rc == SUCCESS)
+        rc = packet_type;
+    else if (isconnected)
+        closeSession();
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::handlePacket(int packet_type, Timer& timer)
+{
+    int len = 0,
+        rc = SUCCESS;
+
+    switch (packet_type)
+    {
+        default:
+            // no more data to read, unrecoverable. Or read packet fails due to unexpected network error
+            rc = packet_type;
+            goto exit;
+        case 0: // timed out reading packet
+            break;
+        case CONNACK:
+        {
+            int i = findPending(CONNECT, 0);
+            if (i >= 0)     // startConnect
+            {
+                connackData data;
+                int connack_rc = readConnack(data);
+                if (connack_rc == SUCCESS)
+                {
+                    isconnected = true;
+                    ping_outstanding = false;
+                    rc = resendInflight(timer, false);
+                }
+                completePending(i, connack_rc, data.sessionPresent);
+            }
+            break;
+        }
+        case PUBACK:
+#if MQTTCLIENT_QOS2
+        case PUBCOMP:
+#endif
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            int i;
+            if (pendingCount == 0)
+                break;      // the blocking API reads its own acks
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+            {
+                rc = FAILURE;
+                break;
+            }
+            arena.releaseInflight(mypacketid);
+            if ((i = findPending(PUBLISH, mypacketid)) >= 0)
+                // an MQTT 5 ack longer than the packet id carries a reason code, 0x80 and up is a failure
+                completePending(i, (mqttVersion == 5 && arena.readbuf[1] > 2 && arena.readbuf[4] >= MQTTV5_REASON_UNSPECIFIED_ERROR) ? FAILURE : SUCCESS);
+            break;
+        }
+        case SUBACK:
+        {
+            subackData data;
+            unsigned short mypacketid;
+            int i;
+            if (pendingCount == 0)
+                break;
+            if (readSuback(data, mypacketid) != SUCCESS)
+                rc = FAILURE;
+            else if ((i = findPending(SUBSCRIBE, mypacketid)) >= 0)
+            {
+                int suback_rc = FAILURE;
+                if (data.grantedQoS < 0x80)
+                    suback_rc = setMessageHandler(pending[i].topicFilter, pending[i].mh);
+                completePending(i, suback_rc, data.grantedQoS);
+            }
+            break;
+        }
+        case UNSUBACK:
+        {
+            unsigned short mypacketid;
+            int i;
+            if (pendingCount == 0)
+                break;
+            if (MQTTDeserialize_unsuback(&mypacketid, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+                rc = FAILURE;
+            else if ((i = findPending(UNSUBSCRIBE, mypacketid)) >= 0)
+            {
+                setMessageHandler(pending[i].topicFilter, 0);
+                completePending(i, SUCCESS);
+            }
+            break;
+        }
+        case PUBLISH:
+        {
+            MQTTString topicName = MQTTString_initializer;
+            Message msg;
+            int intQoS;
+            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
+            if (mqttVersion == 5)
+            {
+                // we don't allow the broker topic aliases, so there are no properties we need
+                if (MQTTV5Deserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                                     0, (unsigned char**)&msg.payload, (int*)&msg.payloadlen, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+                    goto exit;
+            }
+            else if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+                goto exit;
+            msg.qos = (enum QoS)intQoS;
+#if MQTTCLIENT_QOS2
+            if (msg.qos != QOS2)
+#endif
+                deliverMessage(topicName, msg);
+#if MQTTCLIENT_QOS2
+            else if (isQoS2msgidFree(msg.id))
+            {
+                if (useQoS2msgid(msg.id))
+                    deliverMessage(topicName, msg);
+                else
+                    WARN("Maximum number of incoming QoS2 messages exceeded");
+            }
+#endif
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+            if (msg.qos != QOS0)
+            {
+                if (msg.qos == QOS1)
+                    len = MQTTSerialize_ack(arena.sendbuf, Arena::SEND_BUFFER_SIZE, PUBACK, 0, msg.id);
+                else if (msg.qos == QOS2)
+                    len = MQTTSerialize_ack(arena.sendbuf, Arena::SEND_BUFFER_SIZE, PUBREC, 0, msg.id);
+                if (len <= 0)
+                    rc = FAILURE;
+                else
+                    rc = sendPacket(len, timer);
+                if (rc == FAILURE)
+                    goto exit; // there was a problem
+            }
+            break;
+#endif
+        }
+#if MQTTCLIENT_QOS2
+        case PUBREC:
+        case PUBREL:
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+                rc = FAILURE;
+            else if ((len = MQTTSerialize_ack(arena.sendbuf, Arena::SEND_BUFFER_SIZE,
+                                 (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
+                rc = FAILURE;
+            else if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
+                rc = FAILURE; // there was a problem
+            if (rc == FAILURE)
+                goto exit; // there was a problem
+            if (packet_type == PUBREL)
+                freeQoS2msgid(mypacketid);
+            break;
+
+#endif
+        case PINGRESP:
+            ping_outstanding = false;
+            break;
+    }
+
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::keepalive()
+{
+    int rc = SUCCESS;
+
+    if (keepAliveInterval == 0)
+        goto exit;
+    
+    if (ping_outstanding)
+    {
+        if (ping_sent.expired())
+        {
+            rc = FAILURE; // session failure
+            #if defined(MQTT_DEBUG)
+                DEBUG("PINGRESP not received in command timeout\r\n");
+            #endif
+        }
+    }
+    else if (last_sent.expired() || last_received.expired())
+    {
+        Timer timer(1000);
+        int len = MQTTSerialize_pingreq(arena.sendbuf, Arena::SEND_BUFFER_SIZE);
+        if (len > 0 && (rc = sendPacket(len, timer)) == SUCCESS) // send the ping packet
+        {
+            ping_outstanding = true;
+            ping_sent.countdown_ms(command_timeout_ms);    // acked like any other packet, a silent broker is gone
+        }
+    }
+exit:
+    return rc;
+}
+
+
+// only used in single-threaded mode where one command at a time is in process
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::waitfor(int packet_type, Timer& timer)
+{
+    int rc = FAILURE;
+
+    do
+    {
+        if (timer.expired())
+            break; // we timed out
+        rc = cycle(timer);
+    }
+    while (rc != packet_type && rc >= 0);
+
+    return rc;
+}
+
+
+// wait for the ack of the publish with this packet id.  Acks of other publishes (resent ones, or those
+// poll() has already completed) are released as they arrive, and the wait goes on
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::waitforAck(int packet_type, unsigned short id, Timer& timer)
+{
+    unsigned short mypacketid;
+    unsigned char dup, type;
+
+    do
+    {
+        if (waitfor(packet_type, timer) != packet_type)
+            return FAILURE;
+        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, arena.readbuf, Arena::READ_BUFFER_SIZE) != 1)
+            return FAILURE;
+        arena.releaseInflight(mypacketid);
+    }
+    while (mypacketid != id);
+
+    return SUCCESS;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::serializeConnect(MQTTPacket_connectData& options)
+{
+    int len = 0;
+
+    this->keepAliveInterval = options.keepAliveInterval;
+    this->cleansession = options.cleansession;
+    this->mqttVersion = options.MQTTVersion;
+    serverReceiveMax = 65535;
+    serverMaxPacketSize = 0;
+#if MQTTCLIENT_TOPIC_ALIASES
+    serverTopicAliasMax = 0;
+    topicAliasCount = 0;    // aliases only live as long as the network connection
+#endif
+    if (mqttVersion == 5)
+    {
+        // tell the broker how big a packet we can take, it drops larger messages for us, unless larger
+        // ones are streamed: then there is no limit
+        bool streaming = false;
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+            streaming = streaming || (messageHandlers[i].topicFilter != 0 && messageHandlers[i].sh != 0);
+        MQTTProperty connect_props[1];
+        MQTTProperties props = {0, 1, connect_props};
+        if (!streaming)
+            MQTTProperties_add(&props, MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, Arena::READ_BUFFER_SIZE);
+        len = MQTTV5Serialize_connect(arena.sendbuf, Arena::SEND_BUFFER_SIZE, &options, &props, 0);
+    }
+    else
+        len = MQTTSerialize_connect(arena.sendbuf, Arena::SEND_BUFFER_SIZE, &options);
+    return len;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::readConnack(connackData& data)
+{
+    int rc = FAILURE;
+
+    data.rc = 0;
+    data.sessionPresent = false;
+    if (mqttVersion == 5)
+    {
+        MQTTProperty connack_props[12];
+        MQTTProperties props = {0, 12, connack_props};
+        unsigned char reasonCode = 0;
+        unsigned int value;
+        if (MQTTV5Deserialize_connack(&props, (unsigned char*)&data.sessionPresent, &reasonCode,
+                            arena.readbuf, Arena::READ_BUFFER_SIZE) == 1)
+        {
+            rc = data.rc = reasonCode;
+            if (MQTTProperties_get(&props, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, &value))
+                serverReceiveMax = value;
+            if (MQTTProperties_get(&props, MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, &value))
+                serverMaxPacketSize = value;
+#if MQTTCLIENT_TOPIC_ALIASES
+            if (MQTTProperties_get(&props, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, &value))
+                serverTopicAliasMax = value;
+#endif
+        }
+    }
+    else if (MQTTDeserialize_connack((unsigned char*)&data.sessionPresent,
+                        (unsigned char*)&data.rc, arena.readbuf, Arena::READ_BUFFER_SIZE) == 1)
+        rc = data.rc;
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::connect(MQTTPacket_connectData& options, connackData& data)
 {
     Timer connect_timer(command_timeout_ms);
     int rc = FAILURE;
@@ -737,9 +1498,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     if (isconnected) // don't send connect packet again if we are already connected
         goto exit;
 
-    this->keepAliveInterval = options.keepAliveInterval;
-    this->cleansession = options.cleansession;
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
+    transport.state = 0;    // a new network connection, drop any partly read packet of the old one
+    stream.left = 0;
+    if ((len = serializeConnect(options)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
@@ -748,36 +1509,12 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
         last_received.countdown(this->keepAliveInterval);
     // this will be a blocking call, wait for the connack
     if (waitfor(CONNACK, connect_timer) == CONNACK)
-    {
-        data.rc = 0;
-        data.sessionPresent = false;
-        if (MQTTDeserialize_connack((unsigned char*)&data.sessionPresent,
-                            (unsigned char*)&data.rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
-            rc = data.rc;
-        else
-            rc = FAILURE;
-    }
+        rc = readConnack(data);
     else
         rc = FAILURE;
 
-#if MQTTCLIENT_QOS2
-    // resend any inflight publish
-    if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
-    {
-        if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
-            rc = FAILURE;
-        else
-            rc = publish(len, connect_timer, inflightQoS);
-    }
-    else
-#endif
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (inflightMsgid > 0)
-    {
-        memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
-    }
-#endif
+    if (rc == SUCCESS)
+        rc = resendInflight(connect_timer, true);
 
 exit:
     if (rc == SUCCESS)
@@ -789,24 +1526,50 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::connect(MQTTPacket_connectData& options)
 {
     connackData data;
     return connect(options, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::connect()
 {
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     return connect(default_options);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::startConnect(MQTTPacket_connectData& options, resultHandler rh)
+{
+    Timer connect_timer(command_timeout_ms);
+    int rc = FAILURE;
+    int len = 0;
+
+    if (isconnected || findPending(CONNECT, 0) >= 0) // don't send connect packet again if we are already connected
+        goto exit;
+
+    transport.state = 0;    // a new network connection, drop any partly read packet of the old one
+    stream.left = 0;
+    if ((len = serializeConnect(options)) <= 0)
+        goto exit;
+    if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
+        goto exit; // there was a problem
+
+    if (this->keepAliveInterval > 0)
+        last_received.countdown(this->keepAliveInterval);
+    addPending(CONNECT, 0, rh);     // poll() completes it when the connack arrives
+
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
 {
     int rc = FAILURE;
     int i = -1;
@@ -818,8 +1581,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         {
             if (messageHandler == 0) // remove existing
             {
+                topicTrie.remove(topicFilter);
                 messageHandlers[i].topicFilter = 0;
                 messageHandlers[i].fp.detach();
+                messageHandlers[i].sh = 0;
             }
             rc = SUCCESS; // return i when adding new subscription
             break;
@@ -833,12 +1598,13 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
             {
                 if (messageHandlers[i].topicFilter == 0)
                 {
-                    rc = SUCCESS;
+                    rc = topicTrie.insert(topicFilter, i) ? SUCCESS : FAILURE;
+                    messageHandlers[i].sh = 0;
                     break;
                 }
             }
         }
-        if (i < MAX_MESSAGE_HANDLERS)
+        if (i < MAX_MESSAGE_HANDLERS && rc == SUCCESS)
         {
             messageHandlers[i].topicFilter = topicFilter;
             messageHandlers[i].fp.attach(messageHandler);
@@ -848,8 +1614,23 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter,
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Arena>::setStreamHandler(const char* topicFilter, streamHandler sh)
+{
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter != 0 && strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
+        {
+            messageHandlers[i].sh = sh;
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::subscribe(const char* topicFilter,
      enum QoS qos, messageHandler messageHandler, subackData& data)
 {
     int rc = FAILURE;
@@ -860,7 +1641,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
     if (!isconnected)
         goto exit;
 
-    len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_subscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, packetid.getNext(), 0, 1, &topic, (int*)&qos);
+    else
+        len = MQTTSerialize_subscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the subscribe packet
@@ -868,14 +1652,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
 
     if (waitfor(SUBACK, timer) == SUBACK)      // wait for suback
     {
-        int count = 0;
         unsigned short mypacketid;
-        data.grantedQoS = 0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
-        {
-            if (data.grantedQoS != 0x80)
-                rc = setMessageHandler(topicFilter, messageHandler);
-        }
+        if (readSuback(data, mypacketid) == SUCCESS && data.grantedQoS < 0x80)
+            rc = setMessageHandler(topicFilter, messageHandler);
     }
     else
         rc = FAILURE;
@@ -887,16 +1666,72 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+// the granted QoS is 0x80 or more (MQTT 5 reason code) if the subscription was refused
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::readSuback(subackData& data, unsigned short& mypacketid)
+{
+    int count = 0;
+    int rc;
+
+    data.grantedQoS = 0;
+    if (mqttVersion == 5)
+        rc = MQTTV5Deserialize_suback(&mypacketid, 0, 1, &count, &data.grantedQoS, arena.readbuf, Arena::READ_BUFFER_SIZE);
+    else
+        rc = MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, arena.readbuf, Arena::READ_BUFFER_SIZE);
+    return (rc == 1) ? SUCCESS : FAILURE;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
 {
     subackData data;
     return subscribe(topicFilter, qos, messageHandler, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribe(const char* topicFilter)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::startSubscribe(const char* topicFilter,
+     enum QoS qos, messageHandler messageHandler, resultHandler rh)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    int len = 0;
+    int i;
+    unsigned short id;
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
+
+    if (!isconnected)
+        goto exit;
+    if (pendingCount == MQTTCLIENT_MAX_PENDING)
+    {
+        rc = BUSY;
+        goto exit;
+    }
+
+    id = packetid.getNext();
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_subscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, id, 0, 1, &topic, (int*)&qos);
+    else
+        len = MQTTSerialize_subscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, id, 1, &topic, (int*)&qos);
+    if (len <= 0)
+        goto exit;
+    if ((rc = sendStarted(len, timer, SUBSCRIBE, id, rh)) > 0)
+    {
+        i = findPending(SUBSCRIBE, id);     // the message handler is set when the suback arrives
+        pending[i].topicFilter = topicFilter;
+        pending[i].mh = messageHandler;
+    }
+
+exit:
+    if (rc == FAILURE)
+        closeSession();
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::unsubscribe(const char* topicFilter)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
@@ -906,7 +1741,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (!isconnected)
         goto exit;
 
-    if ((len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic)) <= 0)
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_unsubscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, packetid.getNext(), 0, 1, &topic);
+    else
+        len = MQTTSerialize_unsubscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, packetid.getNext(), 1, &topic);
+    if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
@@ -914,7 +1753,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (waitfor(UNSUBACK, timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_unsuback(&mypacketid, arena.readbuf, Arena::READ_BUFFER_SIZE) == 1)
         {
             // remove the subscription message handler associated with this topic, if there is one
             setMessageHandler(topicFilter, 0);
@@ -930,8 +1769,42 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Arena>::startUnsubscribe(const char* topicFilter, resultHandler rh)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
+    unsigned short id;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+    if (pendingCount == MQTTCLIENT_MAX_PENDING)
+    {
+        rc = BUSY;
+        goto exit;
+    }
+
+    id = packetid.getNext();
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_unsubscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, id, 0, 1, &topic);
+    else
+        len = MQTTSerialize_unsubscribe(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, id, 1, &topic);
+    if (len <= 0)
+        goto exit;
+    if ((rc = sendStarted(len, timer, UNSUBSCRIBE, id, rh)) > 0)
+        pending[findPending(UNSUBSCRIBE, id)].topicFilter = topicFilter;   // the handler goes when the unsuback arrives
+
+exit:
+    if (rc == FAILURE)
+        closeSession();
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::publish(int len, Timer& timer, enum QoS qos, unsigned short id)
 {
     int rc;
 
@@ -940,35 +1813,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
 
 #if MQTTCLIENT_QOS1
     if (qos == QOS1)
-    {
-        if (waitfor(PUBACK, timer) == PUBACK)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
-        }
-        else
-            rc = FAILURE;
-    }
+        rc = waitforAck(PUBACK, id, timer);
 #endif
 #if MQTTCLIENT_QOS2
     else if (qos == QOS2)
-    {
-        if (waitfor(PUBCOMP, timer) == PUBCOMP)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
-        }
-        else
-            rc = FAILURE;
-    }
+        rc = waitforAck(PUBCOMP, id, timer);
 #endif
 
 exit:
@@ -979,8 +1828,8 @@ exit:
 
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
@@ -997,51 +1846,246 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
         id = packetid.getNext();
 #endif
 
-    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
-              topicString, (unsigned char*)payload, payloadlen);
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_publish(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, qos, retained, id,
+                  topicString, 0, (unsigned char*)payload, payloadlen);
+    else
+        len = MQTTSerialize_publish(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, qos, retained, id,
+                  topicString, (unsigned char*)payload, payloadlen);
     if (len <= 0)
         goto exit;
+    if (serverMaxPacketSize && (unsigned int)len > serverMaxPacketSize)
+    {
+        rc = BUFFER_OVERFLOW;   // the broker would disconnect us for it
+        goto exit;
+    }
+
+    if (!keepInflight(len, id))
+    {
+        rc = BUFFER_OVERFLOW;   // no room to keep it for resending
+        goto exit;
+    }
+
+    rc = publish(len, timer, qos, id);
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, class Arena>
+int MQTT::Client<Network, Timer, a, b, Arena>::findTopicAlias(const void* topic)
+{
+#if MQTTCLIENT_TOPIC_ALIASES
+    for (int i = 0; i < topicAliasCount; ++i)
+    {
+        if (topicAliases[i] == topic)
+            return i + 1;
+    }
+#endif
+    return 0;
+}
+
+
+// write a PUBLISH to a precompiled topic into the send buffer, returns its length or BUFFER_OVERFLOW
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+template<int MAX_TOPIC_LEN>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::serializePublish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen, unsigned short id)
+{
+    enum QoS qos = topic.qos();
+    unsigned short alias = 0;
+    bool sendTopic = true;
+    bool newAlias = false;
+    int rem_len = payloadlen;
+    int len = 0;
+    unsigned char* ptr = arena.sendbuf;
+
+    if (qos > QOS0)
+        rem_len += 2;
+
+#if MQTTCLIENT_TOPIC_ALIASES
+    if (mqttVersion == 5)
+    {
+        if ((alias = findTopicAlias(&topic)) != 0)
+            // a publish kept for resending must still make sense on a new connection, where the alias is unknown
+            sendTopic = (qos != QOS0 && !cleansession);
+        else if (topicAliasCount < serverTopicAliasMax && topicAliasCount < MQTTCLIENT_TOPIC_ALIASES)
+        {
+            alias = topicAliasCount + 1;    // send the topic with a new alias, from now on the alias is enough
+            newAlias = true;
+        }
+    }
+#endif
+    rem_len += sendTopic ? topic.len - 1 : 2;
+    if (mqttVersion == 5)
+        rem_len += alias ? 4 : 1;   // property length, topic alias property
+
+    len = MQTTPacket_len(rem_len);
+    if (len > Arena::SEND_BUFFER_SIZE || (serverMaxPacketSize && (unsigned int)len > serverMaxPacketSize))
+        return BUFFER_OVERFLOW;
+    *ptr++ = topic.data[0];
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    if (sendTopic)
+    {
+        memcpy(ptr, &topic.data[1], topic.len - 1);
+        ptr += topic.len - 1;
+    }
+    else
+        writeInt(&ptr, 0);      // zero length topic, the alias stands in for it
+    if (qos > QOS0)
+        writeInt(&ptr, id);
+    if (mqttVersion == 5)
+    {
+        if (alias)
+        {
+            writeChar(&ptr, 3);
+            writeChar(&ptr, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+            writeInt(&ptr, alias);
+        }
+        else
+            writeChar(&ptr, 0);
+    }
+    memcpy(ptr, payload, payloadlen);
+#if MQTTCLIENT_TOPIC_ALIASES
+    if (newAlias)
+        topicAliases[topicAliasCount++] = &topic;
+#endif
+    return len;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+template<int MAX_TOPIC_LEN>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::publish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    enum QoS qos = topic.qos();
+    unsigned short id = 0;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (!cleansession)
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
+#endif
+
+    if ((len = serializePublish(topic, payload, payloadlen, id)) < 0)
     {
-        memcpy(pubbuf, sendbuf, len);
-        inflightMsgid = id;
-        inflightLen = len;
-        inflightQoS = qos;
-#if MQTTCLIENT_QOS2
-        pubrel = false;
+        rc = len;
+        goto exit;
+    }
+
+    if (!keepInflight(len, id))
+    {
+        rc = BUFFER_OVERFLOW;   // no room to keep it for resending
+        goto exit;
+    }
+
+    rc = publish(len, timer, qos, id);
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+template<int MAX_TOPIC_LEN>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::startPublish(const PublishTopic<MAX_TOPIC_LEN>& topic, const void* payload, size_t payloadlen, resultHandler rh)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    enum QoS qos = topic.qos();
+    unsigned short id = 0;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+    if (qos != QOS0 && (pendingCount == MQTTCLIENT_MAX_PENDING || inflightPublishes >= serverReceiveMax))
+    {
+        rc = BUSY;      // try again once poll() has seen an ack
+        goto exit;
+    }
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
 #endif
+
+    if ((len = serializePublish(topic, payload, payloadlen, id)) < 0)
+    {
+        rc = len;
+        goto exit;
+    }
+    rc = sendStarted(len, timer, PUBLISH, id, rh);     // poll() completes it when the PUBACK/PUBCOMP arrives
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::startPublish(const char* topicName, Message& message, resultHandler rh)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    MQTTString topicString = MQTTString_initializer;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+    if (message.qos != QOS0 && (pendingCount == MQTTCLIENT_MAX_PENDING || inflightPublishes >= serverReceiveMax))
+    {
+        rc = BUSY;
+        goto exit;
     }
+
+    topicString.cstring = (char*)topicName;
+    message.id = 0;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (message.qos == QOS1 || message.qos == QOS2)
+        message.id = packetid.getNext();
 #endif
 
-    rc = publish(len, timer, qos);
+    if (mqttVersion == 5)
+        len = MQTTV5Serialize_publish(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, message.qos, message.retained, message.id,
+                  topicString, 0, (unsigned char*)message.payload, message.payloadlen);
+    else
+        len = MQTTSerialize_publish(arena.sendbuf, Arena::SEND_BUFFER_SIZE, 0, message.qos, message.retained, message.id,
+                  topicString, (unsigned char*)message.payload, message.payloadlen);
+    if (len <= 0)
+        goto exit;
+    if (serverMaxPacketSize && (unsigned int)len > serverMaxPacketSize)
+    {
+        rc = BUFFER_OVERFLOW;   // the broker would disconnect us for it
+        goto exit;
+    }
+    rc = sendStarted(len, timer, PUBLISH, message.id, rh);
 exit:
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
     unsigned short id = 0;  // dummy - not used for anything
     return publish(topicName, payload, payloadlen, id, qos, retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, Message& message)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::publish(const char* topicName, Message& message)
 {
     return publish(topicName, message.payload, message.payloadlen, message.qos, message.retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::disconnect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Arena>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Arena>::disconnect()
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
-    int len = MQTTSerialize_disconnect(sendbuf, MAX_MQTT_PACKET_SIZE);
+    int len = MQTTSerialize_disconnect(arena.sendbuf, Arena::SEND_BUFFER_SIZE);
     if (len > 0)
         rc = sendPacket(len, timer);            // send the disconnect packet
     closeSession();
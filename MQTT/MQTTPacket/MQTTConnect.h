@@ -144,6 +144,7 @@ DLLExport int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned ch
 
 DLLExport int MQTTSerialize_disconnect(unsigned char* buf, int buflen);
 DLLExport int MQTTSerialize_pingreq(unsigned char* buf, int buflen);
+DLLExport int MQTTSerialize_pingresp(unsigned char* buf, int buflen);
 
 #endif /* MQTTCONNECT_H_ */
 
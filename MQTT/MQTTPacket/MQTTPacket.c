@@ -356,8 +356,8 @@ exit:
  * @param buf the buffer into which the packet will be serialized
  * @param buflen the length in bytes of the supplied buffer
  * @param trp pointer to a transport structure holding what is needed to solve getting data from it
- * @return integer MQTT packet type, 0 for call again, or -1 on error
- * @note  the whole message must fit into the caller's buffer
+ * @return integer MQTT packet type, 0 for call again, -1 on error, or MQTTPACKET_BUFFER_TOO_SHORT if
+ * the packet doesn't fit the caller's buffer (the caller can read the trp->rem_len bytes left itself)
  */
 int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 {
@@ -385,7 +385,10 @@ int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 			return 0;
 		trp->len = 1 + MQTTPacket_encode(buf + 1, trp->rem_len); /* put the original remaining length back into the buffer */
 		if((trp->rem_len + trp->len) > buflen)
+		{
+			rc = MQTTPACKET_BUFFER_TOO_SHORT; /* header and remaining length are in buf, the rest is unread */
 			goto exit;
+		}
 		++trp->state;
 		/*FALLTHROUGH*/
 	case 2:
@@ -0,0 +1,273 @@
+/*******************************************************************************
+ * MQTT 5 properties
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "MQTTProperties.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+
+/**
+  * Returns the wire type of a property
+  * @param identifier the property identifier, one of MQTTPropertyCodes
+  * @return one of MQTTPropertyTypes, MQTTPROPERTY_TYPE_UNKNOWN if the identifier isn't valid
+  */
+int MQTTProperty_getType(int identifier)
+{
+	switch (identifier)
+	{
+	case MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR:
+	case MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION:
+	case MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION:
+	case MQTTPROPERTY_CODE_MAXIMUM_QOS:
+	case MQTTPROPERTY_CODE_RETAIN_AVAILABLE:
+	case MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE:
+	case MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE:
+	case MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE:
+		return MQTTPROPERTY_TYPE_BYTE;
+	case MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE:
+	case MQTTPROPERTY_CODE_RECEIVE_MAXIMUM:
+	case MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM:
+	case MQTTPROPERTY_CODE_TOPIC_ALIAS:
+		return MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL:
+	case MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL:
+	case MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL:
+	case MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE:
+		return MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER:
+		return MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_CORRELATION_DATA:
+	case MQTTPROPERTY_CODE_AUTHENTICATION_DATA:
+		return MQTTPROPERTY_TYPE_BINARY_DATA;
+	case MQTTPROPERTY_CODE_CONTENT_TYPE:
+	case MQTTPROPERTY_CODE_RESPONSE_TOPIC:
+	case MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER:
+	case MQTTPROPERTY_CODE_AUTHENTICATION_METHOD:
+	case MQTTPROPERTY_CODE_RESPONSE_INFORMATION:
+	case MQTTPROPERTY_CODE_SERVER_REFERENCE:
+	case MQTTPROPERTY_CODE_REASON_STRING:
+		return MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING;
+	case MQTTPROPERTY_CODE_USER_PROPERTY:
+		return MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR;
+	}
+	return MQTTPROPERTY_TYPE_UNKNOWN;
+}
+
+
+/**
+  * Number of bytes a variable byte integer takes on the wire
+  * @param rem_len the value to be encoded
+  * @return the length of the encoding, 1 to 4
+  */
+int MQTTPacket_VBIlen(int rem_len)
+{
+	if (rem_len < 128)
+		return 1;
+	else if (rem_len < 16384)
+		return 2;
+	else if (rem_len < 2097152)
+		return 3;
+	return 4;
+}
+
+
+static int MQTTProperty_len(MQTTProperty* prop)
+{
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+	case MQTTPROPERTY_TYPE_BYTE:
+		return 1;
+	case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+		return 2;
+	case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+		return 4;
+	case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+		return MQTTPacket_VBIlen(prop->value);
+	}
+	return 0;
+}
+
+
+/**
+  * Length of the properties on the wire, not including the property length field itself
+  * @param props the property list, may be NULL for no properties
+  * @return the length in bytes
+  */
+int MQTTProperties_len(MQTTProperties* props)
+{
+	int i, len = 0;
+
+	if (props)
+		for (i = 0; i < props->count; ++i)
+			len += 1 + MQTTProperty_len(&props->array[i]);
+	return len;
+}
+
+
+/**
+  * Adds an integer valued property to a list
+  * @param props the property list
+  * @param identifier the property identifier, one of MQTTPropertyCodes
+  * @param value the value
+  * @return 0 on success, -1 if the list is full or the property isn't integer valued
+  */
+int MQTTProperties_add(MQTTProperties* props, int identifier, unsigned int value)
+{
+	int type = MQTTProperty_getType(identifier);
+
+	if (props->count >= props->max_count || type < MQTTPROPERTY_TYPE_BYTE || type > MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER)
+		return -1;
+	props->array[props->count].identifier = (unsigned char)identifier;
+	props->array[props->count].value = value;
+	props->count++;
+	return 0;
+}
+
+
+/**
+  * Looks up a property in a list
+  * @param props the property list
+  * @param identifier the property identifier, one of MQTTPropertyCodes
+  * @param value returned value of the property, untouched if not present
+  * @return 1 if the property is present, 0 if not
+  */
+int MQTTProperties_get(MQTTProperties* props, int identifier, unsigned int* value)
+{
+	int i;
+
+	for (i = 0; i < props->count; ++i)
+	{
+		if (props->array[i].identifier == identifier)
+		{
+			*value = props->array[i].value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+  * Writes the property length and the properties to an output buffer
+  * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
+  * @param props the property list, may be NULL for no properties
+  * @return the number of bytes written
+  */
+int MQTTProperties_write(unsigned char** pptr, MQTTProperties* props)
+{
+	unsigned char* start = *pptr;
+	int i;
+
+	*pptr += MQTTPacket_encode(*pptr, MQTTProperties_len(props));
+	if (props)
+	{
+		for (i = 0; i < props->count; ++i)
+		{
+			MQTTProperty* prop = &props->array[i];
+
+			writeChar(pptr, prop->identifier);
+			switch (MQTTProperty_getType(prop->identifier))
+			{
+			case MQTTPROPERTY_TYPE_BYTE:
+				writeChar(pptr, (char)prop->value);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				writeInt(pptr, prop->value);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				writeInt(pptr, prop->value >> 16);
+				writeInt(pptr, prop->value & 0xFFFF);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				*pptr += MQTTPacket_encode(*pptr, prop->value);
+				break;
+			}
+		}
+	}
+	return *pptr - start;
+}
+
+
+/**
+  * Reads the property length and the properties from an input buffer.  Integer valued
+  * properties are added to the list (as far as it has room), the others are skipped.
+  * @param props the property list to fill, may be NULL to skip all properties
+  * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+  * @param enddata pointer to the end of the data: do not read beyond
+  * @return 1 if successful, 0 if the properties are malformed
+  */
+int MQTTProperties_read(MQTTProperties* props, unsigned char** pptr, unsigned char* enddata)
+{
+	unsigned char* propend;
+	int len = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (props)
+		props->count = 0;
+	if (enddata - *pptr < 1)
+		goto exit;
+	*pptr += MQTTPacket_decodeBuf(*pptr, &len);
+	propend = *pptr + len;
+	if (propend > enddata)
+		goto exit;
+
+	while (*pptr < propend)
+	{
+		int identifier = (unsigned char)readChar(pptr);
+		unsigned int value = 0;
+		int vlen = 0;
+
+		switch (MQTTProperty_getType(identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			if (propend - *pptr < 1)
+				goto exit;
+			value = (unsigned char)readChar(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			if (propend - *pptr < 2)
+				goto exit;
+			value = readInt(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			if (propend - *pptr < 4)
+				goto exit;
+			value = (unsigned int)readInt(pptr) << 16;
+			value |= readInt(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			*pptr += MQTTPacket_decodeBuf(*pptr, &vlen);
+			value = vlen;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			if (propend - *pptr < 2)
+				goto exit;
+			vlen = readInt(pptr);
+			if (propend - *pptr < vlen)
+				goto exit;
+			*pptr += vlen;
+			/* FALLTHROUGH - the value is the second string */
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			if (propend - *pptr < 2)
+				goto exit;
+			vlen = readInt(pptr);
+			if (propend - *pptr < vlen)
+				goto exit;
+			*pptr += vlen;
+			continue;
+		default:
+			goto exit;
+		}
+		if (props)
+			MQTTProperties_add(props, identifier, value);
+	}
+	rc = (*pptr == propend);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
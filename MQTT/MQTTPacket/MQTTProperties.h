@@ -0,0 +1,88 @@
+/*******************************************************************************
+ * MQTT 5 properties
+ *
+ * Only the integer valued properties (byte, two byte, four byte and variable
+ * byte integer) are held in an MQTTProperties list.  String, binary and user
+ * properties are checked and skipped when read and cannot be written.
+ *******************************************************************************/
+
+#ifndef MQTTPROPERTIES_H_
+#define MQTTPROPERTIES_H_
+
+#if defined(__cplusplus) /* If this is a C++ compiler, use C linkage */
+extern "C" {
+#endif
+
+enum MQTTPropertyCodes
+{
+	MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR = 1,
+	MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL = 2,
+	MQTTPROPERTY_CODE_CONTENT_TYPE = 3,
+	MQTTPROPERTY_CODE_RESPONSE_TOPIC = 8,
+	MQTTPROPERTY_CODE_CORRELATION_DATA = 9,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER = 11,
+	MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL = 17,
+	MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER = 18,
+	MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE = 19,
+	MQTTPROPERTY_CODE_AUTHENTICATION_METHOD = 21,
+	MQTTPROPERTY_CODE_AUTHENTICATION_DATA = 22,
+	MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION = 23,
+	MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL = 24,
+	MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION = 25,
+	MQTTPROPERTY_CODE_RESPONSE_INFORMATION = 26,
+	MQTTPROPERTY_CODE_SERVER_REFERENCE = 28,
+	MQTTPROPERTY_CODE_REASON_STRING = 31,
+	MQTTPROPERTY_CODE_RECEIVE_MAXIMUM = 33,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM = 34,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS = 35,
+	MQTTPROPERTY_CODE_MAXIMUM_QOS = 36,
+	MQTTPROPERTY_CODE_RETAIN_AVAILABLE = 37,
+	MQTTPROPERTY_CODE_USER_PROPERTY = 38,
+	MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE = 39,
+	MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE = 40,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE = 41,
+	MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE = 42
+};
+
+enum MQTTPropertyTypes
+{
+	MQTTPROPERTY_TYPE_BYTE,
+	MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_BINARY_DATA,
+	MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING,
+	MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR,
+	MQTTPROPERTY_TYPE_UNKNOWN = -1
+};
+
+typedef struct
+{
+	unsigned char identifier; /**< one of MQTTPropertyCodes */
+	unsigned int value;       /**< integer value of the property */
+} MQTTProperty;
+
+typedef struct
+{
+	int count;          /**< number of properties in the array */
+	int max_count;      /**< size of the array */
+	MQTTProperty* array;
+} MQTTProperties;
+
+#define MQTTProperties_initializer {0, 0, NULL}
+
+int MQTTProperty_getType(int identifier);
+
+int MQTTProperties_len(MQTTProperties* props);
+int MQTTProperties_add(MQTTProperties* props, int identifier, unsigned int value);
+int MQTTProperties_get(MQTTProperties* props, int identifier, unsigned int* value);
+int MQTTProperties_write(unsigned char** pptr, MQTTProperties* props);
+int MQTTProperties_read(MQTTProperties* props, unsigned char** pptr, unsigned char* enddata);
+
+int MQTTPacket_VBIlen(int rem_len);
+
+#ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
+}
+#endif
+
+#endif /* MQTTPROPERTIES_H_ */
@@ -0,0 +1,426 @@
+/*******************************************************************************
+ * MQTT 5 serialization of the packets whose layout differs from MQTT 3.1.1
+ *******************************************************************************/
+
+#include "MQTTV5Packet.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+
+static int MQTTV5_propertiesLength(MQTTProperties* props)
+{
+	int len = MQTTProperties_len(props);
+
+	return MQTTPacket_VBIlen(len) + len;
+}
+
+
+/**
+  * Determines the length of the MQTT 5 connect packet that would be produced using the supplied options
+  * @param options the options to be used to build the connect packet
+  * @param connectProperties the connect properties, may be NULL
+  * @param willProperties the will properties, may be NULL
+  * @return the length of buffer needed to contain the serialized version of the packet
+  */
+int MQTTV5Serialize_connectLength(MQTTPacket_connectData* options, MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	int len = 10; /* "MQTT", protocol level, flags, keepalive */
+
+	FUNC_ENTRY;
+	len += MQTTV5_propertiesLength(connectProperties);
+	len += MQTTstrlen(options->clientID)+2;
+	if (options->willFlag)
+		len += MQTTV5_propertiesLength(willProperties) + MQTTstrlen(options->will.topicName)+2 + MQTTstrlen(options->will.message)+2;
+	if (options->username.cstring || options->username.lenstring.data)
+		len += MQTTstrlen(options->username)+2;
+	if (options->password.cstring || options->password.lenstring.data)
+		len += MQTTstrlen(options->password)+2;
+
+	FUNC_EXIT_RC(len);
+	return len;
+}
+
+
+/**
+  * Serializes the connect options into the buffer as an MQTT 5 connect packet.
+  * options->MQTTVersion is ignored.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param options the options to be used to build the connect packet
+  * @param connectProperties the connect properties, may be NULL
+  * @param willProperties the will properties, may be NULL
+  * @return serialized length, or error if 0
+  */
+int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	MQTTConnectFlags flags = {0};
+	int len = 0;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	if (MQTTPacket_len(len = MQTTV5Serialize_connectLength(options, connectProperties, willProperties)) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.byte = 0;
+	header.bits.type = CONNECT;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, len); /* write remaining length */
+
+	writeCString(&ptr, "MQTT");
+	writeChar(&ptr, (char) 5);
+
+	flags.all = 0;
+	flags.bits.cleansession = options->cleansession;
+	flags.bits.will = (options->willFlag) ? 1 : 0;
+	if (flags.bits.will)
+	{
+		flags.bits.willQoS = options->will.qos;
+		flags.bits.willRetain = options->will.retained;
+	}
+
+	if (options->username.cstring || options->username.lenstring.data)
+		flags.bits.username = 1;
+	if (options->password.cstring || options->password.lenstring.data)
+		flags.bits.password = 1;
+
+	writeChar(&ptr, flags.all);
+	writeInt(&ptr, options->keepAliveInterval);
+	MQTTProperties_write(&ptr, connectProperties);
+	writeMQTTString(&ptr, options->clientID);
+	if (options->willFlag)
+	{
+		MQTTProperties_write(&ptr, willProperties);
+		writeMQTTString(&ptr, options->will.topicName);
+		writeMQTTString(&ptr, options->will.message);
+	}
+	if (flags.bits.username)
+		writeMQTTString(&ptr, options->username);
+	if (flags.bits.password)
+		writeMQTTString(&ptr, options->password);
+
+	rc = ptr - buf;
+
+	exit: FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into MQTT 5 connack data
+  * @param connackProperties returned connack properties, may be NULL to skip them
+  * @param sessionPresent the session present flag returned
+  * @param reasonCode returned reason code, 0 is success
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent,
+		unsigned char* reasonCode, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+	MQTTConnackFlags flags = {0};
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != CONNACK)
+		goto exit;
+
+	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	enddata = curdata + mylen;
+	rc = 0;
+	if (enddata - curdata < 2)
+		goto exit;
+
+	flags.all = readChar(&curdata);
+	*sessionPresent = flags.bits.sessionpresent;
+	*reasonCode = readChar(&curdata);
+
+	if (enddata > curdata && !MQTTProperties_read(connackProperties, &curdata, enddata))
+		goto exit;
+
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied publish data into the supplied buffer as an MQTT 5 publish packet
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish, empty when a topic alias is used
+  * @param properties the publish properties (eg: topic alias), may be NULL
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, MQTTProperties* properties, unsigned char* payload, int payloadlen)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	rem_len = 2 + MQTTstrlen(topicName) + MQTTV5_propertiesLength(properties) + payloadlen;
+	if (qos > 0)
+		rem_len += 2; /* packetid */
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeMQTTString(&ptr, topicName);
+
+	if (qos > 0)
+		writeInt(&ptr, packetid);
+
+	MQTTProperties_write(&ptr, properties);
+
+	memcpy(ptr, payload, payloadlen);
+	ptr += payloadlen;
+
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into MQTT 5 publish data
+  * @param dup returned integer - the MQTT dup flag
+  * @param qos returned integer - the MQTT QoS value
+  * @param retained returned integer - the MQTT retained flag
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param topicName returned MQTTString - the MQTT topic in the publish
+  * @param properties returned publish properties, may be NULL to skip them
+  * @param payload returned byte buffer - the MQTT publish payload
+  * @param payloadlen returned integer - the length of the MQTT payload
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success
+  */
+int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid,
+		MQTTString* topicName, MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen = 0;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != PUBLISH)
+		goto exit;
+	*dup = header.bits.dup;
+	*qos = header.bits.qos;
+	*retained = header.bits.retain;
+
+	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	enddata = curdata + mylen;
+	rc = 0;
+
+	if (!readMQTTLenString(topicName, &curdata, enddata) ||
+		enddata - curdata < ((*qos > 0) ? 3 : 1)) /* packetid and property length */
+		goto exit;
+
+	if (*qos > 0)
+		*packetid = readInt(&curdata);
+
+	if (!MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	*payloadlen = enddata - curdata;
+	*payload = curdata;
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied subscribe data into the supplied buffer as an MQTT 5 subscribe packet
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties the subscribe properties, may be NULL
+  * @param count - number of members in the topicFilters and options arrays
+  * @param topicFilters - array of topic filter names
+  * @param options - array of subscription options (bits 0-1 are the requested QoS)
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int options[])
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 2 + MQTTV5_propertiesLength(properties); /* packetid, properties */
+	int rc = 0;
+	int i = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+		rem_len += 2 + MQTTstrlen(topicFilters[i]) + 1; /* length + topic + options */
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.byte = 0;
+	header.bits.type = SUBSCRIBE;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeInt(&ptr, packetid);
+	MQTTProperties_write(&ptr, properties);
+
+	for (i = 0; i < count; ++i)
+	{
+		writeMQTTString(&ptr, topicFilters[i]);
+		writeChar(&ptr, options[i]);
+	}
+
+	rc = ptr - buf;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into MQTT 5 suback data
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param properties returned suback properties, may be NULL to skip them
+  * @param maxcount - the maximum number of members allowed in the reasonCodes array
+  * @param count returned integer - number of members in the reasonCodes array
+  * @param reasonCodes returned array of integers - granted QoS, or >= 0x80 for failure
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count,
+		int reasonCodes[], unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != SUBACK)
+		goto exit;
+
+	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	enddata = curdata + mylen;
+	rc = 0;
+	if (enddata - curdata < 3)
+		goto exit;
+
+	*packetid = readInt(&curdata);
+	if (!MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	*count = 0;
+	while (curdata < enddata)
+	{
+		if (*count >= maxcount)
+		{
+			rc = -1;
+			goto exit;
+		}
+		reasonCodes[(*count)++] = (unsigned char)readChar(&curdata);
+	}
+
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied unsubscribe data into the supplied buffer as an MQTT 5 unsubscribe packet
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties the unsubscribe properties, may be NULL
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[])
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 2 + MQTTV5_propertiesLength(properties); /* packetid, properties */
+	int rc = -1;
+	int i = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+		rem_len += 2 + MQTTstrlen(topicFilters[i]); /* length + topic*/
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.byte = 0;
+	header.bits.type = UNSUBSCRIBE;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeInt(&ptr, packetid);
+	MQTTProperties_write(&ptr, properties);
+
+	for (i = 0; i < count; ++i)
+		writeMQTTString(&ptr, topicFilters[i]);
+
+	rc = ptr - buf;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * MQTT 5 serialization of the packets whose layout differs from MQTT 3.1.1
+ *
+ * CONNECT, CONNACK, PUBLISH, SUBSCRIBE, SUBACK and UNSUBSCRIBE carry properties in
+ * MQTT 5.  The acks, PINGREQ/PINGRESP and a plain DISCONNECT are compatible with the
+ * 3.1.1 functions in MQTTPacket.h (a short ack means reason code 0 and no properties).
+ *******************************************************************************/
+
+#ifndef MQTTV5PACKET_H_
+#define MQTTV5PACKET_H_
+
+#include "MQTTPacket.h"
+
+#if defined(__cplusplus) /* If this is a C++ compiler, use C linkage */
+extern "C" {
+#endif
+
+#include "MQTTProperties.h"
+
+#define MQTTV5_REASON_SUCCESS 0x00
+#define MQTTV5_REASON_UNSPECIFIED_ERROR 0x80
+
+DLLExport int MQTTV5Serialize_connectLength(MQTTPacket_connectData* options, MQTTProperties* connectProperties, MQTTProperties* willProperties);
+DLLExport int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+DLLExport int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent,
+		unsigned char* reasonCode, unsigned char* buf, int buflen);
+
+DLLExport int MQTTV5Serialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, MQTTProperties* properties, unsigned char* payload, int payloadlen);
+DLLExport int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid,
+		MQTTString* topicName, MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen);
+
+DLLExport int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int options[]);
+DLLExport int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count,
+		int reasonCodes[], unsigned char* buf, int buflen);
+
+DLLExport int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[]);
+
+#ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
+}
+#endif
+
+#endif /* MQTTV5PACKET_H_ */
@@ -0,0 +1,142 @@
+#if !defined(MQTTPACKETARENA_H)
+#define MQTTPACKETARENA_H
+
+#include <string.h>
+
+#define MQTTPACKETARENA_ENTRY_HEADER 4     // in-flight entry: packet id, packet length
+
+namespace MQTT
+{
+
+/**
+ * @class PacketArena
+ * @brief the packet buffers of an MQTT::Client, in one block
+ *
+ * The three areas are sized independently, and each has a fixed lifetime:
+ * - read buffer: the packet just read from the network.  It is valid until the next read, so message
+ *   handlers (which get pointers into it) must copy anything they want to keep.
+ * - send buffer: one outgoing packet, from serialization until it has been written to the network.
+ * - in-flight store: QoS 1 and 2 publishes of a persistent session (cleansession 0) waiting for their ack,
+ *   kept to be resent after a reconnect.  Each entry takes only its serialized bytes plus a
+ *   MQTTPACKETARENA_ENTRY_HEADER byte header, and is freed by its ack (or a clean session).
+ * @param READ_SIZE the largest packet that can be received
+ * @param SEND_SIZE the largest packet that can be sent
+ * @param INFLIGHT_SIZE bytes for in-flight publishes, 0 if publishes are never resent (clean sessions only)
+ */
+template<int READ_SIZE, int SEND_SIZE, int INFLIGHT_SIZE>
+class PacketArena
+{
+public:
+
+    enum
+    {
+        READ_BUFFER_SIZE = READ_SIZE,
+        SEND_BUFFER_SIZE = SEND_SIZE,
+        INFLIGHT_STORE_SIZE = INFLIGHT_SIZE,
+        RAM_BYTES = READ_SIZE + SEND_SIZE + INFLIGHT_SIZE   // static RAM of the buffers
+    };
+
+    PacketArena() : inflightUsed(0)
+    {
+    }
+
+    /** Keep a copy of a serialized publish until it is acked
+     *  @return false if the store has no room for it
+     */
+    bool storeInflight(unsigned short id, const unsigned char* packet, int len)
+    {
+        if (INFLIGHT_SIZE == 0 || inflightUsed + MQTTPACKETARENA_ENTRY_HEADER + len > INFLIGHT_SIZE)
+            return false;
+        unsigned char* entry = &inflight[inflightUsed];
+        entry[0] = id >> 8;
+        entry[1] = id & 0xFF;
+        entry[2] = len >> 8;
+        entry[3] = len & 0xFF;
+        memcpy(entry + MQTTPACKETARENA_ENTRY_HEADER, packet, len);
+        inflightUsed += MQTTPACKETARENA_ENTRY_HEADER + len;
+        return true;
+    }
+
+    /** Drop an in-flight publish (its ack has arrived)
+     *  @return false if there was no publish with this packet id
+     */
+    bool releaseInflight(unsigned short id)
+    {
+        for (int pos = 0; pos < inflightUsed; pos += entryLen(pos))
+        {
+            if (entryId(pos) == id)
+            {
+                int len = entryLen(pos);
+                memmove(&inflight[pos], &inflight[pos + len], inflightUsed - pos - len);
+                inflightUsed -= len;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Copy out the index'th in-flight publish, oldest first
+     *  @return its length, 0 if there is no such entry
+     */
+    int getInflight(int index, unsigned char* buf, int buflen, unsigned short& id)
+    {
+        for (int pos = 0; pos < inflightUsed; pos += entryLen(pos))
+        {
+            if (index-- == 0)
+            {
+                int len = entryLen(pos) - MQTTPACKETARENA_ENTRY_HEADER;
+                if (len > buflen)
+                    return 0;
+                id = entryId(pos);
+                memcpy(buf, &inflight[pos + MQTTPACKETARENA_ENTRY_HEADER], len);
+                return len;
+            }
+        }
+        return 0;
+    }
+
+    bool hasInflight(unsigned short id)
+    {
+        for (int pos = 0; pos < inflightUsed; pos += entryLen(pos))
+        {
+            if (entryId(pos) == id)
+                return true;
+        }
+        return false;
+    }
+
+    int inflightCount()
+    {
+        int count = 0;
+        for (int pos = 0; pos < inflightUsed; pos += entryLen(pos))
+            ++count;
+        return count;
+    }
+
+    void clearInflight()
+    {
+        inflightUsed = 0;
+    }
+
+    unsigned char readbuf[READ_SIZE];
+    unsigned char sendbuf[SEND_SIZE];
+
+private:
+
+    unsigned short entryId(int pos)
+    {
+        return (inflight[pos] << 8) | inflight[pos + 1];
+    }
+
+    int entryLen(int pos)   // including the header
+    {
+        return MQTTPACKETARENA_ENTRY_HEADER + ((inflight[pos + 2] << 8) | inflight[pos + 3]);
+    }
+
+    unsigned char inflight[INFLIGHT_SIZE > 0 ? INFLIGHT_SIZE : 1];
+    int inflightUsed;
+};
+
+}
+
+#endif
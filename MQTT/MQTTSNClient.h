@@ -0,0 +1,441 @@
+#if !defined(MQTTSNCLIENT_H)
+#define MQTTSNCLIENT_H
+
+#include <string.h>
+
+#if !defined(MQTTSN_RETRY_MS)
+    #define MQTTSN_RETRY_MS 3000        // Tretry: wait for the gateway's reply before sending again
+#endif
+#if !defined(MQTTSN_RETRIES)
+    #define MQTTSN_RETRIES 3            // Nretry: sends again before the gateway is given up on
+#endif
+#if !defined(MQTTSN_PROTOCOL_ID)
+    #define MQTTSN_PROTOCOL_ID 0x01     // MQTT-SN 1.2
+#endif
+
+namespace MQTTSN
+{
+
+enum QoS { QOS_MINUS1 = -1, QOS0 = 0, QOS1 = 1 };
+
+enum TopicIdType { TOPIC_NORMAL = 0, TOPIC_PREDEFINED = 1, TOPIC_SHORT = 2 };
+
+// all failure return codes must be negative
+enum returnCode { BUSY = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+
+enum msgTypes
+{
+    MQTTSN_ADVERTISE = 0x00, MQTTSN_SEARCHGW = 0x01, MQTTSN_GWINFO = 0x02, MQTTSN_CONNECT = 0x04,
+    MQTTSN_CONNACK = 0x05, MQTTSN_REGISTER = 0x0A, MQTTSN_REGACK = 0x0B, MQTTSN_PUBLISH = 0x0C,
+    MQTTSN_PUBACK = 0x0D, MQTTSN_PINGREQ = 0x16, MQTTSN_PINGRESP = 0x17, MQTTSN_DISCONNECT = 0x18
+};
+
+enum flags
+{
+    MQTTSN_FLAG_DUP = 0x80, MQTTSN_FLAG_QOS_MINUS1 = 0x60, MQTTSN_FLAG_QOS1 = 0x20, MQTTSN_FLAG_RETAIN = 0x10,
+    MQTTSN_FLAG_CLEANSESSION = 0x04
+};
+
+
+struct ResultData
+{
+    unsigned short msgId;   // message id of the QoS 1 publish
+    int rc;                 // SUCCESS, FAILURE (no PUBACK after the retries) or the PUBACK return code (> 0)
+};
+
+
+/**
+ * @class Client
+ * @brief MQTT-SN client over a datagram network, for telemetry through an MQTT-SN gateway
+ *
+ * A publish is a datagram with a 7 byte header and a 2 byte topic id instead of the topic name: a topic
+ * id the gateway assigned with registerTopic(), an id predefined on the gateway, or a two character
+ * short topic name.  QoS -1 publishes (predefined and short topics) need no connection at all, only a
+ * gateway.  The gateway is set in the network, found with searchGateway(), or taken from the first
+ * ADVERTISE heard.
+ *
+ * connect(), registerTopic() and searchGateway() block until the gateway replies (resending every
+ * MQTTSN_RETRY_MS, MQTTSN_RETRIES times).  Publishing doesn't: a QoS 1 publish is kept until its PUBACK
+ * arrives through poll(), which also resends it and keeps the connection alive.  One QoS 1 publish is in
+ * flight at a time.
+ * @param Network a datagram network class with the methods:
+ *     int read(unsigned char* buf, int len, int timeout_ms) - one datagram, returns its length, <= 0 if none
+ *     int write(unsigned char* buf, int len, int timeout_ms) - to the gateway
+ *     int broadcast(unsigned char* buf, int len, int timeout_ms) - to the gateways on the segment
+ *     void useSender() - make the sender of the last datagram read the gateway
+ * @param Timer a timer class with the methods: countdown_ms, expired, left_ms
+ * @param MAX_PACKET_SIZE the largest datagram sent or received
+ */
+template<class Network, class Timer, int MAX_PACKET_SIZE = 64>
+class Client
+{
+public:
+
+    typedef void (*resultHandler)(ResultData&);
+
+    Client(Network& network, unsigned int command_timeout_ms = MQTTSN_RETRY_MS) : ipstack(network),
+        command_timeout_ms(command_timeout_ms), gatewayKnown(false), gwId(0), isconnected(false), keepAlive(0),
+        pingOutstanding(0), nextMsgId(0), inflightLen(0), inflightRetries(0), resultHandler_(0)
+    {
+    }
+
+    /** Set the callback of completed QoS 1 publishes
+     */
+    void setResultHandler(resultHandler rh)
+    {
+        resultHandler_ = rh;
+    }
+
+    /** Broadcast SEARCHGW and wait for a gateway to answer with GWINFO (an ADVERTISE will do too)
+     *  @param radius - broadcast radius in hops
+     *  @return SUCCESS if a gateway is now in use
+     */
+    int searchGateway(unsigned char radius = 1)
+    {
+        for (int attempt = 0; attempt <= MQTTSN_RETRIES && !gatewayKnown; ++attempt)
+        {
+            Timer timer(command_timeout_ms);
+            int body = start(MQTTSN_SEARCHGW, 1);
+            sendbuf[body] = radius;
+            if (ipstack.broadcast(sendbuf, sendlen, command_timeout_ms) != sendlen)
+                return FAILURE;
+            while (!gatewayKnown && readPacket(timer) >= 0)
+                handlePacket();
+        }
+        return gatewayKnown ? SUCCESS : FAILURE;
+    }
+
+    /** A gateway is known (searched, advertised, or set in the network with setGatewayKnown())
+     */
+    bool hasGateway()
+    {
+        return gatewayKnown;
+    }
+
+    /** The gateway was set in the network directly, no need to search for one
+     */
+    void setGatewayKnown(unsigned char id = 0)
+    {
+        gatewayKnown = true;
+        gwId = id;
+    }
+
+    unsigned char gatewayId()
+    {
+        return gwId;
+    }
+
+    /** Connect to the gateway
+     *  @param clientId - the client id, 1-23 characters
+     *  @param keepAliveSec - the keepalive (Duration), 0 = none
+     *  @param cleanSession - forget earlier subscriptions and registrations
+     *  @return SUCCESS, FAILURE if the gateway didn't answer, or the CONNACK return code (> 0)
+     */
+    int connect(const char* clientId, unsigned short keepAliveSec = 60, bool cleanSession = true)
+    {
+        int len = strlen(clientId);
+        int body;
+        if (!gatewayKnown)
+            return FAILURE;
+        if ((body = start(MQTTSN_CONNECT, 4 + len)) == 0)
+            return BUFFER_OVERFLOW;
+        sendbuf[body] = cleanSession ? MQTTSN_FLAG_CLEANSESSION : 0;
+        sendbuf[body + 1] = MQTTSN_PROTOCOL_ID;
+        sendbuf[body + 2] = keepAliveSec >> 8;
+        sendbuf[body + 3] = keepAliveSec & 0xFF;
+        memcpy(&sendbuf[body + 4], clientId, len);
+        int rc = request(MQTTSN_CONNACK);
+        if (rc != SUCCESS)
+            return rc;
+        rc = readbuf[pktBody];   // return code
+        if (rc == 0)
+        {
+            isconnected = true;
+            keepAlive = keepAliveSec;
+            pingOutstanding = 0;
+            pingTimer.countdown_ms((unsigned long)keepAlive * 1000);
+        }
+        return rc;
+    }
+
+    /** Get the gateway's topic id for a topic name, for publishes on this connection
+     *  @param topicName - the topic (no wildcards)
+     *  @param topicId - returned topic id
+     *  @return SUCCESS, FAILURE, or the REGACK return code (> 0)
+     */
+    int registerTopic(const char* topicName, unsigned short& topicId)
+    {
+        int len = strlen(topicName);
+        unsigned short msgId = getNextMsgId();
+        int body;
+        if (!isconnected)
+            return FAILURE;
+        if ((body = start(MQTTSN_REGISTER, 4 + len)) == 0)
+            return BUFFER_OVERFLOW;
+        sendbuf[body] = 0;      // topic id, assigned by the gateway
+        sendbuf[body + 1] = 0;
+        sendbuf[body + 2] = msgId >> 8;
+        sendbuf[body + 3] = msgId & 0xFF;
+        memcpy(&sendbuf[body + 4], topicName, len);
+        int rc = request(MQTTSN_REGACK, msgId);
+        if (rc != SUCCESS)
+            return rc;
+        if (readbuf[pktBody + 4] == 0)
+            topicId = (readbuf[pktBody] << 8) | readbuf[pktBody + 1];
+        return readbuf[pktBody + 4];
+    }
+
+    /** Publish to a topic id
+     *  @param topicId - a registered topic id, a predefined topic id, or a short topic (shortTopic("t1"))
+     *  @param type - which of those topicId is
+     *  @param qos - QOS_MINUS1: no connection needed (predefined and short topics), fire and forget;
+     *      QOS0; QOS1: completed by poll() when the PUBACK arrives, through the result handler
+     *  @return SUCCESS, BUSY (a QoS 1 publish is still in flight), BUFFER_OVERFLOW or FAILURE
+     */
+    int publish(unsigned short topicId, TopicIdType type, const void* payload, int payloadlen, QoS qos = QOS0,
+                bool retained = false)
+    {
+        unsigned short msgId = 0;
+        int body;
+        if (qos == QOS_MINUS1 ? (!gatewayKnown || type == TOPIC_NORMAL) : !isconnected)
+            return FAILURE;
+        if (qos == QOS1 && inflightLen)
+            return BUSY;
+        if ((body = start(MQTTSN_PUBLISH, 5 + payloadlen)) == 0)
+            return BUFFER_OVERFLOW;
+        if (qos == QOS1)
+            msgId = getNextMsgId();
+        sendbuf[body] = (qos == QOS_MINUS1 ? MQTTSN_FLAG_QOS_MINUS1 : qos == QOS1 ? MQTTSN_FLAG_QOS1 : 0) |
+                        (retained ? MQTTSN_FLAG_RETAIN : 0) | type;
+        sendbuf[body + 1] = topicId >> 8;
+        sendbuf[body + 2] = topicId & 0xFF;
+        sendbuf[body + 3] = msgId >> 8;
+        sendbuf[body + 4] = msgId & 0xFF;
+        memcpy(&sendbuf[body + 5], payload, payloadlen);
+        if (sendPacket() != SUCCESS)
+            return FAILURE;
+        if (qos == QOS1)
+        {
+            memcpy(inflightbuf, sendbuf, sendlen);
+            inflightLen = sendlen;
+            inflightFlags = body;
+            inflightMsgId = msgId;
+            inflightRetries = 0;
+            retryTimer.countdown_ms(MQTTSN_RETRY_MS);
+        }
+        return SUCCESS;
+    }
+
+    /** A short topic name as a topic id, for publish() with TOPIC_SHORT
+     */
+    static unsigned short shortTopic(const char* name)
+    {
+        return (name[0] << 8) | name[1];
+    }
+
+    /** Handle what the gateway sent (acks, advertisements), resend an unacked QoS 1 publish and keep the
+     *  connection alive.  Never waits for the network.
+     *  @return SUCCESS while connected, FAILURE otherwise
+     */
+    int poll()
+    {
+        Timer now(0);
+        while (readPacket(now) >= 0)
+            handlePacket();
+        if (inflightLen && retryTimer.expired())
+        {
+            if (!isconnected || inflightRetries == MQTTSN_RETRIES)
+                completeInflight(FAILURE);
+            else
+            {
+                inflightbuf[inflightFlags] |= MQTTSN_FLAG_DUP;
+                ipstack.write(inflightbuf, inflightLen, command_timeout_ms);
+                ++inflightRetries;
+                retryTimer.countdown_ms(MQTTSN_RETRY_MS);
+            }
+        }
+        if (isconnected && keepAlive > 0 && pingTimer.expired())
+        {
+            if (pingOutstanding > MQTTSN_RETRIES)
+                isconnected = false;    // the gateway is gone
+            else
+            {
+                start(MQTTSN_PINGREQ, 0);
+                ++pingOutstanding;
+                sendPacket();
+                pingTimer.countdown_ms(MQTTSN_RETRY_MS);
+            }
+        }
+        return isconnected ? SUCCESS : FAILURE;
+    }
+
+    /** Disconnect from the gateway (it isn't waited for)
+     */
+    int disconnect()
+    {
+        int rc = FAILURE;
+        if (isconnected)
+        {
+            start(MQTTSN_DISCONNECT, 0);
+            rc = sendPacket();
+        }
+        isconnected = false;
+        if (inflightLen)
+            completeInflight(FAILURE);
+        return rc;
+    }
+
+    bool isConnected()
+    {
+        return isconnected;
+    }
+
+private:
+
+    unsigned short getNextMsgId()
+    {
+        return nextMsgId = (nextMsgId == 65535) ? 1 : nextMsgId + 1;
+    }
+
+    // write the header of a packet with bodylen bytes after the type, returns the offset of the body, 0 if
+    // the packet doesn't fit
+    int start(int type, int bodylen)
+    {
+        int total = 2 + bodylen;
+        int hdr = 1;
+        if (total > 255)
+        {
+            total += 2;     // three byte length: 0x01, length MSB, LSB
+            hdr = 3;
+        }
+        if (total > MAX_PACKET_SIZE)
+            return 0;
+        if (hdr == 1)
+            sendbuf[0] = total;
+        else
+        {
+            sendbuf[0] = 0x01;
+            sendbuf[1] = total >> 8;
+            sendbuf[2] = total & 0xFF;
+        }
+        sendbuf[hdr] = type;
+        sendlen = total;
+        return hdr + 1;
+    }
+
+    int sendPacket()
+    {
+        if (ipstack.write(sendbuf, sendlen, command_timeout_ms) != sendlen)
+            return FAILURE;
+        if (isconnected && keepAlive > 0 && !pingOutstanding)
+            pingTimer.countdown_ms((unsigned long)keepAlive * 1000);
+        return SUCCESS;
+    }
+
+    // read one datagram, returns its type (>= 0), -1 if none arrived in time; bad datagrams are skipped
+    int readPacket(Timer& timer)
+    {
+        while (true)
+        {
+            int len = ipstack.read(readbuf, MAX_PACKET_SIZE, timer.left_ms() > 0 ? timer.left_ms() : 0);
+            if (len <= 0)
+                return -1;
+            int hdr = (readbuf[0] == 0x01) ? 3 : 1;
+            int total = (hdr == 3) ? (readbuf[1] << 8) | readbuf[2] : readbuf[0];
+            if (len > hdr && total == len)
+            {
+                pktType = readbuf[hdr];
+                pktBody = hdr + 1;
+                pktLen = len - pktBody;
+                return pktType;
+            }
+        }
+    }
+
+    // send the packet in sendbuf and wait for the reply (and its msgId), sending again on a timeout
+    int request(int replyType, int msgId = -1)
+    {
+        for (int attempt = 0; attempt <= MQTTSN_RETRIES; ++attempt)
+        {
+            Timer timer(command_timeout_ms);
+            if (sendPacket() != SUCCESS)
+                return FAILURE;
+            while (readPacket(timer) >= 0)
+            {
+                if (pktType == replyType && (msgId < 0 ||
+                    (pktLen >= 5 && ((readbuf[pktBody + 2] << 8) | readbuf[pktBody + 3]) == msgId)))
+                    return SUCCESS;
+                handlePacket();
+            }
+        }
+        return FAILURE;
+    }
+
+    void handlePacket()
+    {
+        switch (pktType)
+        {
+            case MQTTSN_ADVERTISE:
+            case MQTTSN_GWINFO:
+                // GWINFO from a gateway has no address, one with an address is another client's answer
+                if (!gatewayKnown && pktLen == (pktType == MQTTSN_ADVERTISE ? 3 : 1))
+                {
+                    ipstack.useSender();
+                    gwId = readbuf[pktBody];
+                    gatewayKnown = true;
+                }
+                break;
+            case MQTTSN_PUBACK:
+                if (inflightLen && pktLen >= 5 && ((readbuf[pktBody + 2] << 8) | readbuf[pktBody + 3]) == inflightMsgId)
+                    completeInflight(readbuf[pktBody + 4]);
+                break;
+            case MQTTSN_PINGRESP:
+                pingOutstanding = 0;
+                pingTimer.countdown_ms((unsigned long)keepAlive * 1000);
+                break;
+            case MQTTSN_DISCONNECT:
+                isconnected = false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    void completeInflight(int rc)
+    {
+        ResultData result = {inflightMsgId, rc};
+        inflightLen = 0;
+        if (resultHandler_)
+            resultHandler_(result);
+    }
+
+    Network& ipstack;
+    unsigned int command_timeout_ms;
+
+    unsigned char sendbuf[MAX_PACKET_SIZE];
+    int sendlen;
+    unsigned char readbuf[MAX_PACKET_SIZE];
+    int pktType;            // the datagram in readbuf: type, offset of the body, body length
+    int pktBody;
+    int pktLen;
+
+    bool gatewayKnown;
+    unsigned char gwId;
+    bool isconnected;
+    unsigned short keepAlive;
+    Timer pingTimer;
+    int pingOutstanding;    // PINGREQs sent without a PINGRESP
+    unsigned short nextMsgId;
+
+    unsigned char inflightbuf[MAX_PACKET_SIZE];     // the QoS 1 publish awaiting its PUBACK
+    int inflightLen;        // 0 = none
+    int inflightFlags;      // offset of its flags byte, for the DUP bit
+    unsigned short inflightMsgId;
+    int inflightRetries;
+    Timer retryTimer;
+    resultHandler resultHandler_;
+};
+
+}
+
+#endif
@@ -3,7 +3,7 @@
 
 #include "MQTTmbed.h"
 #include <EthernetInterface.h>
-#include <Timer.h>
+#include "TimerWheel.h"
 
 class MQTTSocket
 {
@@ -30,7 +30,7 @@ public:
     // common read/write routine, avoiding blocking timeouts
     int common(unsigned char* buffer, int len, int timeout, bool read)
     {
-        timer.start();
+        Deadline deadline(timeout);
         mysock.set_blocking(false); // blocking timeouts seem not to work
         int bytes = 0;
         bool first = true;
@@ -56,8 +56,7 @@ public:
             else
                 bytes += rc;
         }
-        while (bytes < len && timer.read_ms() < timeout);
-        timer.stop();
+        while (bytes < len && !deadline.expired());
         return bytes;
     }
 
@@ -90,7 +89,6 @@ private:
     bool open;
     TCPSocket mysock;
     EthernetInterface *net;
-    Timer timer;
 
 };
 
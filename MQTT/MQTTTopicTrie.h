@@ -0,0 +1,354 @@
+#if !defined(MQTTTOPICTRIE_H)
+#define MQTTTOPICTRIE_H
+
+#include <string.h>
+
+#if !defined(MQTTTOPICTRIE_MAX_LEVELS)
+    #define MQTTTOPICTRIE_MAX_LEVELS 16     // deepest topic filter that can be stored
+#endif
+
+namespace MQTT
+{
+
+/**
+ * @class TopicTrie
+ * @brief statically allocated trie of subscription topic filters
+ *
+ * Each node is one topic level ("cmnd", "+", "#", ...) and filters sharing a prefix share its nodes.
+ * Level text is interned once, at insert time, into a fixed pool (an existing copy of the same text is
+ * reused).  When the pool is full, text left behind by removed nodes is reclaimed by compacting it: the
+ * text still in use slides down, shared text stays shared.
+ * Matching an incoming topic walks the trie one level at a time, so the cost depends on the number of
+ * levels in the topic (and the siblings at each level), not on the number of filters.
+ * @param MAX_NODES the number of topic levels that can be stored, over all filters
+ * @param POOL_SIZE bytes of interned level text
+ */
+template<int MAX_NODES, int POOL_SIZE>
+class TopicTrie
+{
+public:
+
+    TopicTrie()
+    {
+        clear();
+    }
+
+    /** Remove all filters
+     */
+    void clear()
+    {
+        for (int i = 0; i < MAX_NODES; ++i)
+            nodes[i].refs = 0;
+        root = -1;
+        poolUsed = 0;
+    }
+
+    /** Add a topic filter
+     *  @param topicFilter - the filter, which can include + and # wildcards
+     *  @param handler - the id returned by match() for topics matching this filter, 0 - 127
+     *  @return true if added, false if the trie is out of nodes or pool space
+     */
+    bool insert(const char* topicFilter, int handler)
+    {
+        short path[MQTTTOPICTRIE_MAX_LEVELS];
+        int depth = 0;
+        short* link = &root;
+        const char* level = topicFilter;
+
+        while (true)
+        {
+            const char* sep = strchr(level, '/');
+            int len = sep ? sep - level : strlen(level);
+            short n = findChild(*link, level, len);
+            if (n < 0)
+            {
+                if (depth == MQTTTOPICTRIE_MAX_LEVELS || (n = newNode(level, len)) < 0)
+                {
+                    release(path, depth);   // undo the levels added so far
+                    return false;
+                }
+                nodes[n].sibling = *link;
+                *link = n;
+            }
+            else if (depth == MQTTTOPICTRIE_MAX_LEVELS)
+            {
+                release(path, depth);
+                return false;
+            }
+            nodes[n].refs++;
+            path[depth++] = n;
+            if (!sep)
+                break;
+            link = &nodes[n].child;
+            level = sep + 1;
+        }
+        nodes[path[depth - 1]].handler = handler;
+        return true;
+    }
+
+    /** Remove a topic filter
+     *  @param topicFilter - the filter as it was inserted
+     *  @return true if the filter was found and removed
+     */
+    bool remove(const char* topicFilter)
+    {
+        short path[MQTTTOPICTRIE_MAX_LEVELS];
+        int depth = findPath(topicFilter, path);
+
+        if (depth == 0 || nodes[path[depth - 1]].handler < 0)
+            return false;
+        nodes[path[depth - 1]].handler = -1;
+        release(path, depth);
+        return true;
+    }
+
+    /** Remove the topic filter inserted with a handler id
+     *  @param handler - the id given to insert()
+     *  @return true if the filter was found and removed
+     */
+    bool removeHandler(int handler)
+    {
+        short path[MQTTTOPICTRIE_MAX_LEVELS];
+        int depth = findHandler(root, handler, path, 0);
+
+        if (depth == 0)
+            return false;
+        nodes[path[depth - 1]].handler = -1;
+        release(path, depth);
+        return true;
+    }
+
+    /** Look up a topic filter as it was inserted (wildcards are compared as text, not matched)
+     *  @param topicFilter - the filter
+     *  @return its handler id, -1 if the filter is not in the trie
+     */
+    int find(const char* topicFilter)
+    {
+        short path[MQTTTOPICTRIE_MAX_LEVELS];
+        int depth = findPath(topicFilter, path);
+
+        return depth ? nodes[path[depth - 1]].handler : -1;
+    }
+
+    /** Find the filters matching a topic name
+     *  @param topicName - the topic of a received message (not null terminated)
+     *  @param len - length of topicName
+     *  @param handlers - returned handler ids of the matching filters
+     *  @param maxHandlers - size of the handlers array
+     *  @return the number of matching filters
+     */
+    int match(const char* topicName, int len, int* handlers, int maxHandlers)
+    {
+        int count = 0;
+        matchLevel(root, topicName, topicName + len, true, handlers, count, maxHandlers);
+        return count;
+    }
+
+private:
+
+    struct Node
+    {
+        unsigned short text;    // offset of the level text in pool
+        unsigned char len;      // length of the level text
+        signed char handler;    // handler id if a filter ends here, -1 if not
+        unsigned char refs;     // filters passing through this node, 0 = free node
+        short child;            // first node of the next level, -1 = none
+        short sibling;          // next node at this level, -1 = none
+    };
+
+    bool isLevel(short n, const char* level, int len)
+    {
+        return nodes[n].len == len && memcmp(&pool[nodes[n].text], level, len) == 0;
+    }
+
+    bool isWildcard(short n, char c)
+    {
+        return nodes[n].len == 1 && pool[nodes[n].text] == c;
+    }
+
+    short findChild(short child, const char* level, int len)
+    {
+        for (short n = child; n >= 0; n = nodes[n].sibling)
+        {
+            if (isLevel(n, level, len))
+                return n;
+        }
+        return -1;
+    }
+
+    int findPath(const char* topicFilter, short* path)    // nodes of a filter's levels, returns the depth, 0 if not found
+    {
+        int depth = 0;
+        short child = root;
+        const char* level = topicFilter;
+
+        while (true)
+        {
+            const char* sep = strchr(level, '/');
+            int len = sep ? sep - level : strlen(level);
+            short n = findChild(child, level, len);
+            if (n < 0 || depth == MQTTTOPICTRIE_MAX_LEVELS)
+                return 0;
+            path[depth++] = n;
+            if (!sep)
+                return depth;
+            child = nodes[n].child;
+            level = sep + 1;
+        }
+    }
+
+    int findHandler(short child, int handler, short* path, int depth)   // same, found by handler id
+    {
+        for (short n = child; n >= 0; n = nodes[n].sibling)
+        {
+            path[depth] = n;
+            if (nodes[n].handler == handler)
+                return depth + 1;
+            if (depth + 1 < MQTTTOPICTRIE_MAX_LEVELS)
+            {
+                int found = findHandler(nodes[n].child, handler, path, depth + 1);
+                if (found)
+                    return found;
+            }
+        }
+        return 0;
+    }
+
+    short newNode(const char* level, int len)
+    {
+        int text = intern(level, len);
+        if (text < 0 || len > 255)
+            return -1;
+        for (short n = 0; n < MAX_NODES; ++n)
+        {
+            if (nodes[n].refs == 0)
+            {
+                nodes[n].text = text;
+                nodes[n].len = len;
+                nodes[n].handler = -1;
+                nodes[n].child = -1;
+                nodes[n].sibling = -1;
+                return n;
+            }
+        }
+        return -1;
+    }
+
+    int intern(const char* level, int len)
+    {
+        for (int i = 0; i + len <= poolUsed; ++i)
+        {
+            if (memcmp(&pool[i], level, len) == 0)
+                return i;
+        }
+        if (poolUsed + len > POOL_SIZE)
+            compact();
+        if (poolUsed + len > POOL_SIZE)
+            return -1;
+        memcpy(&pool[poolUsed], level, len);
+        poolUsed += len;
+        return poolUsed - len;
+    }
+
+    void release(short* path, int depth)
+    {
+        // drop one reference along the path, unlinking nodes no filter uses any more
+        for (int d = depth - 1; d >= 0; --d)
+        {
+            short n = path[d];
+            if (--nodes[n].refs > 0)
+                continue;
+            short* link = (d == 0) ? &root : &nodes[path[d - 1]].child;
+            while (*link != n)
+                link = &nodes[*link].sibling;
+            *link = nodes[n].sibling;
+        }
+    }
+
+    void compact()
+    {
+        // slide each run of text in use (node texts can overlap, as they are shared) down over the unused text
+        int to = 0;
+        int from = 0;
+        while (true)
+        {
+            int start = poolUsed;
+            for (int n = 0; n < MAX_NODES; ++n)
+            {
+                if (nodes[n].refs > 0 && nodes[n].len > 0 && nodes[n].text + nodes[n].len > from)
+                    start = (nodes[n].text > from) ? (nodes[n].text < start ? nodes[n].text : start) : from;
+            }
+            if (start == poolUsed)
+                break;
+            int end = start;
+            for (bool grown = true; grown; )
+            {
+                grown = false;
+                for (int n = 0; n < MAX_NODES; ++n)
+                {
+                    if (nodes[n].refs > 0 && nodes[n].text <= end && nodes[n].text + nodes[n].len > end)
+                    {
+                        end = nodes[n].text + nodes[n].len;
+                        grown = true;
+                    }
+                }
+            }
+            memmove(&pool[to], &pool[start], end - start);
+            for (int n = 0; n < MAX_NODES; ++n)
+            {
+                if (nodes[n].refs > 0 && nodes[n].len > 0 && nodes[n].text >= start && nodes[n].text < end)
+                    nodes[n].text -= start - to;
+            }
+            to += end - start;
+            from = end;
+        }
+        poolUsed = to;
+    }
+
+    void found(short n, int* handlers, int& count, int maxHandlers)
+    {
+        if (nodes[n].handler >= 0 && count < maxHandlers)
+            handlers[count++] = nodes[n].handler;
+    }
+
+    void matchLevel(short child, const char* level, const char* end, bool first, int* handlers, int& count, int maxHandlers)
+    {
+        const char* sep = level;
+        while (sep < end && *sep != '/')
+            ++sep;
+        int len = sep - level;
+        bool system = first && len > 0 && *level == '$';   // wildcards don't match $SYS etc at the first level
+
+        for (short n = child; n >= 0; n = nodes[n].sibling)
+        {
+            if (isWildcard(n, '#'))
+            {
+                if (!system)
+                    found(n, handlers, count, maxHandlers);
+                continue;
+            }
+            if (isWildcard(n, '+') ? system : !isLevel(n, level, len))
+                continue;
+            if (sep < end)
+                matchLevel(nodes[n].child, sep + 1, end, false, handlers, count, maxHandlers);
+            else
+            {
+                found(n, handlers, count, maxHandlers);
+                for (short c = nodes[n].child; c >= 0; c = nodes[c].sibling)
+                {
+                    if (isWildcard(c, '#'))     // "a/#" matches "a" too
+                        found(c, handlers, count, maxHandlers);
+                }
+            }
+        }
+    }
+
+    Node nodes[MAX_NODES];
+    short root;
+    char pool[POOL_SIZE];
+    int poolUsed;
+};
+
+}
+
+#endif
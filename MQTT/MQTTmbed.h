@@ -2,47 +2,44 @@
 #define MQTT_MBED_H
 
 #include "mbed.h"
+#include "TimerWheel.h"
 
+// the client's Timer: a Deadline on the 64 bit monotonic clock, no mbed Timer per countdown
 class Countdown
 {
 public:
-    Countdown() : t()
+    Countdown() : deadline()
     {
   
     }
     
-    Countdown(int ms) : t()
+    Countdown(int ms) : deadline(ms)
     {
-        countdown_ms(ms);   
     }
     
     
     bool expired()
     {
-        return t.read_ms() >= interval_end_ms;
+        return deadline.expired();
     }
     
-    void countdown_ms(unsigned long ms)  
+    void countdown_ms(long ms)
     {
-        t.stop();
-        interval_end_ms = ms;
-        t.reset();
-        t.start();
+        deadline.countdown_ms(ms);
     }
     
     void countdown(int seconds)
     {
-        countdown_ms((unsigned long)seconds * 1000L);
+        countdown_ms((long)seconds * 1000L);
     }
     
     int left_ms()
     {
-        return interval_end_ms - t.read_ms();
+        return deadline.left_ms();
     }
     
 private:
-    Timer t;
-    unsigned long interval_end_ms; 
+    Deadline deadline;
 };
 
 #endif
\ No newline at end of file
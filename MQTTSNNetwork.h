@@ -0,0 +1,72 @@
+#ifndef _MQTTSNNETWORK_H_
+#define _MQTTSNNETWORK_H_
+
+#include "UDPSocket.h"
+#include "EthernetInterface.h"
+
+/** Datagram network of an MQTTSN::Client: one UDP socket, datagrams go to the gateway (set here, or
+ *  the sender of a GWINFO / ADVERTISE the client adopts), SEARCHGW is broadcast to the gateway port.
+ */
+class MQTTSNNetwork {
+public:
+    MQTTSNNetwork(EthernetInterface* aNetwork) : network(aNetwork), gateway_port(0) {
+        socket = new UDPSocket();
+    }
+
+    ~MQTTSNNetwork() {
+        delete socket;
+    }
+
+    /** Open the socket
+     *  @param gatewayPort UDP port gateways listen on (SEARCHGW is broadcast to it)
+     *  @param localPort UDP port of this client, where gateways' ADVERTISE broadcasts arrive (0 = any)
+     */
+    int open(int gatewayPort, int localPort = 0) {
+        gateway_port = gatewayPort;
+        return socket->bind(localPort);
+    }
+
+    /** Use a known gateway instead of searching for one
+     */
+    int setGateway(const char* host) {
+        return gateway.set_address(host, gateway_port);
+    }
+
+    int read(unsigned char* buffer, int len, int timeout) {
+        socket->set_blocking(false, timeout);
+        return socket->receiveFrom(sender, (char*)buffer, len, true);     // an oversized datagram is cut short
+    }
+
+    int write(unsigned char* buffer, int len, int timeout) {
+        socket->set_blocking(false, timeout);
+        return socket->sendTo(gateway, (char*)buffer, len);
+    }
+
+    int broadcast(unsigned char* buffer, int len, int timeout) {
+        Endpoint all;
+        all.set_address("255.255.255.255", gateway_port);
+        socket->set_blocking(false, timeout);
+        return socket->sendTo(all, (char*)buffer, len);
+    }
+
+    void useSender() {
+        gateway.set_address(sender.get_address(), sender.get_port());
+    }
+
+    char* getIPAddress() {
+        return network->getIPAddress();
+    }
+
+    int close() {
+        return socket->close();
+    }
+
+private:
+    EthernetInterface* network;
+    UDPSocket* socket;
+    Endpoint gateway;
+    Endpoint sender;        // of the last datagram read
+    int gateway_port;
+};
+
+#endif // _MQTTSNNETWORK_H_
@@ -0,0 +1,189 @@
+#ifndef _NETSUPERVISOR_H_
+#define _NETSUPERVISOR_H_
+
+#include <stdint.h>
+
+#define SUPERVISOR_BACKOFF_MS 500       // shortest retry delay after a failure, see failed()
+#define SUPERVISOR_TCP_BACKOFF_MS 2000  // same for TCP connects: the broker's load when the fleet retries together
+#define SUPERVISOR_LINK_BACKOFF_MS 10000  // same for the link: a cable or switch takes a while to come back
+#define SUPERVISOR_BACKOFF_MAX_MS 60000
+#define SUPERVISOR_RECONNECT_SPREAD_MS 5000 // the first TCP connect is at a random point within this: N controllers, N/5 per s
+#define SUPERVISOR_ESCALATE 3           // failures of a layer in a row before the layer below is redone
+
+// the layers of the connection to the broker, each one needs those before it
+enum NetLayer {NET_CHIP, NET_LINK, NET_IP, NET_TCP, NET_MQTT, NET_LAYERS};
+
+/** Connection supervisor: which layer to bring up next, and when.
+ *
+ * The application reports layers found down (PHY link lost, session lost, lease expired), runs the step
+ * next() asks for (reset the W5500, check the link, DHCP, TCP connect, MQTT connect) and reports the
+ * outcome. Only the lowest layer that is down is worked on, so a lost session costs one TCP connect and
+ * leaves DHCP and the W5500 alone. A failed step is retried after a backoff, and after every
+ * SUPERVISOR_ESCALATE failures in a row the layer one further down is redone first: TCP connects failing
+ * redo DHCP, then check the link, then reset the W5500.
+ *
+ * Retries are jittered so a fleet of controllers that lost the same broker at the same moment doesn't
+ * come back as one burst of CONNECTs: the first TCP connect (at power up, and after the connection is
+ * lost) is spread over SUPERVISOR_RECONNECT_SPREAD_MS, and backoffs are decorrelated (each a random time
+ * between the base and 3 times the previous one). Seed each controller differently (seed(), eg: from
+ * its MAC) before the first next().
+ *
+ * Every outage (a layer going down after it was up) is timed until the layer is up again, per layer.
+ * Times are in ms from any free running clock.
+ */
+class NetSupervisor {
+public:
+    struct Stats {
+        uint16_t outages;
+        uint32_t last_ms;       // recovery time of the last outage
+        uint32_t max_ms;        // longest recovery time
+    };
+
+    NetSupervisor() : up_mask(0), rand_state(1) {
+        for (int i = 0; i < NET_LAYERS; i++) {
+            layers[i].retry_ms = 0;
+            layers[i].backoff_ms = 0;
+            layers[i].streak = 0;
+            layers[i].outage = false;
+            layers[i].stats.outages = 0;
+            layers[i].stats.last_ms = 0;
+            layers[i].stats.max_ms = 0;
+        }
+    }
+
+    /** The layer to bring up now: the lowest one down, once its backoff is over
+     *  @return the layer, -1 if all are up or the lowest one down is backing off
+     */
+    int next(unsigned long now_ms) const {
+        for (int i = 0; i < NET_LAYERS; i++) {
+            if (!isUp(i)) {
+                return (long)(now_ms - layers[i].retry_ms) >= 0 ? i : -1;
+            }
+        }
+        return -1;
+    }
+
+    /** A layer is up
+     *  @return true if that ended an outage (rather than being the first bring up)
+     */
+    bool up(int layer, unsigned long now_ms) {
+        Layer &l = layers[layer];
+        bool recovered = l.outage;
+        if (recovered) {
+            l.stats.last_ms = now_ms - l.down_ms;
+            if (l.stats.last_ms > l.stats.max_ms) {
+                l.stats.max_ms = l.stats.last_ms;
+            }
+            l.outage = false;
+        }
+        l.backoff_ms = 0;
+        l.streak = 0;
+        up_mask |= 1 << layer;
+        return recovered;
+    }
+
+    /** A layer was found down, or has to be redone: it is brought up again at once
+     */
+    void down(int layer, unsigned long now_ms) {
+        Layer &l = layers[layer];
+        if (!isUp(layer)) {
+            return;
+        }
+        up_mask &= ~(1 << layer);
+        l.outage = true;
+        l.down_ms = now_ms;
+        l.retry_ms = now_ms + (layer == NET_TCP ? random() % SUPERVISOR_RECONNECT_SPREAD_MS : 0);
+        l.stats.outages++;
+    }
+
+    /** An attempt to bring up a layer failed: retry after a decorrelated jitter backoff (a random time
+     *  between the base and 3 times the previous backoff, capped), escalating every SUPERVISOR_ESCALATE
+     *  failures in a row
+     *  @return the layer redone first because of it, -1 if none
+     */
+    int failed(int layer, unsigned long now_ms) {
+        Layer &l = layers[layer];
+        uint32_t base = layer == NET_LINK ? SUPERVISOR_LINK_BACKOFF_MS : layer == NET_TCP ? SUPERVISOR_TCP_BACKOFF_MS : SUPERVISOR_BACKOFF_MS;
+        uint32_t top = l.backoff_ms * 3 > base ? l.backoff_ms * 3 : base;
+        l.backoff_ms = base + random() % (top - base + 1);
+        if (l.backoff_ms > SUPERVISOR_BACKOFF_MAX_MS) {
+            l.backoff_ms = SUPERVISOR_BACKOFF_MAX_MS;
+        }
+        l.retry_ms = now_ms + l.backoff_ms;
+        l.streak++;         // wrapping around is harmless
+        if (layer == 0 || l.streak % SUPERVISOR_ESCALATE) {
+            return -1;
+        }
+        // one more layer down each time, the W5500 reset once there is no layer left
+        int below = layer - l.streak / SUPERVISOR_ESCALATE;
+        if (below < 0) {
+            below = 0;
+        }
+        down(below, now_ms);
+        return below;
+    }
+
+    bool isUp(int layer) const {
+        return up_mask & (1 << layer);
+    }
+
+    /** All layers are up: the session can be used
+     */
+    bool ready() const {
+        return up_mask == (1 << NET_LAYERS) - 1;
+    }
+
+    const Stats& stats(int layer) const {
+        return layers[layer].stats;
+    }
+
+    /** Seed the jitter, differently on every controller, and place the first TCP connect in the spread
+     */
+    void seed(uint32_t value) {
+        // scrambled, as seeds that differ in a bit or two (consecutive MACs) start xorshift off alike
+        value ^= value >> 16;
+        value *= 0x85EBCA6BU;
+        value ^= value >> 13;
+        value *= 0xC2B2AE35U;
+        value ^= value >> 16;
+        rand_state = value ? value : 1;
+        layers[NET_TCP].retry_ms = random() % SUPERVISOR_RECONNECT_SPREAD_MS;
+    }
+
+    /** Bring a layer up at once, skipping its backoff (or spread): the retry won't load the far end
+     */
+    void retryNow(int layer, unsigned long now_ms) {
+        layers[layer].retry_ms = now_ms;
+    }
+
+    /** Next number of the jitter's pseudo random sequence (xorshift32), for jittering the application's
+     *  own retries too
+     */
+    uint32_t random() {
+        rand_state ^= rand_state << 13;
+        rand_state ^= rand_state >> 17;
+        rand_state ^= rand_state << 5;
+        return rand_state;
+    }
+
+    static const char* name(int layer) {
+        static const char* const names[NET_LAYERS] = {"chip", "link", "ip", "tcp", "mqtt"};
+        return names[layer];
+    }
+
+private:
+    struct Layer {
+        unsigned long retry_ms;     // next attempt to bring it up
+        unsigned long down_ms;      // when the current outage started
+        uint32_t backoff_ms;        // last retry delay, 0 = none since it was last up
+        uint8_t streak;             // failures since it was last up, sets the escalation
+        bool outage;
+        Stats stats;
+    };
+
+    Layer layers[NET_LAYERS];
+    uint8_t up_mask;
+    uint32_t rand_state;
+};
+
+#endif // _NETSUPERVISOR_H_
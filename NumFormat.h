@@ -0,0 +1,90 @@
+#ifndef _NUMFORMAT_H_
+#define _NUMFORMAT_H_
+
+#include <stdint.h>
+
+/** Integer and fixed point formatting for MQTT payloads.
+ *
+ * No printf and no float math, so the float support of minimal-printf can stay out of
+ * the image. Every function writes a null terminated string to buf and returns its
+ * length (like sprintf). buf must hold 13 chars, plus decimals for the fixed point ones.
+ */
+
+/** Unsigned integer, zero padded to at least min_digits (max 10)
+ */
+inline int fmt_uint(char* buf, uint32_t value, int min_digits = 1) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value || n < min_digits);
+    for (int i = 0; i < n; i++) {
+        buf[i] = digits[n - 1 - i];
+    }
+    buf[n] = 0;
+    return n;
+}
+
+/** Signed integer, eg: -42
+ */
+inline int fmt_int(char* buf, int32_t value) {
+    if (value < 0) {
+        buf[0] = '-';
+        return 1 + fmt_uint(buf + 1, -(uint32_t)value);
+    }
+    return fmt_uint(buf, value);
+}
+
+/** Fixed point value held in units of 10^-decimals, eg: fmt_fixed(buf, -2106, 2) gives -21.06
+ */
+inline int fmt_fixed(char* buf, int32_t value, uint8_t decimals) {
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+    uint32_t scale = 1;
+    for (int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+    int n = 0;
+    if (value < 0) {
+        buf[n++] = '-';
+    }
+    n += fmt_uint(buf + n, magnitude / scale);
+    if (decimals) {
+        buf[n++] = '.';
+        n += fmt_uint(buf + n, magnitude % scale, decimals);
+    }
+    return n;
+}
+
+/** Value in 1/16ths (eg: DS1820 raw degC) to decimals places, rounded half away from zero,
+ *  eg: fmt_sixteenths(buf, 337, 2) gives 21.06
+ */
+inline int fmt_sixteenths(char* buf, int32_t value, uint8_t decimals) {
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+    uint32_t scale = 1;
+    for (int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+    int32_t scaled = (magnitude * scale + 8) / 16;
+    return fmt_fixed(buf, value < 0 ? -scaled : scaled, decimals);
+}
+
+/** Upper case hex with 0x prefix, zero padded to at least min_digits (max 8), eg: 0x1FD
+ */
+inline int fmt_hex(char* buf, uint32_t value, int min_digits = 1) {
+    char digits[8];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789ABCDEF"[value & 0xF];
+        value >>= 4;
+    } while (value || n < min_digits);
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < n; i++) {
+        buf[2 + i] = digits[n - 1 - i];
+    }
+    buf[2 + n] = 0;
+    return 2 + n;
+}
+
+#endif // _NUMFORMAT_H_
@@ -0,0 +1,160 @@
+#ifndef _REPORTBYEXCEPTION_H_
+#define _REPORTBYEXCEPTION_H_
+
+#include <stdint.h>
+
+// deadband value for signals that should only go out on their integrity refresh (eg: uptime)
+#define RBE_REFRESH_ONLY INT32_MAX
+
+/** Report-by-exception filter between the sensing code and the MQTT client.
+ *
+ * Each signal holds the latest sampled value and the value last reported. A signal
+ * becomes due when it moves by at least its deadband from the reported value (but not
+ * sooner than min_interval after the previous report), or when max_interval passes without
+ * a report (integrity refresh). After restart() the refreshes are phased evenly across
+ * max_interval, so a periodic refresh never turns into a burst of every signal at once.
+ *
+ * Times are in seconds, values are plain integers (fixed point, scaled by the caller, for analog values).
+ */
+template<int MAX_SIGNALS>
+class ReportByException {
+public:
+    struct Signal {
+        int topic;                  // publisher's topic (table index) the value goes out on
+        int32_t value;              // latest sampled value
+        int32_t reported;           // value last handed to the publisher
+        int32_t deadband;           // change needed before reporting (0 = any change)
+        uint16_t min_interval;      // minimum seconds between change reports
+        uint16_t max_interval;      // integrity refresh period, 0 = never
+        uint32_t last_report;       // uptime of the last report
+        uint8_t format;             // how the publisher formats value (0 = plain integer)
+        bool sampled;               // a value has been supplied
+        bool forced;                // report at the next opportunity
+    };
+
+    ReportByException() : num_signals(0), next_scan(0) {
+    }
+
+    /** Register a signal
+     *  @return signal id, or -1 if the table is full
+     */
+    int add(int topic, int32_t deadband, uint16_t min_interval, uint16_t max_interval, uint8_t format = 0) {
+        if (num_signals >= MAX_SIGNALS) {
+            return -1;
+        }
+        Signal &s = signals[num_signals];
+        s.topic = topic;
+        s.value = 0;
+        s.reported = 0;
+        s.deadband = deadband;
+        s.min_interval = min_interval;
+        s.max_interval = max_interval;
+        s.last_report = 0;
+        s.format = format;
+        s.sampled = false;
+        s.forced = false;
+        return num_signals++;
+    }
+
+    /** Feed a new sample for a signal (cheap, call as often as the value is read)
+     */
+    void update(int id, int32_t value) {
+        if (id < 0 || id >= num_signals) {
+            return;
+        }
+        signals[id].value = value;
+        signals[id].sampled = true;
+    }
+
+    /** Report a signal at the next poll regardless of deadband and min_interval
+     */
+    void force(int id) {
+        if (id >= 0 && id < num_signals) {
+            signals[id].forced = true;
+        }
+    }
+
+    /** Restart reporting (eg: after a new broker session). Every signal gets a fresh
+     *  integrity phase spread evenly over its max_interval, so a reconnect doesn't dump the
+     *  whole table at once. Changes and forced reports still pending go out as usual.
+     *  @param offset shifts all phases by offset/256 of max_interval, give each controller
+     *  of a fleet its own so their refreshes don't line up at the broker either
+     */
+    void restart(uint32_t now, uint8_t offset = 0) {
+        for (int i = 0; i < num_signals; i++) {
+            Signal &s = signals[i];
+            if (s.max_interval == 0) {
+                s.last_report = now;
+                continue;
+            }
+            uint32_t phase = ((uint32_t)(i + 1) * s.max_interval) / num_signals + ((uint32_t)offset * s.max_interval) / 256;
+            if (phase > s.max_interval) {
+                phase -= s.max_interval;
+            }
+            s.last_report = now - s.max_interval + phase;
+        }
+    }
+
+    /** Find the next signal that should be published. Changes and forced reports are
+     *  returned before integrity refreshes; the scan rotates so no signal can starve another.
+     *  @return signal id, -1 if nothing is due
+     */
+    int poll(uint32_t now) {
+        int refresh = -1;
+        for (int n = 0; n < num_signals; n++) {
+            int i = (next_scan + n) % num_signals;
+            Signal &s = signals[i];
+            if (!s.sampled) {
+                continue;
+            }
+            uint32_t age = now - s.last_report;
+            if (s.forced) {
+                return found(i);
+            }
+            if (s.deadband != RBE_REFRESH_ONLY && age >= s.min_interval && changed(s)) {
+                return found(i);
+            }
+            if (refresh < 0 && s.max_interval != 0 && age >= s.max_interval) {
+                refresh = i;
+            }
+        }
+        return refresh < 0 ? -1 : found(refresh);
+    }
+
+    /** Record that a signal has been published
+     */
+    void reported(int id, uint32_t now) {
+        Signal &s = signals[id];
+        s.reported = s.value;
+        s.last_report = now;
+        s.forced = false;
+    }
+
+    const Signal& operator[](int id) const {
+        return signals[id];
+    }
+
+    int count() const {
+        return num_signals;
+    }
+
+private:
+    bool changed(const Signal &s) const {
+        int32_t delta = s.value - s.reported;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        return s.deadband == 0 ? delta != 0 : delta >= s.deadband;
+    }
+
+    int found(int id) {
+        next_scan = (id + 1) % num_signals;
+        return id;
+    }
+
+    Signal signals[MAX_SIGNALS];
+    int num_signals;
+    int next_scan;
+};
+
+#endif // _REPORTBYEXCEPTION_H_
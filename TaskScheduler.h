@@ -0,0 +1,227 @@
+#ifndef _TASKSCHEDULER_H_
+#define _TASKSCHEDULER_H_
+
+#include <stdint.h>
+
+#define SCHED_MAX_TASKS 8
+
+/** Cooperative run-to-completion task scheduler for the bare metal main loop.
+ *
+ * Each task is a function that does one short step and returns. A task is due periodically (period),
+ * when woken (wake(), also from interrupts) or after a delay it set itself (schedule(), eg: the rest of a
+ * 1-Wire conversion). run() runs one due task, the highest priority one (lowest number, the earlier due
+ * on a tie), and idleUs() says how long the loop may sleep until the next one is due, so the caller can
+ * sleep (WFI) until then or until an interrupt. Nothing is preempted: a task that takes long delays the
+ * others, which shows in the stats.
+ *
+ * A task that starts more than its deadline after it was due has missed it. Per task the runs, misses,
+ * latest start and longest and total run time are kept until resetStats().
+ *
+ * Times are in us from a free running 32 bit clock (wraps after 71 minutes, periods and delays have to
+ * be shorter than half that).
+ */
+class TaskScheduler {
+public:
+    typedef void (*Task)();
+    typedef uint32_t (*Clock)();
+
+    struct Stats {
+        uint32_t runs;
+        uint16_t misses;
+        uint32_t max_late_us;       // latest start after being due
+        uint32_t max_run_us;        // longest run
+        uint32_t run_us;            // total run time
+    };
+
+    TaskScheduler(Clock clock) : clock(clock), num_tasks(0), stats_since(0) {
+    }
+
+    /** Register a task
+     *  @param priority 0 = highest
+     *  @param period_ms due every period from now, 0 = only when woken or delayed
+     *  @param deadline_ms latest start after being due without counting a miss
+     *  @return task id, or -1 if the table is full
+     */
+    int add(Task fn, const char* name, uint8_t priority, uint32_t period_ms, uint32_t deadline_ms) {
+        if (num_tasks >= SCHED_MAX_TASKS) {
+            return -1;
+        }
+        Entry &t = tasks[num_tasks];
+        t.fn = fn;
+        t.name = name;
+        t.priority = priority;
+        t.period_us = period_ms * 1000;
+        t.deadline_us = deadline_ms * 1000;
+        t.due_us = clock();
+        t.scheduled = period_ms != 0;
+        t.woken = false;
+        t.delayed = false;
+        clearStats(t.stats);
+        return num_tasks++;
+    }
+
+    /** Make a task due now (safe from interrupts)
+     */
+    void wake(int task) {
+        tasks[task].woken = true;
+    }
+
+    /** Make a task due delay_ms from now instead of at its next period (from the task itself: its next step)
+     */
+    void schedule(int task, uint32_t delay_ms) {
+        Entry &t = tasks[task];
+        t.due_us = clock() + delay_ms * 1000;
+        t.scheduled = true;
+        t.delayed = true;
+    }
+
+    /** Change a task's period, from its next run
+     */
+    void setPeriod(int task, uint32_t period_ms) {
+        tasks[task].period_us = period_ms * 1000;
+    }
+
+    /** Run the highest priority task that is due
+     *  @return true if one ran
+     */
+    bool run() {
+        uint32_t now = clock();
+        int best = -1;
+        for (int i = 0; i < num_tasks; i++) {
+            Entry &t = tasks[i];
+            if (t.woken) {
+                t.woken = false;    // a wake arriving here is merged into this one, the task is due anyway
+                if (!t.scheduled || (int32_t)(t.due_us - now) > 0) {
+                    t.due_us = now;
+                    t.scheduled = true;
+                }
+            }
+            if (!t.scheduled || (int32_t)(now - t.due_us) < 0) {
+                continue;
+            }
+            if (best < 0 || t.priority < tasks[best].priority ||
+                (t.priority == tasks[best].priority && (int32_t)(t.due_us - tasks[best].due_us) < 0)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        Entry &t = tasks[best];
+        uint32_t late = now - t.due_us;
+        t.delayed = false;
+        t.fn();
+        uint32_t ran = clock() - now;
+        if (!t.delayed) {
+            // next period from when it was due, so the phase holds, unless it fell a whole period behind
+            t.due_us += t.period_us;
+            t.scheduled = t.period_us != 0;
+            if ((int32_t)(now - t.due_us) >= 0) {
+                t.due_us = now + t.period_us;
+            }
+        }
+        Stats &s = t.stats;
+        s.runs++;
+        if (late > t.deadline_us) {
+            s.misses++;
+        }
+        if (late > s.max_late_us) {
+            s.max_late_us = late;
+        }
+        if (ran > s.max_run_us) {
+            s.max_run_us = ran;
+        }
+        s.run_us += ran;
+        return true;
+    }
+
+    /** How long nothing is due: the time the caller may sleep, unless an interrupt wakes a task
+     *  @return us until the next task is due, 0 if one is due now, -1 if none is scheduled
+     */
+    int32_t idleUs() const {
+        uint32_t now = clock();
+        int32_t idle = -1;
+        for (int i = 0; i < num_tasks; i++) {
+            const Entry &t = tasks[i];
+            if (t.woken) {
+                return 0;
+            }
+            if (!t.scheduled) {
+                continue;
+            }
+            int32_t until = (int32_t)(t.due_us - now);
+            if (until <= 0) {
+                return 0;
+            }
+            if (idle < 0 || until < idle) {
+                idle = until;
+            }
+        }
+        return idle;
+    }
+
+    /** A task was woken since run() last looked (check with interrupts off before sleeping)
+     */
+    bool woken() const {
+        for (int i = 0; i < num_tasks; i++) {
+            if (tasks[i].woken) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int count() const {
+        return num_tasks;
+    }
+
+    const char* name(int task) const {
+        return tasks[task].name;
+    }
+
+    const Stats& stats(int task) const {
+        return tasks[task].stats;
+    }
+
+    /** us since the stats were last reset, to turn run times into a load
+     */
+    uint32_t statsPeriodUs() const {
+        return clock() - stats_since;
+    }
+
+    void resetStats() {
+        for (int i = 0; i < num_tasks; i++) {
+            clearStats(tasks[i].stats);
+        }
+        stats_since = clock();
+    }
+
+private:
+    struct Entry {
+        Task fn;
+        const char* name;
+        uint8_t priority;
+        uint32_t period_us;
+        uint32_t deadline_us;
+        uint32_t due_us;            // when it is next due
+        bool scheduled;             // due_us is set (periodic, or delayed)
+        bool delayed;               // the task scheduled its own next run while it ran
+        volatile bool woken;        // set by wake(), picked up by run()
+        Stats stats;
+    };
+
+    static void clearStats(Stats &s) {
+        s.runs = 0;
+        s.misses = 0;
+        s.max_late_us = 0;
+        s.max_run_us = 0;
+        s.run_us = 0;
+    }
+
+    Clock clock;
+    Entry tasks[SCHED_MAX_TASKS];
+    int num_tasks;
+    uint32_t stats_since;
+};
+
+#endif // _TASKSCHEDULER_H_
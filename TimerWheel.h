@@ -0,0 +1,366 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include "mbed.h"
+#include "hal/us_ticker_api.h"
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 4      // 16 slots a level: 1 ms, 16 ms, 256 ms and 4 s slots, 65 s a turn at the top
+
+/** Monotonic time since boot in us, 64 bit so it never wraps (the us ticker, extended by the HAL)
+ */
+inline uint64_t monotonic_us() {
+    return ticker_read_us(get_us_ticker_data());
+}
+
+inline uint64_t monotonic_ms() {
+    return monotonic_us() / 1000;
+}
+
+/** A point in time to wait for, by polling: a timeout without a Timer of its own or an interrupt.
+ *
+ * Holds just the 64 bit end time, so it is cheap to create on the stack for every wait.
+ * A default constructed Deadline has expired, and so has one counted down from a negative time
+ * (the time left on another one that has run out).
+ */
+class Deadline {
+public:
+    Deadline() : end_us(0) {
+    }
+
+    explicit Deadline(long ms) {
+        countdown_ms(ms);
+    }
+
+    void countdown_ms(long ms) {
+        end_us = ms > 0 ? monotonic_us() + (uint64_t)ms * 1000 : 0;
+    }
+
+    bool expired() const {
+        return monotonic_us() >= end_us;
+    }
+
+    /** ms until the deadline, negative once it has passed
+     */
+    long left_ms() const {
+        return (long)((int64_t)(end_us - monotonic_us()) / 1000);
+    }
+
+private:
+    uint64_t end_us;
+};
+
+class WheelTimer;
+
+/** Hierarchical timer wheel: every callback timer of the application on one us ticker event.
+ *
+ * Timers are kept in TIMERWHEEL_LEVELS levels of slots by how far off they are, the nearest level in 1 ms
+ * slots, each level up in slots as long as a turn of the level below. A timer is moved down a level when
+ * its slot comes up, and called from its 1 ms slot. The wheel is tickless: the one Timeout is set for the
+ * next timer due (found from a bitmap per level), and the slots on the way are moved down in that
+ * interrupt, so there is an interrupt per expiry, not per ms or per slot. Adding or removing a timer costs
+ * the same however many there are. Timers further off than a turn of the top level wait in its last slot
+ * and are placed again when it comes up.
+ *
+ * Timers are WheelTimer objects, called from the interrupt like a Ticker's. Resolution is 1 ms, a timer
+ * is never called early.
+ */
+class TimerWheel {
+public:
+    static TimerWheel& get() {
+        static TimerWheel wheel;
+        return wheel;
+    }
+
+private:
+    friend class WheelTimer;
+
+    enum {
+        SLOTS = 1 << TIMERWHEEL_SLOT_BITS,
+        MASK = SLOTS - 1,
+        TOP = TIMERWHEEL_LEVELS - 1
+    };
+    static const uint64_t NONE = ~(uint64_t)0;
+
+    TimerWheel() : current(0), armed(NONE), advancing(false) {
+        for (int l = 0; l < TIMERWHEEL_LEVELS; l++) {
+            occupied[l] = 0;
+            for (int s = 0; s < SLOTS; s++) {
+                slots[l][s] = nullptr;
+            }
+        }
+    }
+
+    static int shift(int level) {
+        return level * TIMERWHEEL_SLOT_BITS;
+    }
+
+    inline void add(WheelTimer* t);
+    inline void remove(WheelTimer* t);
+    inline void place(WheelTimer* t);
+    inline void link(WheelTimer* t, int level, int slot);
+    inline WheelTimer* pop(int level, int slot);
+    inline void advance(uint64_t now);
+
+    /** The first slot of a level still to be processed, and the tick it is processed at
+     *  @return the slot, -1 if none
+     */
+    int firstSlot(int l, uint64_t &tick) const {
+        if (!occupied[l]) {
+            return -1;
+        }
+        int pos = (current >> shift(l)) & MASK;
+        // the slot current is in is still to do if current is at its start (always, in 1 ms slots)
+        int from = current & (((uint64_t)1 << shift(l)) - 1) ? pos + 1 : pos;
+        uint32_t ahead = occupied[l] & ~((1U << from) - 1);     // slots still to come this turn
+        if (ahead) {
+            int s = __builtin_ctz(ahead);
+            tick = ((current >> shift(l + 1)) << shift(l + 1)) | ((uint64_t)s << shift(l));
+            return s;
+        }
+        if (l == TOP) {
+            // the top level turns: the slots before are in its next turn
+            int s = __builtin_ctz(occupied[l]);
+            tick = ((current >> shift(l)) + s + SLOTS - pos) << shift(l);
+            return s;
+        }
+        return -1;
+    }
+
+    /** The next tick at which a slot has to be cascaded or fired, NONE if the wheel is empty
+     */
+    uint64_t nextTick() const {
+        uint64_t next = NONE;
+        for (int l = 0; l < TIMERWHEEL_LEVELS; l++) {
+            uint64_t tick;
+            if (firstSlot(l, tick) >= 0 && tick < next) {
+                next = tick;
+            }
+        }
+        return next;
+    }
+
+    /** The tick the next timer is due, NONE if the wheel is empty: the earliest in the first slot of each
+     *  level, as the later slots of a level are due after its first
+     */
+    inline uint64_t nextExpiry() const;
+
+    void irq() {
+        advancing = true;
+        advance(monotonic_ms());
+        advancing = false;
+        armed = NONE;
+        arm();
+    }
+
+    /** Set the Timeout for the next timer due, if it isn't already: the slots on the way there are moved
+     *  down in the same interrupt
+     */
+    void arm() {
+        uint64_t next = nextExpiry();
+        if (next == armed) {
+            return;
+        }
+        armed = next;
+        if (next == NONE) {
+            timeout.detach();
+            return;
+        }
+        uint64_t now = monotonic_us();
+        uint64_t at = next * 1000;
+        timeout.attach(callback(this, &TimerWheel::irq), std::chrono::microseconds(at > now ? at - now : 0));
+    }
+
+    WheelTimer* slots[TIMERWHEEL_LEVELS][SLOTS];
+    uint32_t occupied[TIMERWHEEL_LEVELS];  // bit per slot with timers in it
+    uint64_t current;           // next ms tick to process, every timer due earlier has been called
+    uint64_t armed;             // tick the Timeout is set for
+    bool advancing;
+    Timeout timeout;
+};
+
+/** A callback timer on the TimerWheel, periodic (in place of a Ticker) or one shot (a Timeout)
+ */
+class WheelTimer {
+public:
+    WheelTimer() : next(nullptr), prev(nullptr), linked(false) {
+    }
+
+    ~WheelTimer() {
+        detach();
+    }
+
+    /** Call func every period_ms, the first time period_ms from now
+     */
+    void attach(Callback<void()> func, uint32_t period_ms) {
+        start(func, period_ms, period_ms);
+    }
+
+    /** Call func once, delay_ms from now
+     */
+    void once(Callback<void()> func, uint32_t delay_ms) {
+        start(func, delay_ms, 0);
+    }
+
+    void detach() {
+        core_util_critical_section_enter();
+        TimerWheel &wheel = TimerWheel::get();
+        if (linked) {
+            wheel.remove(this);
+            if (!wheel.advancing) {
+                wheel.arm();
+            }
+        }
+        core_util_critical_section_exit();
+    }
+
+private:
+    friend class TimerWheel;
+
+    void start(Callback<void()> func, uint32_t delay_ms, uint32_t period) {
+        core_util_critical_section_enter();
+        TimerWheel &wheel = TimerWheel::get();
+        if (linked) {
+            wheel.remove(this);
+        }
+        // the next whole ms at least delay_ms from now
+        expiry = (monotonic_us() + (uint64_t)delay_ms * 1000 + 999) / 1000;
+        period_ms = period;
+        cb = func;
+        wheel.add(this);
+        core_util_critical_section_exit();
+    }
+
+    WheelTimer* next;
+    WheelTimer* prev;
+    uint64_t expiry;            // tick (ms) it is due
+    uint32_t period_ms;         // 0 = one shot
+    Callback<void()> cb;
+    uint8_t level;
+    uint8_t slot;
+    bool linked;
+};
+
+uint64_t TimerWheel::nextExpiry() const {
+    uint64_t next = NONE;
+    for (int l = 0; l < TIMERWHEEL_LEVELS; l++) {
+        uint64_t tick;
+        int s = firstSlot(l, tick);
+        if (s < 0) {
+            continue;
+        }
+        for (WheelTimer* t = slots[l][s]; t; t = t->next) {
+            if (t->expiry < next) {
+                next = t->expiry;
+            }
+        }
+    }
+    return next == NONE || next > current ? next : current;
+}
+
+void TimerWheel::add(WheelTimer* t) {
+    bool empty = true;
+    for (int l = 0; l < TIMERWHEEL_LEVELS; l++) {
+        empty = empty && !occupied[l];
+    }
+    if (empty && !advancing) {
+        current = monotonic_ms();   // nothing pending, the wheel can jump to now
+    }
+    place(t);
+    if (!advancing) {
+        arm();
+    }
+}
+
+void TimerWheel::place(WheelTimer* t) {
+    // the lowest level where the timer is in the current turn, a past timer in the current 1 ms slot
+    uint64_t expiry = t->expiry > current ? t->expiry : current;
+    for (int l = 0; l < TOP; l++) {
+        if ((expiry >> shift(l + 1)) == (current >> shift(l + 1))) {
+            link(t, l, (expiry >> shift(l)) & MASK);
+            return;
+        }
+    }
+    uint64_t slot = expiry >> shift(TOP);
+    if (slot - (current >> shift(TOP)) >= SLOTS) {
+        slot = (current >> shift(TOP)) + SLOTS - 1;     // too far: the last slot of the turn, placed again from there
+    }
+    link(t, TOP, slot & MASK);
+}
+
+void TimerWheel::link(WheelTimer* t, int level, int slot) {
+    WheelTimer* &head = slots[level][slot];
+    t->level = level;
+    t->slot = slot;
+    t->prev = nullptr;
+    t->next = head;
+    if (head) {
+        head->prev = t;
+    }
+    head = t;
+    occupied[level] |= 1U << slot;
+    t->linked = true;
+}
+
+void TimerWheel::remove(WheelTimer* t) {
+    if (t->prev) {
+        t->prev->next = t->next;
+    }
+    else {
+        slots[t->level][t->slot] = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    if (!slots[t->level][t->slot]) {
+        occupied[t->level] &= ~(1U << t->slot);
+    }
+    t->linked = false;
+}
+
+WheelTimer* TimerWheel::pop(int level, int slot) {
+    WheelTimer* t = slots[level][slot];
+    if (t) {
+        remove(t);
+    }
+    return t;
+}
+
+void TimerWheel::advance(uint64_t now) {
+    // process every tick up to now that has something to do, skipping straight to the next one
+    while (true) {
+        uint64_t tick = nextTick();
+        if (tick == NONE || tick > now) {
+            current = now + 1;
+            return;
+        }
+        current = tick;
+        for (int l = TOP; l > 0; l--) {
+            if (tick & (((uint64_t)1 << shift(l)) - 1)) {
+                continue;       // not the start of a slot of this level
+            }
+            int s = (tick >> shift(l)) & MASK;
+            while (WheelTimer* t = pop(l, s)) {
+                place(t);       // a level down, or back at the top if still further off than a turn
+            }
+        }
+        while (WheelTimer* t = pop(0, tick & MASK)) {
+            if (t->expiry > tick) {
+                place(t);
+                continue;
+            }
+            if (t->period_ms) {
+                // the next period from when it was due, unless that fell a whole period behind
+                t->expiry += t->period_ms;
+                if (t->expiry <= tick) {
+                    t->expiry = tick + t->period_ms;
+                }
+                place(t);
+            }
+            t->cb();
+        }
+        current = tick + 1;
+    }
+}
+
+#endif // _TIMERWHEEL_H_
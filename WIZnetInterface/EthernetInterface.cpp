@@ -24,12 +24,14 @@ EthernetInterface::EthernetInterface(PinName mosi, PinName miso, PinName sclk, P
         WIZnet_Chip(mosi, miso, sclk, cs, reset)
 {
     ip_set = false;
+    lease = 0;
 }
 
 EthernetInterface::EthernetInterface(SPI* spi, PinName cs, PinName reset) :
         WIZnet_Chip(spi, cs, reset)
 {
     ip_set = false;
+    lease = 0;
 }
 #endif
 
@@ -54,6 +56,7 @@ int EthernetInterface::init(uint8_t * mac)
 int EthernetInterface::init(uint8_t * mac, const char* ip, const char* mask, const char* gateway)
 {
     dhcp = false;
+    lease = 0;
     //
     for (int i =0; i < 6; i++) this->mac[i] = mac[i];
     //
@@ -147,6 +150,12 @@ int EthernetInterface::IPrenew(int timeout_ms)
     gateway = (dhcp.gateway[0]<<24) | (dhcp.gateway[1]<<16) | (dhcp.gateway[2]<<8) | dhcp.gateway[3];
     netmask = (dhcp.netmask[0]<<24) | (dhcp.netmask[1]<<16) | (dhcp.netmask[2]<<8) | dhcp.netmask[3];
     dnsaddr = (dhcp.dnsaddr[0]<<24) | (dhcp.dnsaddr[1]<<16) | (dhcp.dnsaddr[2]<<8) | dhcp.dnsaddr[3];
+    lease   = dhcp.lease;
     return 0;
 }
 
+uint32_t EthernetInterface::getLeaseTime()
+{
+    return lease;
+}
+
@@ -78,6 +78,12 @@ public:
   char* getMACAddress();
 
   int IPrenew(int timeout_ms = 15*1000);
+
+  /** Get the DHCP lease time
+  *
+  * @ returns lease time in seconds of the last DHCP setup, 0 if none was given (or a static IP)
+  */
+  uint32_t getLeaseTime();
     
 private:
     char ip_string[20];
@@ -85,6 +91,7 @@ private:
     char gw_string[20];
     char mac_string[20];
     bool ip_set;
+    uint32_t lease;
 };
 
 #include "TCPSocketConnection.h"
@@ -85,6 +85,7 @@ int DHCPClient::offer(uint8_t buf[], int size) {
                 memcpy(dnsaddr, p, 4);
                 break;
             case 51: // IP lease time 
+                lease = ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
                 break;
             case 54: // DHCP server
                 memcpy(siaddr, p, 4);
@@ -162,6 +163,7 @@ int DHCPClient::setup(int timeout_ms)
         return -1;
     }    
     eth->reg_rd_mac(SHAR, chaddr);
+    lease = 0;
     int interval_ms = 5*1000; // 5000msec
     if (timeout_ms < interval_ms) {
         interval_ms = timeout_ms;
@@ -185,13 +187,12 @@ int DHCPClient::setup(int timeout_ms)
             case 1:
                 send_size = discover();
                 m_udp->sendTo(m_server, (char*)m_buf, send_size);
-                m_interval.reset();
-                m_interval.start();
+                m_interval.countdown_ms(interval_ms);
                 seq++;
                 break;
             case 2:
                 callback();
-                if (m_interval.read_ms() > interval_ms) {
+                if (m_interval.expired()) {
                     DBG("m_retry: %d\n", m_retry);
                     if (++m_retry >= (timeout_ms/interval_ms)) {
                         err = -1;
@@ -202,7 +203,7 @@ int DHCPClient::setup(int timeout_ms)
                 break;
         }
     }
-    DBG("m_retry: %d, m_interval: %d\n", m_retry, m_interval.read_ms());
+    DBG("m_retry: %d, m_interval: %ld\n", m_retry, m_interval.left_ms());
     delete m_udp;
     return err;
 }
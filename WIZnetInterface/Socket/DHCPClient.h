@@ -3,6 +3,7 @@
 #define DHCPCLIENT_H
 #include "eth_arch.h"
 #include "UDPSocket.h"
+#include "TimerWheel.h"
 
 #define DHCP_OFFSET_OP 0
 #define DHCP_OFFSET_XID 4
@@ -31,6 +32,7 @@ public:
     uint8_t gateway[4];
     uint8_t netmask[4];
     uint8_t siaddr[4];
+    uint32_t lease; // lease time in seconds, 0 = not given
 private:
     int discover();
     int request();
@@ -45,7 +47,7 @@ private:
     Endpoint m_server;
     uint8_t xid[4];
     bool exit_flag;
-    Timer m_interval;
+    Deadline m_interval;
     int m_retry;
     uint8_t m_buf[DHCP_MAX_PACKET_SIZE];
     int m_pos;
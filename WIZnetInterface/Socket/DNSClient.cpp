@@ -122,8 +122,7 @@ void DNSClient::resolve(const char* hostname) {
     printHex(buf, size);
 #endif
     m_udp->sendTo(server, (char*)buf, size);
-    m_interval.reset();
-    m_interval.start();
+    m_interval.countdown_ms(1000);
 }
 
 void DNSClient::poll() {
@@ -144,11 +143,10 @@ void DNSClient::poll() {
         case MYNETDNS_ERROR: 
             break;
         case MYNETDNS_OK:
-            DBG2("m_retry=%d, m_interval=%d\n", m_retry, m_interval.read_ms());
+            DBG2("m_retry=%d, m_interval=%ld\n", m_retry, m_interval.left_ms());
             break;
     }
-    if (m_interval.read_ms() > 1000) {
-        m_interval.stop();
+    if (m_interval.expired()) {
         DBG2("timeout m_retry=%d\n", m_retry);
         if (++m_retry >= 2) {
             m_state = MYNETDNS_ERROR;
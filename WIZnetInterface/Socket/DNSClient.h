@@ -2,6 +2,7 @@
 #pragma once
 
 #include "UDPSocket.h"
+#include "TimerWheel.h"
  
 class DNSClient {
 public:
@@ -17,7 +18,7 @@ protected:
     int query(uint8_t buf[], int size, const char* hostname);
     void resolve(const char* hostname);
     uint8_t m_id[2];
-    Timer m_interval;
+    Deadline m_interval;
     int m_retry;
     const char* m_hostname;
 private:
@@ -29,7 +29,7 @@ Socket::Socket() : _sock_fd(-1),_blocking(true), _timeout(1500)
 void Socket::set_blocking(bool blocking, unsigned int timeout)
 {
     _blocking = blocking;
-    _timeout = timeout;
+    _timeout = (int)timeout < 0 ? 0 : timeout;     // the time left on a timer that ran out: don't wait (-1 is forever)
 }
 
 int Socket::close()
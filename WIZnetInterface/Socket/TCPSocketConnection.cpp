@@ -107,7 +107,7 @@ int TCPSocketConnection::receive(char* data, int length, int timeout)
 	if((_sock_fd<0) || !(eth->is_connected(_sock_fd)))
 		return -1;
 
-    int size = eth->wait_readable(_sock_fd, _blocking ? -1 : timeout);
+    int size = eth->wait_readable(_sock_fd, _blocking ? -1 : (timeout > 0 ? timeout : 0));   // run out: don't wait
     if (size < 0) {
         return 0;
     }
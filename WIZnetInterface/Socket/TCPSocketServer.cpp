@@ -17,6 +17,7 @@
  */
 
 #include "TCPSocketServer.h"
+#include "TimerWheel.h"
 
 TCPSocketServer::TCPSocketServer() {}
 
@@ -58,16 +59,14 @@ int TCPSocketServer::accept(TCPSocketConnection& connection)
     if (_sock_fd < 0) {
         return -1;
     }
-    Timer t;
-    t.reset();
-    t.start();
+    Deadline deadline(_timeout);
     while(1) {
-        if (t.read_ms() > _timeout && _blocking == false) {
-            return -1;
-        }
         if (eth->sreg<uint8_t>(_sock_fd, Sn_SR) == WIZnet_Chip::SOCK_ESTABLISHED) {
             break;
         }
+        if (deadline.expired() && _blocking == false) {
+            return -1;
+        }
     }
     uint32_t ip = eth->sreg<uint32_t>(_sock_fd, Sn_DIPR);
     char host[16];
@@ -68,7 +68,7 @@ int UDPSocket::sendTo(Endpoint &remote, char *packet, int length)
 }
 
 // -1 if unsuccessful, else number of bytes received
-int UDPSocket::receiveFrom(Endpoint &remote, char *buffer, int length)
+int UDPSocket::receiveFrom(Endpoint &remote, char *buffer, int length, bool truncate)
 {
     uint8_t info[8];
     int size = eth->wait_readable(_sock_fd, _blocking ? -1 : _timeout, sizeof(info));
@@ -86,8 +86,15 @@ int UDPSocket::receiveFrom(Endpoint &remote, char *buffer, int length)
     /* Perform Length check here to prevent buffer overrun */
     /* fixed by Sean Newton (https://developer.mbed.org/users/SeanNewton/) */
     if (udp_size > length) {
-        //printf("udp_size: %d\n",udp_size);
-        return -1;
+        if (!truncate) {
+            //printf("udp_size: %d\n",udp_size);
+            return -1;
+        }
+        // keep what fits and skip the rest, else the datagram stays at the head of the buffer for good
+        eth->recv(_sock_fd, buffer, length);
+        eth->sreg<uint16_t>(_sock_fd, Sn_RX_RD, eth->sreg<uint16_t>(_sock_fd, Sn_RX_RD) + udp_size - length);
+        eth->scmd(_sock_fd, WIZnet_Chip::RECV);
+        return length;
     }
     return eth->recv(_sock_fd, buffer, udp_size);
 }
@@ -53,12 +53,13 @@ public:
     
     /** Receive a packet from a remote endpoint
     \param remote   The remote endpoint
-    \param buffer   The buffer for storing the incoming packet data. If a packet
-           is too long to fit in the supplied buffer, excess bytes are discarded
+    \param buffer   The buffer for storing the incoming packet data
     \param length   The length of the buffer
+    \param truncate If a packet is too long to fit in the supplied buffer: true keeps what fits and
+           discards the excess bytes, false fails and leaves the packet in the socket
     \return the number of received bytes on success (>=0) or -1 on failure
     */
-    int receiveFrom(Endpoint &remote, char *buffer, int length);
+    int receiveFrom(Endpoint &remote, char *buffer, int length, bool truncate = false);
     
 private:
     void confEndpoint(Endpoint & ep);
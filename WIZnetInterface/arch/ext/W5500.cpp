@@ -24,6 +24,7 @@
 #include "mbed.h"
 #include "mbed_debug.h"
 #include "DNSClient.h"
+#include "TimerWheel.h"
 
 
 //Debug is disabled by default
@@ -107,11 +108,9 @@ bool WIZnet_Chip::connect(int socket, const char * host, int port, int timeout_m
     sreg<uint16_t>(socket, Sn_DPORT, port);
     sreg<uint16_t>(socket, Sn_PORT, new_port());
     scmd(socket, CONNECT);
-    Timer t;
-    t.reset();
-    t.start();
+    Deadline deadline(timeout_ms);
     while(!is_connected(socket)) {
-        if (t.read_ms() > timeout_ms) {
+        if (deadline.expired()) {
             return false;
         }
     }
@@ -205,9 +204,7 @@ int WIZnet_Chip::wait_readable(int socket, int wait_time_ms, int req_size)
     if (socket < 0) {
         return -1;
     }
-    Timer t;
-    t.reset();
-    t.start();
+    Deadline deadline(wait_time_ms);
     while(1) {
         //int size = sreg<uint16_t>(socket, Sn_RX_RSR);
         // during the reading Sn_RX_RXR, it has the possible change of this register.
@@ -221,7 +218,7 @@ int WIZnet_Chip::wait_readable(int socket, int wait_time_ms, int req_size)
         if (size > req_size) {
             return size;
         }
-        if (wait_time_ms != (-1) && t.read_ms() > wait_time_ms) {
+        if (wait_time_ms >= 0 && deadline.expired()) {
             break;
         }
     }
@@ -233,9 +230,7 @@ int WIZnet_Chip::wait_writeable(int socket, int wait_time_ms, int req_size)
     if (socket < 0) {
         return -1;
     }
-    Timer t;
-    t.reset();
-    t.start();
+    Deadline deadline(wait_time_ms);
     while(1) {
         //int size = sreg<uint16_t>(socket, Sn_TX_FSR);
         // during the reading Sn_TX_FSR, it has the possible change of this register.
@@ -249,7 +244,7 @@ int WIZnet_Chip::wait_writeable(int socket, int wait_time_ms, int req_size)
         if (size > req_size) {
             return size;
         }
-        if (wait_time_ms != (-1) && t.read_ms() > wait_time_ms) {
+        if (wait_time_ms >= 0 && deadline.expired()) {
             break;
         }
     }
@@ -330,16 +325,14 @@ uint16_t WIZnet_Chip::new_port()
 
 bool WIZnet_Chip::link(int wait_time_ms)
 {
-	Timer t;
-	t.reset();
-	t.start();
+	Deadline deadline(wait_time_ms);
 	while(1) {
 		int is_link = ethernet_link();
 		
 		if (is_link) {
 			return true;
 		}
-		if (wait_time_ms != (-1) && t.read_ms() > wait_time_ms) {
+		if (wait_time_ms >= 0 && deadline.expired()) {
 			break;
 		}
 	}
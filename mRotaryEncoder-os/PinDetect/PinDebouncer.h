@@ -0,0 +1,243 @@
+#ifndef PIN_DEBOUNCER_H
+#define PIN_DEBOUNCER_H
+
+#include "mbed.h"
+#include "TimerWheel.h"
+
+#ifndef DEBOUNCER_MAX_PORTS
+#define DEBOUNCER_MAX_PORTS 3       // GPIO ports with watched pins (A, B and C on the bluepill)
+#endif
+#define DEBOUNCER_COUNT_BITS 4      // samples to accept a change: 1 - 15
+#define DEBOUNCER_HOLD_BITS 8       // samples until held: 1 - 255
+
+/** A pin watched by the PinDebouncer, told about its debounced changes (from the sampling interrupt)
+ */
+class DebouncedPin {
+public:
+    virtual ~DebouncedPin() {
+    }
+
+private:
+    friend class PinDebouncer;
+    virtual void debounced(int level) = 0;
+    virtual void held(int level) = 0;
+};
+
+/** Debouncer for any number of pins on one sampling tick.
+ *
+ * Every tick reads each GPIO port with watched pins once (IDR) and debounces all its pins at once with
+ * vertical counters: bit N of count[k] is bit k of pin N's counter, so a whole port's counters are
+ * incremented, reset and compared to their thresholds with a few word operations, however many pins are
+ * watched. Per pin there are two counters: samples in a row that differ from the debounced level (a change
+ * is accepted when it reaches the pin's threshold), and samples the level has held since it changed (held
+ * is reported once it reaches the pin's hold count, a bounce in between cancels it). Pins are only called
+ * on a change or held, so the interrupt load is one short tick per period.
+ *
+ * All pins share the sample period, the tick is on the TimerWheel.
+ */
+class PinDebouncer {
+public:
+    static PinDebouncer& get() {
+        static PinDebouncer debouncer;
+        return debouncer;
+    }
+
+    /** Watch a pin, from its current level
+     *  @param samples samples in a row at the new level to accept a change (1 - 15)
+     *  @param hold samples at the same level after a change to report it held (0 = never, up to 255)
+     */
+    void add(DebouncedPin* pin, PinName name, int samples, int hold) {
+        core_util_critical_section_enter();
+        Port* port = find(STM_PORT(name), true);
+        if (port) {
+            uint32_t bit = 1UL << STM_PIN(name);
+            port->pins[STM_PIN(name)] = pin;
+            port->watched |= bit;
+            port->state = (port->state & ~bit) | (port->gpio->IDR & bit);
+            clear(port, bit);
+            setThresholds(port, bit, samples, hold);
+        }
+        core_util_critical_section_exit();
+        if (!port) {
+            error("PinDebouncer: too many ports\r\n");
+        }
+    }
+
+    void remove(PinName name) {
+        core_util_critical_section_enter();
+        Port* port = find(STM_PORT(name), false);
+        if (port) {
+            uint32_t bit = 1UL << STM_PIN(name);
+            port->watched &= ~bit;
+            port->pins[STM_PIN(name)] = nullptr;
+            clear(port, bit);
+            if (!port->watched) {
+                port->gpio = nullptr;       // free the slot
+            }
+        }
+        bool any = false;
+        for (int p = 0; p < DEBOUNCER_MAX_PORTS; p++) {
+            any = any || ports[p].gpio;
+        }
+        if (!any) {
+            ticker.detach();
+            period_ms = 0;
+        }
+        core_util_critical_section_exit();
+    }
+
+    /** Change a watched pin's thresholds (see add())
+     */
+    void setThresholds(PinName name, int samples, int hold) {
+        core_util_critical_section_enter();
+        Port* port = find(STM_PORT(name), false);
+        if (port) {
+            setThresholds(port, 1UL << STM_PIN(name), samples, hold);
+        }
+        core_util_critical_section_exit();
+    }
+
+    /** Sample every period_ms (whole ms, at least 1), for all pins
+     */
+    void setPeriod(uint32_t ms) {
+        if (ms == 0) {
+            ms = 1;
+        }
+        if (ms != period_ms) {
+            period_ms = ms;
+            ticker.attach(callback(this, &PinDebouncer::tick), ms);
+        }
+    }
+
+    /** Debounced level of a watched pin
+     */
+    int level(PinName name) {
+        Port* port = find(STM_PORT(name), false);
+        return port ? (port->state >> STM_PIN(name)) & 1 : 0;
+    }
+
+private:
+    struct Port {
+        GPIO_TypeDef* gpio;     // nullptr = slot free
+        uint8_t index;          // STM_PORT
+        uint16_t watched;
+        uint16_t state;         // debounced levels
+        uint16_t holding;       // pins that changed and may still report held
+        uint16_t count[DEBOUNCER_COUNT_BITS];       // samples in a row differing from state
+        uint16_t change_at[DEBOUNCER_COUNT_BITS];   // thresholds, as counters
+        uint16_t hold[DEBOUNCER_HOLD_BITS];         // samples since the change
+        uint16_t hold_at[DEBOUNCER_HOLD_BITS];
+        uint16_t hold_on;       // pins with a hold count
+        DebouncedPin* pins[16];
+    };
+
+    PinDebouncer() : period_ms(0) {
+        for (int p = 0; p < DEBOUNCER_MAX_PORTS; p++) {
+            ports[p].gpio = nullptr;
+        }
+    }
+
+    Port* find(uint8_t index, bool create) {
+        Port* free = nullptr;
+        for (int p = 0; p < DEBOUNCER_MAX_PORTS; p++) {
+            if (ports[p].gpio && ports[p].index == index) {
+                return &ports[p];
+            }
+            if (!ports[p].gpio && !free) {
+                free = &ports[p];
+            }
+        }
+        if (!create || !free) {
+            return nullptr;
+        }
+        memset(free, 0, sizeof(Port));
+        free->gpio = (GPIO_TypeDef*)(GPIOA_BASE + index * (GPIOB_BASE - GPIOA_BASE));
+        free->index = index;
+        return free;
+    }
+
+    static void clear(Port* port, uint32_t bit) {
+        for (int k = 0; k < DEBOUNCER_COUNT_BITS; k++) {
+            port->count[k] &= ~bit;
+        }
+        for (int k = 0; k < DEBOUNCER_HOLD_BITS; k++) {
+            port->hold[k] &= ~bit;
+        }
+        port->holding &= ~bit;
+    }
+
+    static void setThresholds(Port* port, uint32_t bit, int samples, int hold) {
+        samples = samples < 1 ? 1 : samples >= 1 << DEBOUNCER_COUNT_BITS ? (1 << DEBOUNCER_COUNT_BITS) - 1 : samples;
+        hold = hold < 0 ? 0 : hold >= 1 << DEBOUNCER_HOLD_BITS ? (1 << DEBOUNCER_HOLD_BITS) - 1 : hold;
+        for (int k = 0; k < DEBOUNCER_COUNT_BITS; k++) {
+            port->change_at[k] = (samples >> k) & 1 ? port->change_at[k] | bit : port->change_at[k] & ~bit;
+        }
+        for (int k = 0; k < DEBOUNCER_HOLD_BITS; k++) {
+            port->hold_at[k] = (hold >> k) & 1 ? port->hold_at[k] | bit : port->hold_at[k] & ~bit;
+        }
+        port->hold_on = hold ? port->hold_on | bit : port->hold_on & ~bit;
+    }
+
+    /** Count the pins in mask up by one and the rest back to 0
+     */
+    static void increment(uint16_t* planes, int bits, uint32_t mask) {
+        uint32_t carry = mask;
+        for (int k = 0; k < bits; k++) {
+            uint32_t next = planes[k] & carry;
+            planes[k] = (planes[k] ^ carry) & mask;
+            carry = next;
+        }
+    }
+
+    /** The pins in mask whose counter equals its threshold
+     */
+    static uint32_t reached(const uint16_t* planes, const uint16_t* at, int bits, uint32_t mask) {
+        for (int k = 0; k < bits; k++) {
+            mask &= ~(planes[k] ^ at[k]);
+        }
+        return mask;
+    }
+
+    void tick() {
+        for (int p = 0; p < DEBOUNCER_MAX_PORTS; p++) {
+            Port &port = ports[p];
+            if (!port.gpio) {
+                continue;
+            }
+            uint32_t delta = (port.gpio->IDR ^ port.state) & port.watched;
+            increment(port.count, DEBOUNCER_COUNT_BITS, delta);
+            uint32_t changed = reached(port.count, port.change_at, DEBOUNCER_COUNT_BITS, delta);
+            for (int k = 0; k < DEBOUNCER_COUNT_BITS; k++) {
+                port.count[k] &= ~changed;
+            }
+            port.state ^= changed;
+            // a bounce after a change cancels held, a change starts counting again (this sample is the first)
+            port.holding = (port.holding & ~(delta & ~changed)) | (changed & port.hold_on);
+            for (int k = 0; k < DEBOUNCER_HOLD_BITS; k++) {
+                port.hold[k] &= ~changed;
+            }
+            increment(port.hold, DEBOUNCER_HOLD_BITS, port.holding);
+            uint32_t held = reached(port.hold, port.hold_at, DEBOUNCER_HOLD_BITS, port.holding);
+            port.holding &= ~held;
+            while (changed | held) {
+                int pin = __builtin_ctz(changed | held);
+                uint32_t bit = 1UL << pin;
+                int level = (port.state >> pin) & 1;
+                if (changed & bit) {
+                    port.pins[pin]->debounced(level);
+                }
+                if (held & bit) {
+                    port.pins[pin]->held(level);
+                }
+                changed &= ~bit;
+                held &= ~bit;
+            }
+        }
+    }
+
+    Port ports[DEBOUNCER_MAX_PORTS];
+    WheelTimer ticker;
+    uint32_t period_ms;
+};
+
+#endif
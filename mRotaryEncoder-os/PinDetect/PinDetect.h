@@ -21,6 +21,7 @@
 #define PIN_DETECT_H
 
 #include "mbed.h"
+#include "PinDebouncer.h"
 
 #ifndef PINDETECT_PIN_ASSERTED
 #define PINDETECT_PIN_ASSERTED   1
@@ -59,6 +60,9 @@ namespace AjK {
  *
  * Only callbacks that have been attached will be called by the library.
  *
+ * Sampling is done by the PinDebouncer, for every PinDetect on one tick: the sample
+ * frequency is shared, the last one set applies to all of them.
+ *
  * Example:
  * @code
  * #include "mbed.h"
@@ -121,18 +125,17 @@ namespace AjK {
  * The above is a very basic introduction. For more details:-
  * @see example.h
  */
-class PinDetect {
+class PinDetect : public DebouncedPin {
 
 protected:
     DigitalIn   *_in;
-    Ticker      *_ticker;
+    PinName     _pin;
+    bool        _sampling;
     int         _prevState;
     int         _sampleTime;
     int         _assertValue;
     int         _samplesTillAssertReload;
-    int         _samplesTillAssert;
     int         _samplesTillHeldReload;
-    int         _samplesTillHeld;
     Callback<void()> _callbackAsserted;
     Callback<void()> _callbackDeasserted;
     Callback<void()> _callbackAssertedHeld;
@@ -145,8 +148,6 @@ protected:
      */
     void init(PinName p, PinMode m) {
         _sampleTime              = PINDETECT_SAMPLE_PERIOD;
-        _samplesTillAssert       = PINDETECT_ASSERT_COUNT;
-        _samplesTillHeld         = 0;
         _samplesTillAssertReload = PINDETECT_ASSERT_COUNT;
         _samplesTillHeldReload   = PINDETECT_HOLD_COUNT;
         _assertValue             = PINDETECT_PIN_ASSERTED;
@@ -154,11 +155,11 @@ protected:
         _in = new DigitalIn(p);
         _in->mode(m);
         _prevState = _in->read();
-        _ticker = new Ticker;
+        _pin = p;
+        _sampling = false;
     }
 
 public:
-    friend class Ticker;
 
     PinDetect() {
         error("You must supply a PinName");
@@ -188,18 +189,24 @@ public:
     /** PinDetect destructor
      */
     ~PinDetect() {
-        if (_ticker) delete(_ticker);
+        if (_sampling) PinDebouncer::get().remove(_pin);
         if (_in) delete(_in);
     }
 
     /** Set the sampling time in microseconds.
+     *
+     * Sampling runs on the TimerWheel, so the period is rounded to whole ms (at least 1).
+     * It is the PinDebouncer's period, for every PinDetect.
      *
      * @param int The time between pin samples in microseconds.
      */
     void setSampleFrequency(int i=PINDETECT_SAMPLE_PERIOD) {
+        PinDebouncer &debouncer = PinDebouncer::get();
         _sampleTime = i;
         _prevState = _in->read();
-        _ticker->attach_us(callback(this, &PinDetect::isr), _sampleTime);
+        debouncer.add(this, _pin, _samplesTillAssertReload + 1, _samplesTillHeldReload);
+        debouncer.setPeriod(_sampleTime < 1000 ? 1 : (_sampleTime + 500) / 1000);
+        _sampling = true;
     }
 
     /** Set the value used as assert.
@@ -220,6 +227,7 @@ public:
      */
     void setSamplesTillAssert(int i) {
         _samplesTillAssertReload = i;
+        if (_sampling) PinDebouncer::get().setThresholds(_pin, _samplesTillAssertReload + 1, _samplesTillHeldReload);
     }
 
     /** Set the number of continuous samples until held assumed.
@@ -230,6 +238,7 @@ public:
      */
     void setSamplesTillHeld(int i) {
         _samplesTillHeldReload = i;
+        if (_sampling) PinDebouncer::get().setThresholds(_pin, _samplesTillAssertReload + 1, _samplesTillHeldReload);
     }
 
     /** Set the pin mode.
@@ -346,44 +355,25 @@ public:
     }
 
 protected:
-    /** The Ticker periodic callback function
+    /** Called by the PinDebouncer when the pin changed (after samplesTillAssert + 1 samples)
+     */
+    void debounced(int level) {
+        _prevState = level;
+        if (level == _assertValue) {
+            if (_callbackAsserted)
+                _callbackAsserted();
+        } else if (_callbackDeasserted)
+            _callbackDeasserted();
+    }
+
+    /** Called by the PinDebouncer when the pin held its level for samplesTillHeld samples after a change
      */
-    void isr(void) {
-        int currentState = _in->read();
-
-        if (currentState != _prevState) {
-            if (_samplesTillAssert == 0) {
-                _prevState = currentState;
-                _samplesTillHeld = _samplesTillHeldReload;
-                if (currentState == _assertValue) {
-                    if (_callbackAsserted)
-                        _callbackAsserted();
-                } else if (_callbackDeasserted)
-                    _callbackDeasserted();
-            }
-            else {
-                _samplesTillAssert--;
-            }
-        }
-        else {
-            _samplesTillAssert = _samplesTillAssertReload;
-        }
-
-        if (_samplesTillHeld) {
-            if (_prevState == currentState) {
-                _samplesTillHeld--;
-                if (_samplesTillHeld == 0) {
-                    if (currentState == _assertValue) {
-                        if (_callbackAssertedHeld)
-                            _callbackAssertedHeld();
-                    } else if (_callbackDeassertedHeld)
-                        _callbackDeassertedHeld();
-                }
-            }
-            else {
-                _samplesTillHeld = 0;
-            }
-        }
+    void held(int level) {
+        if (level == _assertValue) {
+            if (_callbackAssertedHeld)
+                _callbackAssertedHeld();
+        } else if (_callbackDeassertedHeld)
+            _callbackDeassertedHeld();
     }
 
 };
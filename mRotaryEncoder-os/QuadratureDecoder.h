@@ -0,0 +1,124 @@
+#ifndef QUADRATURE_DECODER_H
+#define QUADRATURE_DECODER_H
+
+#include <stdint.h>
+
+/** Quadrature decoder: the position of a rotary encoder from the states of its A and B switches.
+ *
+ * Every change of either switch is looked up in a table of the 16 transitions between the 4 states
+ * (A,B): a step of a quarter cycle either way, none, or an error when both switches changed at once (a
+ * state was missed, its direction is unknown). Contact bounce only steps back and forth, so needs no
+ * debouncing. The position counts detents, a number of quarter steps (4 for an encoder with a detent per
+ * cycle, 2 for one with a detent every half cycle), so bounce and jitter within a detent move nothing.
+ *
+ * With acceleration on, a detent turned within fast_us of the one before (the same way) moves the
+ * position by up to max_multiplier, in proportion to the speed.
+ *
+ * No hardware is involved, times are passed in (us, any free running clock).
+ */
+class QuadratureDecoder {
+public:
+    QuadratureDecoder(int counts_per_detent = 4) : state(0), counts(0), pos(0), errs(0), last_us(0), last_dir(0),
+        fast_us(0), max_mult(1) {
+        setCountsPerDetent(counts_per_detent);
+    }
+
+    /** Start from the switches' current state
+     */
+    void reset(int a, int b) {
+        state = (a ? 2 : 0) | (b ? 1 : 0);
+        counts = 0;
+    }
+
+    /** The switches changed (either one, or both)
+     *  @return detents turned: 1 clockwise, -1 counterclockwise, or 0
+     */
+    int update(int a, int b, uint32_t now_us) {
+        // index: previous state, new state; state = A << 1 | B, clockwise is 00 -> 10 -> 11 -> 01 -> 00
+        static const int8_t steps[16] = {
+            0, -1,  1,  ERR,
+            1,  0,  ERR, -1,
+           -1,  ERR, 0,  1,
+            ERR, 1, -1,  0
+        };
+        int next = (a ? 2 : 0) | (b ? 1 : 0);
+        int step = steps[state << 2 | next];
+        state = next;
+        if (step == ERR) {
+            errs++;
+            return 0;
+        }
+        return advance(step, now_us);
+    }
+
+    /** Quarter steps counted elsewhere (eg: by a timer in encoder mode), since the last call
+     *  @return detents turned, negative counterclockwise
+     */
+    int addCounts(int steps, uint32_t now_us) {
+        return advance(steps, now_us);
+    }
+
+    int position() const {
+        return pos;
+    }
+
+    void setPosition(int value) {
+        pos = value;
+        counts = 0;
+    }
+
+    /** Transitions with both switches changed: turned faster than the switches are read
+     */
+    uint32_t errors() const {
+        return errs;
+    }
+
+    void setCountsPerDetent(int n) {
+        per_detent = n < 1 ? 1 : n;
+        counts = 0;
+    }
+
+    /** Move the position by up to max_multiplier detents per detent turned within fast_us of the last
+     *  @param fast_us 0 = off
+     */
+    void setAcceleration(uint32_t fast, int max_multiplier) {
+        fast_us = fast;
+        max_mult = max_multiplier < 1 ? 1 : max_multiplier;
+    }
+
+private:
+    enum {ERR = 2};
+
+    int advance(int steps, uint32_t now_us) {
+        counts += steps;
+        int detents = counts / per_detent;     // whole detents, the rest stays in counts
+        if (!detents) {
+            return 0;
+        }
+        counts -= detents * per_detent;
+        int dir = detents > 0 ? 1 : -1;
+        int n = detents * dir;
+        // detents counted together (by a timer) are spread evenly over the time since the last
+        uint32_t interval = (now_us - last_us) / n;
+        int mult = 1;
+        if (fast_us && dir == last_dir && interval < fast_us) {
+            mult += (int)((uint64_t)(max_mult - 1) * (fast_us - interval) / fast_us);
+        }
+        pos += detents * mult;
+        last_us = now_us;
+        last_dir = dir;
+        return detents;
+    }
+
+    uint8_t state;
+    int counts;             // quarter steps within the current detent
+    int per_detent;
+    int pos;
+    uint32_t errs;
+    uint32_t last_us;       // the last detent
+    int last_dir;
+    uint32_t fast_us;
+    int max_mult;
+};
+
+#endif
@@ -3,92 +3,126 @@
 
 
 mRotaryEncoder::mRotaryEncoder(PinName pinA, PinName pinB, PinName pinSW, PinMode pullMode, int debounceTime_us, int detectRise, int detectFall) {
-    m_pinA = new PinDetect(pinA);                      // interrrupts on pinA
-    m_pinB = new DigitalIn(pinB);                      // only digitalIn for pinB
+    m_pinA = new InterruptIn(pinA);                    // interrrupts on both pins, every edge
+    m_pinB = new InterruptIn(pinB);
+    m_timer = nullptr;
+    m_timerPins[0] = nullptr;
+    m_timerPins[1] = nullptr;
 
     //set pins with internal PullUP-default
     m_pinA->mode(pullMode);
     m_pinB->mode(pullMode);
 
-    // attach interrrupts on pinA
-    if (detectRise != 0){
-        m_pinA->attach_asserted(callback(this, &mRotaryEncoder::rise));
-    }
-    if (detectFall != 0){
-        m_pinA->attach_deasserted(callback(this, &mRotaryEncoder::fall));
+    // a detent every half cycle with both edges of pinA detected, else every cycle
+    m_decoder.setCountsPerDetent(detectRise != 0 && detectFall != 0 ? 2 : 4);
+    m_decoder.reset(m_pinA->read(), m_pinB->read());
+
+    // attach interrrupts on both pins, bouncing only steps back and forth
+    m_pinA->rise(callback(this, &mRotaryEncoder::edge));
+    m_pinA->fall(callback(this, &mRotaryEncoder::edge));
+    m_pinB->rise(callback(this, &mRotaryEncoder::edge));
+    m_pinB->fall(callback(this, &mRotaryEncoder::edge));
+
+    initSW(pinSW, pullMode, debounceTime_us);
+}
+
+mRotaryEncoder::mRotaryEncoder(TIM_TypeDef* timer, PinName pinA, PinName pinB, PinName pinSW, PinMode pullMode, int debounceTime_us, int countsPerDetent) {
+    m_pinA = nullptr;
+    m_pinB = nullptr;
+    m_timer = timer;
+
+    // the timer reads the pins as inputs (STM32F1: no alternate function needed for timer inputs)
+    m_timerPins[0] = new DigitalIn(pinA, pullMode);
+    m_timerPins[1] = new DigitalIn(pinB, pullMode);
+
+    if (timer == TIM2) {
+        __HAL_RCC_TIM2_CLK_ENABLE();
+    } else if (timer == TIM3) {
+        __HAL_RCC_TIM3_CLK_ENABLE();
+    } else if (timer == TIM4) {
+        __HAL_RCC_TIM4_CLK_ENABLE();
+    } else {
+        error("mRotaryEncoder: no encoder mode on this timer\r\n");
     }
-    
-    //start sampling pinA
-    m_pinA->setSampleFrequency(debounceTime_us);                  // Start timers an Defaults debounce time.
+    // encoder mode 3: counts every edge of both inputs, up or down by their order
+    timer->CR1 = 0;
+    timer->SMCR = TIM_SMCR_SMS_0 | TIM_SMCR_SMS_1;
+    // CH1 and CH2 inputs on TI1 and TI2, with the longest input filter against contact glitches
+    timer->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC2S_0 | TIM_CCMR1_IC1F | TIM_CCMR1_IC2F;
+    timer->CCER = 0;
+    timer->PSC = 0;
+    timer->ARR = 0xFFFF;
+    timer->CNT = 0;
+    timer->CR1 = TIM_CR1_CEN;
+    m_timerCount = 0;
+    m_decoder.setCountsPerDetent(countsPerDetent);
+
+    initSW(pinSW, pullMode, debounceTime_us);
+}
 
+void mRotaryEncoder::initSW(PinName pinSW, PinMode pullMode, int debounceTime_us) {
     // Switch on pinSW
     m_pinSW = new PinDetect(pinSW);                 // interrupt on press switch
     m_pinSW->mode(pullMode);
     
     m_pinSW->setSampleFrequency(debounceTime_us);                  // Start timers an Defaults debounce time.
 
-
-    m_position = 0;
-
     m_debounceTime_us = debounceTime_us;
 }
 
 mRotaryEncoder::~mRotaryEncoder() {
-    delete m_pinA;
-    delete m_pinB;
+    if (m_timer) {
+        m_timer->CR1 = 0;
+        delete m_timerPins[0];
+        delete m_timerPins[1];
+    } else {
+        delete m_pinA;
+        delete m_pinB;
+    }
     delete m_pinSW;
 }
 
 int mRotaryEncoder::Get(void) {
-    return m_position;
+    if (m_timer) {
+        // the steps the timer counted since the last Get()
+        core_util_critical_section_enter();
+        uint16_t count = m_timer->CNT;
+        m_decoder.addCounts((int16_t)(count - m_timerCount), (uint32_t)monotonic_us());
+        m_timerCount = count;
+        core_util_critical_section_exit();
+    }
+    return m_decoder.position();
 }
 
 
 
 void mRotaryEncoder::Set(int value) {
-    m_position = value;
+    core_util_critical_section_enter();
+    m_decoder.setPosition(value);
+    core_util_critical_section_exit();
 }
 
 
-void mRotaryEncoder::fall(void) {
-    // debouncing does PinDetect for us
-    //pinA still low?
-    if (*m_pinA == 0) {
-        if (*m_pinB == 1) {
-            m_position++;
-            if (rotCWIsr) {
-                rotCWIsr();
-            }
-        } else {
-            m_position--;
-            if (rotCWIsr){
-                rotCCWIsr();
-            }
-        }
-        if (rotIsr){
-            rotIsr();                        // call the isr for rotation
-        }
-    }
+void mRotaryEncoder::setAcceleration(uint32_t fast_us, int maxMultiplier) {
+    core_util_critical_section_enter();
+    m_decoder.setAcceleration(fast_us, maxMultiplier);
+    core_util_critical_section_exit();
 }
 
-void mRotaryEncoder::rise(void) {
-    //PinDetect does debouncing
-    //pinA still high?
-    if (*m_pinA == 1) {
-        if (*m_pinB == 1) {
-            m_position--;
-            if (rotCCWIsr){
-                rotCCWIsr();
-            }
-        } else {
-            m_position++;
-            if (rotCWIsr){
-                rotCWIsr();
-            }
+
+void mRotaryEncoder::edge(void) {
+    // either pin changed: decode the new state of both
+    int detents = m_decoder.update(m_pinA->read(), m_pinB->read(), (uint32_t)monotonic_us());
+    if (detents > 0) {
+        if (rotCWIsr) {
+            rotCWIsr();
         }
-        if (rotIsr){
-            rotIsr();                        // call the isr for rotation
+    } else if (detents < 0) {
+        if (rotCCWIsr) {
+            rotCCWIsr();
         }
     }
+    if (detents != 0 && rotIsr) {
+        rotIsr();                        // call the isr for rotation
+    }
 }
-
@@ -3,11 +3,13 @@
 
 #include "mbed.h"
 #include "PinDetect.h"
+#include "QuadratureDecoder.h"
 
 
 /** This Class handles a rotary encoder with mechanical switches and an integrated pushbutton
- * It uses two pins, one creating an interrupt on change.
- * Rotation direction is determined by checking the state of the other pin.
+ * Both pins interrupt on change, and every change is decoded by a transition table
+ * (QuadratureDecoder), so no step is lost to bounce or speed and missed states are counted.
+ * Alternatively a STM32 timer in encoder mode counts the steps, at no CPU cost.
  * Additionally a pushbutton switch is detected
  *
  * Operating the encoder changes an internal integer value that can be read
@@ -35,6 +37,7 @@
  * 26.11.2010 extended by charly - pushbutton, pullmode, debounce, callback-system
  * Feb2011 Changes InterruptIn to PinDetect which does the debounce of mechanical switches
  * Mar2020 Configurable detection of rise/fall events to account for different types of encoders (half as much dent points)
+ * Oct2026 Table driven decoding of both pins, error count, optional acceleration, timer encoder mode
  *
  */
 class mRotaryEncoder {
@@ -46,11 +49,26 @@ public:
     * @param pinSW Pin for push-button switch
     * @param pullmode mode for pinA pinB and pinSW like DigitalIn.mode
     * @param debounceTime_us time in micro-seconds to wait for bouncing of mechanical switches to end
+    *        (pushbutton only, rotation needs no debouncing)
     * @param detectRise Detect rise event as new rotation. default 1
     * @param detectFall Detect fall event as new rotation. default 1 
+    *        both: a detent every half cycle of pinA, one of them: every cycle
     */
     mRotaryEncoder(PinName pinA, PinName pinB, PinName pinSW, PinMode pullMode=PullUp, int debounceTime_us=1000, int detectRise=1, int detectFall=1);
 
+    /** Create a rotary encoder counted by a timer in encoder mode: the position is read from the
+    * timer's counter by Get(), the rotation callbacks aren't called
+    *
+    * @param timer TIM2, TIM3 or TIM4 (16 bit counter, Get() has to be called within 32767 quarter cycles)
+    * @param pinA Switch A, on the timer's channel 1 (STM32F1: PA_0 for TIM2, PA_6 for TIM3, PB_6 for TIM4)
+    * @param pinB Switch B, on the timer's channel 2 (PA_1, PA_7, PB_7)
+    * @param pinSW Pin for push-button switch
+    * @param pullmode mode for pinA pinB and pinSW like DigitalIn.mode
+    * @param debounceTime_us time in micro-seconds to wait for bouncing of the push-button to end
+    * @param countsPerDetent quarter cycles per detent, 4: a detent every cycle, 2: every half cycle
+    */
+    mRotaryEncoder(TIM_TypeDef* timer, PinName pinA, PinName pinB, PinName pinSW, PinMode pullMode=PullUp, int debounceTime_us=1000, int countsPerDetent=4);
+
     /** destroy object
     *
     */
@@ -76,6 +94,19 @@ public:
         return *this;
     }
 
+    /** Number of missed states: turned faster than the pins were read (not with a timer)
+    */
+    uint32_t Errors(void) {
+        return m_decoder.errors();
+    }
+
+    /** Turning fast moves the position by more than a detent
+    *
+    * @param fast_us a detent within this time of the last one (same direction) is accelerated, 0 = off
+    * @param maxMultiplier detents the position moves per detent at the highest speed
+    */
+    void setAcceleration(uint32_t fast_us, int maxMultiplier);
+
     /** attach a function to be called when switch is pressed
     *
     * keep this function short, as no interrrupts can occour within
@@ -177,17 +208,20 @@ public:
 */
 
 private:
-    PinDetect       *m_pinA;
-    DigitalIn       *m_pinB;
-    volatile int    m_position;
+    InterruptIn     *m_pinA;                // nullptr with a timer
+    InterruptIn     *m_pinB;
+    DigitalIn       *m_timerPins[2];
+    TIM_TypeDef     *m_timer;
+    uint16_t        m_timerCount;           // counter at the last Get()
+    QuadratureDecoder m_decoder;
 
     int             m_debounceTime_us;
 
 
     PinDetect       *m_pinSW;
 
-    void rise(void);
-    void fall(void);
+    void initSW(PinName pinSW, PinMode pullMode, int debounceTime_us);
+    void edge(void);
 
 protected:
     /**
@@ -7,6 +7,18 @@
 #include "MQTTClient.h"
 #include "MQTTNetwork.h"
 #include "MQTTmbed.h"
+#include "ReportByException.h"
+#include "GpioBank.h"
+#include "NumFormat.h"
+#include "CommandRouter.h"
+#include "CommandQueue.h"
+#include "FirmwareUpdate.h"
+#include "EdgeBroker.h"
+#include "BrokerList.h"
+#include "NetSupervisor.h"
+#include "TaskScheduler.h"
+#include "TimerWheel.h"
+#include "EdgeQueue.h"
 #include "mbed_thread.h"
 #include <cstdio>
 
@@ -14,32 +26,79 @@
 #define CONTROLLER_NAME "test"
 #define CONTROLLER_NUM_HEX 0x99
 #define WATCHDOG_TIMEOUT_MS 9999
-#define LOOP_SLEEP_MS 99
+#define NET_OFFLINE_POLL_MS 99      // network task period while the broker isn't connected
+#define NET_POLL_MS 2               // network task period while connected, MQTT is polled every run
+#define INPUT_SAMPLE_MS 10          // input sampling task period, the polled inputs are read this often
+#define INPUT_EDGE_QUEUE 32         // input edges queued by the interrupts for the input task (power of 2)
+#define TELEMETRY_MS 10             // report-by-exception publish task period
+#define SCHED_REPORT_SEC 60         // task load, longest run and deadline misses are reported this often
 #define MQTT_KEEPALIVE 20
+#define MQTT_VERSION 5              // 5 = MQTT 5 (repeat publishes use topic aliases), 4 = MQTT 3.1.1
 #define NET_TIMEOUT_MS 2000
+#define MQTT_WARM_STANDBY 0         // 1 = keep a second connection to the next broker, taken over when the active one fails
+#define MQTT_STANDBY_RETRY_SEC 30   // between attempts to connect the standby (each can hold the loop for NET_TIMEOUT_MS)
+#define BROKER_RECOVER_SEC 60       // each broker's health recovers a step this often, see BrokerList.h
+#define FLEET_PHASE -1              // 0-255 = where in their periods this controller's periodic work falls, -1 = from CONTROLLER_NUM_HEX
 #define MAX_DS1820 9
+#define RBE_IO_REFRESH_SEC 30       // integrity refresh of unchanged inputs/outputs
+#define RBE_TEMP_REFRESH_SEC 60     // integrity refresh of unchanged temperatures
+#define RBE_TEMP_DEADBAND 2         // temperatures are held in DS1820 1/16 degC, so 0.125 degC
+#define RBE_TEMP_MIN_SEC 5          // minimum time between temperature change reports
+#define RBE_UPTIME_REFRESH_SEC 15
+#define RBE_MAX_PER_PASS 4          // max reports published per main loop pass
+#define TEMP_DECIMALS 2             // decimal places of published temperatures
+#define CMND_QUEUE_DEPTH 4          // received commands held until the main loop runs them
+#define CMND_MAX_TOPIC_LEN 48
+#define CMND_MAX_PAYLOAD_LEN 24
+#define IO_PER_PIN_TOPICS 0         // 1 = also publish stat/<name>/inputN and outputN (compatibility mode)
+#define MQTT_READ_BUF 100           // largest MQTT packet received (commands, acks)
+#define MQTT_SEND_BUF 100           // largest MQTT packet published
+#define MQTT_INFLIGHT_BUF 0         // publishes kept for resending, only used with cleansession 0
+#define EDGE_BROKER_PORT 1883       // local MQTT broker for sibling controllers and HMIs, 0 = off
+#define EDGE_MAX_CLIENTS (MQTT_WARM_STANDBY ? 4 : 5)   // each takes a W5500 socket, see EdgeBroker.h
+#define EDGE_MAX_FILTERS 12         // different topic filters subscribed on the local broker
+#define EDGE_PACKET_SIZE 128        // largest packet a local client can send
+#define EDGE_BRIDGE_UP ""           // local publishes passed on to the central broker, eg: "hmi/#" ("" = none)
+#define EDGE_BRIDGE_DOWN ""         // central broker topics passed on to local clients, eg: "site/#" ("" = none)
+#define EDGE_BRIDGE_DEPTH 4         // bridged publishes held until the main loop sends them on
+#define RAM_MQTT_SESSION 1024       // RAM budget per broker connection, the RAM_* budgets are checked at compile time (RAM report)
+#define RAM_EDGE_BROKER 1664
+#define RAM_RBE 1024                // report-by-exception signal table
+#define RAM_QUEUES 640              // command and bridge queues
+#define RAM_SCHEDULER 512
+#define RAM_INPUT_EDGES 384
+#define RAM_FIRMWARE_UPDATE 256
+#define RAM_COMPONENTS 6400         // all of them, the rest of the 20K is mbed OS, the stacks and the small globals
 
-Ticker tick_30sec;
-Ticker tick_15sec;
-Ticker tick_1sec;
-Ticker tick_500ms;
+typedef MQTT::PacketArena<MQTT_READ_BUF, MQTT_SEND_BUF, MQTT_INFLIGHT_BUF> MQTTArena;
+typedef MQTT::Client<MQTTNetwork, Countdown, MQTT_SEND_BUF, 5, MQTTArena> MQTTClient;
+typedef EdgeBroker<EDGE_MAX_CLIENTS, EDGE_MAX_FILTERS, EDGE_PACKET_SIZE> EdgeMQTT;
 
-bool flag_publish_info;
-bool flag_publish_inputs;
-bool flag_publish_outputs;
-bool flag_read_ds1820;
-bool flag_update_oled;
+WheelTimer tick_30sec;
+WheelTimer tick_30sec_phase;
+WheelTimer tick_1sec;
+WheelTimer tick_500ms;
 
 enum IO_state {IO_ON, IO_OFF};
 
 Watchdog &wd = Watchdog::get_instance();
 
 uint8_t mac_addr[6]={0x00, 0x00, 0x00, 0xBE, 0xEF, CONTROLLER_NUM_HEX};
-const char* mqtt_broker = "192.168.1.1";
-const int mqtt_port = 1883;
+
+// controller number bit reversed: any run of consecutive numbers is spread evenly over 0-255
+constexpr uint8_t bit_reverse(uint8_t b) {
+    return ((b & 0x01) << 7) | ((b & 0x02) << 5) | ((b & 0x04) << 3) | ((b & 0x08) << 1) |
+           ((b & 0x10) >> 1) | ((b & 0x20) >> 3) | ((b & 0x40) >> 5) | ((b & 0x80) >> 7);
+}
+const uint8_t fleet_phase = FLEET_PHASE >= 0 ? FLEET_PHASE : bit_reverse(CONTROLLER_NUM_HEX);
+const BrokerAddress brokers[] = {      // in order of preference
+    {"192.168.1.1", 1883},
+    {"192.168.1.2", 1883},
+};
+BrokerList broker_list(brokers, sizeof(brokers) / sizeof(brokers[0]));
 char const *topic_sub = "cmnd/" CONTROLLER_NAME "/+";
 char const *topic_cmnd = "cmnd/" CONTROLLER_NAME "/";
-char const *topic_pub = "stat/" CONTROLLER_NAME "/";
+char topic_ota[] = "cmnd/" CONTROLLER_NAME "/ota";
 char lwt_topic[] = "stat/" CONTROLLER_NAME "/online";
 char lwt_msg[] = "0";
 char mqtt_clientid[] = CONTROLLER_NAME;
@@ -47,18 +106,68 @@ char mqtt_clientid[] = CONTROLLER_NAME;
 unsigned long uptime_sec = 0;
 bool connected_net = false;
 bool connected_mqtt = false;
-uint8_t conn_failures = 0;
+NetSupervisor supervisor;   // chip, link, IP, TCP and MQTT layers of the broker connection
+uint64_t supervisor_epoch_ms;   // supervisor time starts with the main loop, the reconnect spread isn't spent on boot
+uint32_t clock_us() {
+    return monotonic_us();
+}
+TaskScheduler scheduler(clock_us);
+int task_inputs, task_net, task_telemetry, task_display, task_onewire;
+WheelTimer sched_wakeup;
+unsigned long sched_report_sec = SCHED_REPORT_SEC;
+EthernetInterface* ethernet;
+char ip_address[16] = "";
+unsigned long lease_renew_sec = 0;      // 0 = no lease to renew
+unsigned long lease_expiry_sec = 0;
+unsigned long broker_recover_sec = BROKER_RECOVER_SEC;
+
+// a connection to a broker
+struct MQTTSession {
+    MQTTSession(EthernetInterface* wiz) : net(wiz), client(net, NET_TIMEOUT_MS), broker(-1) {
+    }
+    MQTTNetwork net;
+    MQTTClient client;
+    int broker;         // index in brokers[], -1 = not connected
+};
+MQTTSession* active;        // the session the controller publishes and takes commands on
+#if MQTT_WARM_STANDBY
+MQTTSession* standby;       // connected to the next broker, ready to take over
+unsigned long standby_retry_sec = 0;
+#endif
 
 #define NUM_INPUTS 9
-DigitalIn inputs[] = {PA_0, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7, PB_0};
+#define INPUT_PINS PA_0, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7, PB_0
+DigitalIn inputs[] = {INPUT_PINS};
+constexpr PinName input_pins[] = {INPUT_PINS};
+constexpr GpioBank<NUM_INPUTS> input_bank(input_pins);      // whole bank sampling: one IDR read a port
 bool input_state[NUM_INPUTS];
+#define NUM_IRQ_INPUTS 8            // inputs 0-7 interrupt on both edges, input 8 (PB_0) shares EXTI0 with PA_0 so is polled
+InterruptIn input_irq[] = {PA_0, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7};
+EdgeQueue<INPUT_EDGE_QUEUE> input_edges;
+uint32_t input_dropped_seen = 0;
+bool input_resync = true;           // read every input, not just the polled ones: at boot and after edges were dropped
+bool input_resynced = false;        // the last pass read every input: skip the edges it already saw
+uint32_t input_resync_us;
+uint32_t input_toggled = 0;         // inputs changed since the last inputbank message, also those back where they were
+uint32_t input_changes = 0;
+bool input_edge_pending = false;    // an edge not published yet, since input_edge_us
+uint32_t input_edge_us;
+uint32_t input_latency_us = 0;      // edge to inputbank publish, last and longest since the last task report
+uint32_t input_latency_max_us = 0;
 #define NUM_OUTPUTS 11
-DigitalOut outputs[] = {PB_7, PB_6, PB_5, PB_4, PB_3, PA_15, PA_12, PA_11, PA_10, PA_9, PA_8};
+#define OUTPUT_PINS PB_7, PB_6, PB_5, PB_4, PB_3, PA_15, PA_12, PA_11, PA_10, PA_9, PA_8
+DigitalOut outputs[] = {OUTPUT_PINS};
+constexpr PinName output_pins[] = {OUTPUT_PINS};
+constexpr GpioBank<NUM_OUTPUTS> output_bank(output_pins);   // whole bank reads and writes: one BSRR write a port
+WheelTimer output_pulse;
+volatile uint32_t output_pulse_mask;
+volatile uint32_t output_pulse_restore;
 DigitalOut led(PC_13);
 
 DS1820* temp_probe[MAX_DS1820];
 #define DS1820_DATA_PIN PB_1
 int num_ds1820 = 0;
+int ds1820_next = -1;       // probe read in the next 1-Wire step, -1 = start a conversion
 
 #define OLED_ADR   0x3c
 SSD1306I2C oled_i2c(OLED_ADR, PB_9, PB_8);
@@ -66,91 +175,352 @@ char oled_msg_line1[25];
 char oled_msg_line2[25];
 char oled_msg_line3[25];
 
+// every topic the controller publishes to, serialized at compile time (QoS, retained flag, topic)
+#define STAT_TOPIC(x) "stat/" CONTROLLER_NAME "/" x
+#define MAX_PUB_TOPIC_LEN 32
+typedef MQTT::PublishTopic<MAX_PUB_TOPIC_LEN> PubTopic;
+enum {
+    TOPIC_VERSION, TOPIC_IPADDRESS, TOPIC_ONLINE, TOPIC_INPUTS, TOPIC_OUTPUTS, TOPIC_DS1820,
+    TOPIC_INPUTBANK, TOPIC_OUTPUTBANK, TOPIC_UPTIME, TOPIC_OTA, TOPIC_RECOVERY, TOPIC_TASKS,
+    TOPIC_PROBETEMP0,
+#if IO_PER_PIN_TOPICS
+    TOPIC_INPUT0 = TOPIC_PROBETEMP0 + MAX_DS1820,
+    TOPIC_OUTPUT0 = TOPIC_INPUT0 + NUM_INPUTS,
+    NUM_PUB_TOPICS = TOPIC_OUTPUT0 + NUM_OUTPUTS
+#else
+    NUM_PUB_TOPICS = TOPIC_PROBETEMP0 + MAX_DS1820
+#endif
+};
+constexpr PubTopic pub_topics[] = {
+    {STAT_TOPIC("version"), MQTT::QOS1, true},
+    {STAT_TOPIC("IPAddress"), MQTT::QOS1, true},
+    {STAT_TOPIC("online"), MQTT::QOS1, true},
+    {STAT_TOPIC("inputs"), MQTT::QOS1, true},
+    {STAT_TOPIC("outputs"), MQTT::QOS1, true},
+    {STAT_TOPIC("ds1820"), MQTT::QOS1, true},
+    {STAT_TOPIC("inputbank"), MQTT::QOS1},
+    {STAT_TOPIC("outputbank"), MQTT::QOS1},
+    {STAT_TOPIC("uptime"), MQTT::QOS1},
+    {STAT_TOPIC("ota"), MQTT::QOS1},
+    {STAT_TOPIC("recovery"), MQTT::QOS1, true},
+    {STAT_TOPIC("tasks"), MQTT::QOS1},
+    {STAT_TOPIC("probetemp0"), MQTT::QOS1}, {STAT_TOPIC("probetemp1"), MQTT::QOS1}, {STAT_TOPIC("probetemp2"), MQTT::QOS1},
+    {STAT_TOPIC("probetemp3"), MQTT::QOS1}, {STAT_TOPIC("probetemp4"), MQTT::QOS1}, {STAT_TOPIC("probetemp5"), MQTT::QOS1},
+    {STAT_TOPIC("probetemp6"), MQTT::QOS1}, {STAT_TOPIC("probetemp7"), MQTT::QOS1}, {STAT_TOPIC("probetemp8"), MQTT::QOS1},
+#if IO_PER_PIN_TOPICS
+    {STAT_TOPIC("input0"), MQTT::QOS1}, {STAT_TOPIC("input1"), MQTT::QOS1}, {STAT_TOPIC("input2"), MQTT::QOS1},
+    {STAT_TOPIC("input3"), MQTT::QOS1}, {STAT_TOPIC("input4"), MQTT::QOS1}, {STAT_TOPIC("input5"), MQTT::QOS1},
+    {STAT_TOPIC("input6"), MQTT::QOS1}, {STAT_TOPIC("input7"), MQTT::QOS1}, {STAT_TOPIC("input8"), MQTT::QOS1},
+    {STAT_TOPIC("output0"), MQTT::QOS1}, {STAT_TOPIC("output1"), MQTT::QOS1}, {STAT_TOPIC("output2"), MQTT::QOS1},
+    {STAT_TOPIC("output3"), MQTT::QOS1}, {STAT_TOPIC("output4"), MQTT::QOS1}, {STAT_TOPIC("output5"), MQTT::QOS1},
+    {STAT_TOPIC("output6"), MQTT::QOS1}, {STAT_TOPIC("output7"), MQTT::QOS1}, {STAT_TOPIC("output8"), MQTT::QOS1},
+    {STAT_TOPIC("output9"), MQTT::QOS1}, {STAT_TOPIC("output10"), MQTT::QOS1},
+#endif
+};
+static_assert(sizeof(pub_topics) / sizeof(pub_topics[0]) == NUM_PUB_TOPICS, "pub_topics[] doesn't match the topic enum");
+
+#define RBE_MAX_SIGNALS (NUM_INPUTS + NUM_OUTPUTS + MAX_DS1820 + 3)
+ReportByException<RBE_MAX_SIGNALS> rbe;
+enum {FORMAT_INT, FORMAT_SIXTEENTHS};      // payload format of a signal
+int sig_input[NUM_INPUTS];
+int sig_output[NUM_OUTPUTS];
+int sig_input_bank;
+int sig_output_bank;
+int sig_temp[MAX_DS1820];
+int sig_uptime;
+uint16_t input_bank_seq = 0;
+uint16_t output_bank_seq = 0;
+
+
+void end_output_pulse() {
+    // put the pulsed outputs back as they were (timeout context, no blocking)
+    output_bank.write(output_pulse_mask, output_pulse_restore);
+    output_pulse_mask = 0;
+}
+
+void outputs_command(const CommandArgs &args) {
+    // outputs command: "<mask>,<value>[,<duration ms>]", eg: "0x003,0x001" or "0x00C,0x00C,500"
+    // every output in mask is switched to its bit in value with one port write (per port),
+    // with a duration the same outputs go back to their previous state afterwards
+    if (args.count < 2 || (args.values[0] & ~output_bank.all())) {
+        printf("%ld: Error: bad outputs command: %.*s\n", uptime_sec, args.payloadlen, args.payload);
+        return;
+    }
+    uint32_t mask = args.values[0];
+    uint32_t value = args.values[1];
+    uint32_t duration_ms = args.count > 2 ? args.values[2] : 0;
+    // a new command replaces any pulse still running, its outputs are left as they are now
+    output_pulse.detach();
+    output_pulse_mask = 0;
+    uint32_t previous = output_bank.read();
+    output_bank.write(mask, value);
+    printf("%ld: Outputs 0x%03lX set to 0x%03lX\n", uptime_sec, (unsigned long)mask, (unsigned long)(value & mask));
+    sprintf(oled_msg_line2, "Outputs 0x%03lX=0x%03lX", (unsigned long)mask, (unsigned long)(value & mask));
+    if (duration_ms) {
+        output_pulse_restore = previous;
+        output_pulse_mask = mask;
+        output_pulse.once(&end_output_pulse, duration_ms);
+    }
+}
+
+void output_command(const CommandArgs &args) {
+    // output# command: "1" or "0"
+    if (args.index >= NUM_OUTPUTS) {
+        printf("%ld: Error: unknown output number: %d\n", uptime_sec, args.index);
+        return;
+    }
+    printf("%ld: Turning output %d %s\n", uptime_sec, args.index, args.values[0] ? "ON" : "OFF");
+    sprintf(oled_msg_line2, "Output %d %s", args.index, args.values[0] ? "ON" : "OFF");
+    // take the output out of a pulse still running, which would put it back when it ends (and stop the
+    // pulse if this was its last output)
+    uint32_t bit = 1UL << args.index;
+    core_util_critical_section_enter();
+    output_pulse_mask &= ~bit;
+    if (!output_pulse_mask) {
+        output_pulse.detach();
+    }
+    output_bank.write(bit, args.values[0] ? output_bank.all() : 0);
+    core_util_critical_section_exit();
+}
+
+// commands received on cmnd/<name>/<sub-topic>
+const Command commands[] = {
+    {"outputs",     command_parse_numbers,  outputs_command},
+    {"output%u",    command_parse_bool,     output_command},
+};
+CommandRouter command_router(topic_cmnd, commands, sizeof(commands) / sizeof(commands[0]));
+
+CommandQueue<CMND_QUEUE_DEPTH, CMND_MAX_TOPIC_LEN, CMND_MAX_PAYLOAD_LEN> command_queue;
+FirmwareUpdate ota;         // cmnd/<name>/ota frames, see FirmwareUpdate.h
+WheelTimer ota_reboot;
+EdgeMQTT edge;              // local broker
+CommandQueue<EDGE_BRIDGE_DEPTH, CMND_MAX_TOPIC_LEN, CMND_MAX_PAYLOAD_LEN> bridge_queue;
+
+// RAM report: what the settings cost, worked out by the compiler for the target. A setting that takes a
+// component over its budget fails the build here, rather than as a heap or stack overflow at run time.
+constexpr unsigned ram_mqtt = sizeof(MQTTSession) * (1 + MQTT_WARM_STANDBY);
+constexpr unsigned ram_queues = sizeof(command_queue) + sizeof(bridge_queue);
+constexpr unsigned ram_components = ram_mqtt + sizeof(EdgeMQTT) + sizeof(rbe) + ram_queues + sizeof(scheduler) +
+                                    sizeof(input_edges) + sizeof(ota);
+static_assert(sizeof(MQTTSession) <= RAM_MQTT_SESSION, "MQTT session over RAM_MQTT_SESSION, see MQTT_READ_BUF, MQTT_SEND_BUF and MQTT_INFLIGHT_BUF");
+static_assert(sizeof(EdgeMQTT) <= RAM_EDGE_BROKER, "local broker over RAM_EDGE_BROKER, see EDGE_MAX_CLIENTS, EDGE_MAX_FILTERS and EDGE_PACKET_SIZE");
+static_assert(sizeof(rbe) <= RAM_RBE, "report-by-exception table over RAM_RBE, see RBE_MAX_SIGNALS");
+static_assert(ram_queues <= RAM_QUEUES, "command queues over RAM_QUEUES, see CMND_QUEUE_DEPTH, EDGE_BRIDGE_DEPTH and CMND_MAX_*_LEN");
+static_assert(sizeof(scheduler) <= RAM_SCHEDULER, "task scheduler over RAM_SCHEDULER");
+static_assert(sizeof(input_edges) <= RAM_INPUT_EDGES, "input edge queue over RAM_INPUT_EDGES, see INPUT_EDGE_QUEUE");
+static_assert(sizeof(ota) <= RAM_FIRMWARE_UPDATE, "firmware update over RAM_FIRMWARE_UPDATE");
+static_assert(ram_components <= RAM_COMPONENTS, "components over RAM_COMPONENTS, with MQTT_WARM_STANDBY too");
 
 void message_handler(MQTT::MessageData& md)
 {
-    // MQTT callback function
+    // MQTT callback function, runs inside the client (which may be waiting for an ack), so only
+    // queue the command here, the main loop runs it (and the client PUBACKs it straight away)
     MQTT::Message &message = md.message;
-    char topic[md.topicName.lenstring.len + 1];
-    sprintf(topic, "%.*s", md.topicName.lenstring.len, md.topicName.lenstring.data);
-    char* payload = new char[message.payloadlen + 1];
-    sprintf(payload, "%.*s", message.payloadlen, (char*)message.payload);
-    // printf("%ld: DEBUG: Received: %s Msg: %s qos %d, retained %d, dup %d, packetid %d\n", uptime_sec, topic, payload, message.qos, message.retained, message.dup, message.id);
-    char* sub_topic = topic + strlen(topic_cmnd);  // find the last word of the topic (eg: cmnd/controller00/output2)
-    if (!strncmp(sub_topic, "output", 6)) {
-        // output# command received
-        char* output_num_str = sub_topic + 6;
-        int8_t output_num = atoi(output_num_str);
-        if (output_num < 0 || output_num >= NUM_OUTPUTS) {
-            printf("%ld: Error: unknown output number: %d\n", uptime_sec, output_num);
-            return;
-        }
-        if (!strncmp(payload, "1", 1)) {
-            printf("%ld: Turning output %d ON\n", uptime_sec, output_num);
-            sprintf(oled_msg_line2, "Output %d ON", output_num);
-            outputs[output_num] = 1;
-            flag_publish_outputs = true;
-        }
-        else if (!strncmp(payload, "0", 1)) {
-            printf("%ld: Turning output %d OFF\n", uptime_sec, output_num);
-            sprintf(oled_msg_line2, "Output %d OFF", output_num);
-            outputs[output_num] = 0;
-            flag_publish_outputs = true;
-        }
-        else {
-            printf("%ld: Error: unknown output command: %s\n", uptime_sec, payload);
-            return;
+    // printf("%ld: DEBUG: Received: %.*s Msg: %.*s qos %d, retained %d, dup %d, packetid %d\n", uptime_sec, md.topicName.lenstring.len, md.topicName.lenstring.data, message.payloadlen, (char*)message.payload, message.qos, message.retained, message.dup, message.id);
+    if (MQTTPacket_equals(&md.topicName, topic_ota)) {
+        ota.receive((const uint8_t*)message.payload, message.payloadlen, 0, message.payloadlen);
+        return;
+    }
+    command_queue.push(md.topicName, message.payload, message.payloadlen);
+}
+
+void ota_stream(MQTT::StreamData& sd)
+{
+    // MQTT callback function, a firmware frame too big for the read buffer, in chunks as it arrives
+    if (MQTTPacket_equals(&sd.topicName, topic_ota)) {
+        ota.receive((const uint8_t*)sd.message.payload, sd.message.payloadlen, sd.offset, sd.total);
+    }
+}
+
+void edge_command(MQTTString& topic, const void* payload, int payloadlen)
+{
+    // local broker route, a local client commanding this controller: queued like the central broker's
+    command_queue.push(topic, payload, payloadlen);
+}
+
+void edge_bridge_up(MQTTString& topic, const void* payload, int payloadlen)
+{
+    // local broker route, held until the main loop can publish it to the central broker
+    bridge_queue.push(topic, payload, payloadlen);
+}
+
+void edge_bridge_down(MQTT::MessageData& md)
+{
+    // MQTT callback function, central broker topics passed on to the local clients
+    edge.publish(md.topicName, md.message.payload, md.message.payloadlen);
+}
+
+void run_commands() {
+    // run the commands received since the last pass, oldest first
+    const CommandQueue<CMND_QUEUE_DEPTH, CMND_MAX_TOPIC_LEN, CMND_MAX_PAYLOAD_LEN>::Entry* cmnd;
+    int dropped = command_queue.takeDropped();
+    if (dropped) {
+        printf("%ld: Error: %d command(s) dropped (queue full or too long)\n", uptime_sec, dropped);
+    }
+    while ((cmnd = command_queue.front()) != NULL) {
+        MQTTString topic = MQTTString_initializer;
+        topic.lenstring.data = (char*)cmnd->topic;
+        topic.lenstring.len = cmnd->topiclen;
+        switch (command_router.dispatch(topic, cmnd->payload, cmnd->payloadlen)) {
+            case COMMAND_NOT_FOUND:
+                printf("%ld: Error: unknown command: %.*s\n", uptime_sec, cmnd->topiclen, cmnd->topic);
+                break;
+            case COMMAND_BAD_ARGS:
+                printf("%ld: Error: bad command payload: %.*s\n", uptime_sec, cmnd->payloadlen, cmnd->payload);
+                break;
+            default:
+                break;
         }
+        command_queue.pop();
+    }
+}
+
+void publish_done(MQTT::ResultData &result) {
+    // MQTT callback function, the broker's ack of a publish (or the publish failed)
+    if (result.rc != MQTT::SUCCESS) {
+        printf("%ld: Publish Error! (packet id %d not acknowledged)\n", uptime_sec, result.id);
+        sprintf(oled_msg_line1, "%s", "MQTT Publish error! :-(");
     }
 }
 
-bool publish(MQTT::Client<MQTTNetwork, Countdown> &client, char* topic, char* msg_payload, bool retained = false) {
-    // main function to publish MQTT messages
-    MQTT::Message msg;
-    msg.qos = MQTT::QOS1;
-    msg.retained = retained;
-    msg.payloadlen = strlen(msg_payload);
-    msg.payload = msg_payload;
-    char topic_full[30];
-    strcat(topic_full, topic_pub);
-    strcat(topic_full, topic);
-    printf("%ld: DEBUG: Publishing: %s to: %s\n", uptime_sec, msg_payload, topic_full);
-    if (client.publish(topic_full, msg) != MQTT::SUCCESS) {
-        printf("%ld: Publish Error! (topic:%s msg:%s)\n", uptime_sec, topic, msg_payload);
+bool publish(MQTTClient &client, int topic, const char* msg_payload, int len = -1) {
+    // main function to publish MQTT messages, QoS and retained flag come with the precompiled topic
+    // the publish goes out now, its ack arrives through client.poll() (waits only while the broker's
+    // receive window is full)
+    const PubTopic &pub_topic = pub_topics[topic];
+    int rc;
+    if (len < 0) {
+        len = strlen(msg_payload);
+    }
+    printf("%ld: DEBUG: Publishing: %.*s to: %.*s\n", uptime_sec, len, msg_payload, pub_topic.nameLen(), pub_topic.name());
+    edge.publish(pub_topic.name(), pub_topic.nameLen(), msg_payload, len);   // local clients first, at LAN latency
+    while ((rc = client.startPublish(pub_topic, msg_payload, len, publish_done)) == MQTT::BUSY && client.poll() == MQTT::SUCCESS) {
+    }
+    if (rc < 0) {
+        printf("%ld: Publish Error! (topic:%.*s msg:%.*s)\n", uptime_sec, pub_topic.nameLen(), pub_topic.name(), len, msg_payload);
         sprintf(oled_msg_line1, "%s", "MQTT Publish error! :-(");
         return false;
     }
     return true;
 }
 
-bool publish_num(MQTT::Client<MQTTNetwork, Countdown> &client, char* topic, int num, bool retained = false) {
-    char message[10];
-    sprintf(message, "%d", num);
-    return publish(client, topic, message, retained);
+bool publish_num(MQTTClient &client, int topic, int num) {
+    char message[12];
+    int len = fmt_int(message, num);
+    return publish(client, topic, message, len);
 }
 
-bool publish_info(MQTT::Client<MQTTNetwork, Countdown> &client) {
-    // periodic mqtt info message
-    char topic[] = "uptime";
-    char message[10];
-    sprintf(message, "%ld", uptime_sec);
-    return publish(client, topic, message);
+bool publish_bank(MQTTClient &client, int id, uint16_t &seq, uint32_t toggled = 0) {
+    // whole IO bank in one message: "<state mask>,<changed mask>,<sequence>"
+    // changed mask is relative to the previous bank message (0 on an integrity refresh), plus toggled:
+    // bits that changed and changed back since
+    char message[32];
+    uint32_t mask = rbe[id].value;
+    uint32_t changed = (mask ^ rbe[id].reported) | toggled;
+    int len = fmt_hex(message, mask, 3);
+    message[len++] = ',';
+    len += fmt_hex(message + len, changed, 3);
+    message[len++] = ',';
+    len += fmt_uint(message + len, ++seq);
+    return publish(client, rbe[id].topic, message, len);
 }
 
-void publish_inputs(MQTT::Client<MQTTNetwork, Countdown> &client) {
-    for (int i=0; i<NUM_INPUTS; i++) {
-        char topic_str[8]; // long enough string for inputxx
-        sprintf(topic_str, "input%d", i);
-        publish_num(client, topic_str, input_state[i]);
+bool publish_signal(MQTTClient &client, int id) {
+    // publish the current value of a report-by-exception signal
+    char message[16];
+    int len;
+    if (id == sig_input_bank) {
+        if (!publish_bank(client, id, input_bank_seq, input_toggled)) {
+            return false;
+        }
+        input_toggled = 0;
+        if (input_edge_pending) {
+            input_edge_pending = false;
+            input_latency_us = clock_us() - input_edge_us;
+            if (input_latency_us > input_latency_max_us) {
+                input_latency_max_us = input_latency_us;
+            }
+        }
+        return true;
+    }
+    if (id == sig_output_bank) {
+        return publish_bank(client, id, output_bank_seq);
+    }
+    if (rbe[id].format == FORMAT_SIXTEENTHS) {
+        len = fmt_sixteenths(message, rbe[id].value, TEMP_DECIMALS);
+    }
+    else {
+        len = fmt_int(message, rbe[id].value);
+    }
+    return publish(client, rbe[id].topic, message, len);
+}
+
+void bridge_publish(MQTTClient &client) {
+    // publish what the local broker bridged up since the last pass, at QoS 0
+    const CommandQueue<EDGE_BRIDGE_DEPTH, CMND_MAX_TOPIC_LEN, CMND_MAX_PAYLOAD_LEN>::Entry* msg;
+    char topic[CMND_MAX_TOPIC_LEN + 1];
+    int dropped = bridge_queue.takeDropped();
+    if (dropped) {
+        printf("%ld: Error: %d bridged publish(es) dropped (queue full or too long)\n", uptime_sec, dropped);
+    }
+    while ((msg = bridge_queue.front()) != NULL) {
+        memcpy(topic, msg->topic, msg->topiclen);
+        topic[msg->topiclen] = '\0';
+        if (client.publish(topic, (void*)msg->payload, msg->payloadlen) != MQTT::SUCCESS) {
+            printf("%ld: Bridge publish Error! (topic:%s)\n", uptime_sec, topic);
+        }
+        bridge_queue.pop();
+    }
+}
+
+void report_ota(MQTTClient &client) {
+    // progress of a firmware update, reboot into a verified image
+    const char* status = ota.takeStatus();
+    if (status == NULL) {
+        return;
+    }
+    printf("%ld: OTA: %s\n", uptime_sec, status);
+    sprintf(oled_msg_line2, "OTA %.20s", status);
+    publish(client, TOPIC_OTA, status);
+    if (ota.state() == FirmwareUpdate::OTA_VERIFIED) {
+        ota_reboot.once(&system_reset, 2000);   // let the status go out first
+    }
+}
+
+void publish_changes(MQTTClient &client) {
+    // publish whatever the report-by-exception filter says is due, a few per pass
+    for (int n=0; n<RBE_MAX_PER_PASS; n++) {
+        int id = rbe.poll(uptime_sec);
+        if (id < 0) {
+            break;
+        }
+        if (!publish_signal(client, id)) {
+            break;
+        }
+        rbe.reported(id, uptime_sec);
     }
 }
 
-void publish_outputs(MQTT::Client<MQTTNetwork, Countdown> &client) {
+void rbe_init() {
+    // register every published signal with the report-by-exception filter
+    sig_input_bank = rbe.add(TOPIC_INPUTBANK, 0, 0, RBE_IO_REFRESH_SEC);
+    sig_output_bank = rbe.add(TOPIC_OUTPUTBANK, 0, 0, RBE_IO_REFRESH_SEC);
+    for (int i=0; i<NUM_INPUTS; i++) {
+        sig_input[i] = -1;
+#if IO_PER_PIN_TOPICS
+        sig_input[i] = rbe.add(TOPIC_INPUT0 + i, 0, 0, RBE_IO_REFRESH_SEC);
+#endif
+    }
     for (int i=0; i<NUM_OUTPUTS; i++) {
-        char topic_str[9]; // long enough string for outputxx
-        sprintf(topic_str, "output%d", i);
-        publish_num(client, topic_str, outputs[i]);
+        sig_output[i] = -1;
+#if IO_PER_PIN_TOPICS
+        sig_output[i] = rbe.add(TOPIC_OUTPUT0 + i, 0, 0, RBE_IO_REFRESH_SEC);
+#endif
     }
+    for (int i=0; i<num_ds1820; i++) {
+        sig_temp[i] = rbe.add(TOPIC_PROBETEMP0 + i, RBE_TEMP_DEADBAND, RBE_TEMP_MIN_SEC, RBE_TEMP_REFRESH_SEC, FORMAT_SIXTEENTHS);
+    }
+    sig_uptime = rbe.add(TOPIC_UPTIME, RBE_REFRESH_ONLY, 0, RBE_UPTIME_REFRESH_SEC);
 }
 
 void update_oled() {
@@ -192,73 +562,160 @@ void update_oled() {
 
 
 
-void read_inputs(MQTT::Client<MQTTNetwork, Countdown> &client) {
-    for (int i=0; i<NUM_INPUTS; i++) {
-        bool old_state = input_state[i];    // save old state
-        input_state[i] = inputs[i];         // read new value
-        if(input_state[i] != old_state) {
-            // input has changed state
-            printf("%ld: Input %d changed to %d\n", uptime_sec, i, input_state[i]);
-            sprintf(oled_msg_line1, "Input %d changed to %d", i, input_state[i]);
-            char topic_str[8]; // long enough string for inputxx
-            sprintf(topic_str, "input%d", i);
-            publish_num(client, topic_str, input_state[i]);
-        }
+void input_edge(InterruptIn* in, bool level) {
+    // EXTI interrupt: queue the edge with its time, and have the input task take it now
+    input_edges.push(in - input_irq, level, clock_us());
+    scheduler.wake(task_inputs);
+}
+
+void input_rise(InterruptIn* in) {
+    input_edge(in, 1);
+}
+
+void input_fall(InterruptIn* in) {
+    input_edge(in, 0);
+}
+
+void input_changed(int i, bool level, uint32_t us) {
+    // an input changed state at us
+    input_state[i] = level;
+    input_toggled |= 1 << i;
+    input_changes++;
+    if (!input_edge_pending) {
+        input_edge_pending = true;
+        input_edge_us = us;
     }
+    printf("%ld: Input %d changed to %d\n", uptime_sec, i, level);
+    sprintf(oled_msg_line1, "Input %d changed to %d", i, level);
 }
 
-void read_ds1820(MQTT::Client<MQTTNetwork, Countdown> &client) {
-    char temp_str[6];
-    char topic_str[12];
-    // Start temperature conversion of all probes, wait until ready
-    temp_probe[0]->convertTemperature(true, DS1820::all_devices);
-    // loop through all devices and publish temp
-    for (int i = 0; i<num_ds1820; i++) {
-        float temp_ds = temp_probe[i]->temperature();
-        if (temp_ds == DS1820::invalid_conversion) {
-            printf("%ld: DS1820 %d failed temperature conversion :-(\n", uptime_sec, i);
-            return;
+void read_inputs() {
+    // the edges queued by the interrupts in order, then the polled inputs (all of them after a dropped edge)
+    uint32_t changes = input_changes;
+    EdgeQueue<INPUT_EDGE_QUEUE>::Edge edge;
+    while (input_edges.pop(edge)) {
+        if (input_resynced && (int32_t)(edge.us - input_resync_us) <= 0) {
+            continue;       // queued while the resync read the pins
         }
-        else if (temp_ds == -0.25) {
-            // reject bad temp readings (0 counts converted to -0.25degC)
-            printf("%ld: DS1820 %d bad temp (likely not connected) :-(\n", uptime_sec, i);
-            return;
+        if (edge.level == input_state[edge.pin]) {
+            // the edge before it came and went before its interrupt read the pin: a short pulse
+            input_changed(edge.pin, !edge.level, edge.us);
+        }
+        input_changed(edge.pin, edge.level, edge.us);
+    }
+    uint32_t dropped = input_edges.dropped();
+    if (dropped != input_dropped_seen) {
+        printf("%ld: Input edges dropped: %lu\n", uptime_sec, (unsigned long)(dropped - input_dropped_seen));
+        input_dropped_seen = dropped;
+        input_resync = true;
+    }
+    if (input_resync) {
+        input_resync_us = clock_us();
+    }
+    uint32_t levels = input_bank.sample();     // every input at the same moment
+    for (int i = input_resync ? 0 : NUM_IRQ_INPUTS; i < NUM_INPUTS; i++) {
+        bool level = (levels >> i) & 1;
+        if (level != input_state[i]) {
+            input_changed(i, level, clock_us());
         }
-        // convert to string and publish
-        sprintf(temp_str, "%3.2f", temp_ds);
-        sprintf(topic_str, "probetemp%d", i);
-        printf("%ld: DS1820 %d measures %3.2foC\n", uptime_sec, i, temp_ds);
-        sprintf(oled_msg_line3, "DS1820 %d = %3.2foC", i, temp_ds);
-        // printf("%ld: DS1820 %d measures %doC (int)\n", uptime_sec, i, (int)temp_ds);
-        publish(client, topic_str, temp_str, false);
+    }
+    input_resynced = input_resync;
+    input_resync = false;
+    uint32_t bank = 0;
+    for (int i=0; i<NUM_INPUTS; i++) {
+        rbe.update(sig_input[i], input_state[i]);
+        bank |= (uint32_t)input_state[i] << i;
+    }
+    rbe.update(sig_input_bank, bank);
+    if (input_changes != changes) {
+        rbe.force(sig_input_bank);          // also when a pulse left the bank as it was
+        scheduler.wake(task_telemetry);     // publish now, not at the next telemetry period
     }
 }
 
-bool networking_init(EthernetInterface &wiz) {
-    printf("%ld: Start networking...\n", uptime_sec);
-    // reset the w5500
+void read_outputs() {
+    uint32_t bank = output_bank.read();
+    for (int i=0; i<NUM_OUTPUTS; i++) {
+        rbe.update(sig_output[i], (bank >> i) & 1);
+    }
+    rbe.update(sig_output_bank, bank);
+}
+
+void read_ds1820() {
+    // 1-Wire task, a step per run: start the temperature conversion of all probes, come back when it's
+    // ready, then read a probe per run
+    if (num_ds1820 == 0) {
+        return;
+    }
+    if (ds1820_next < 0) {
+        int wait_ms = temp_probe[0]->convertTemperature(false, DS1820::all_devices);
+        ds1820_next = 0;
+        scheduler.schedule(task_onewire, wait_ms);     // the probes convert on their own meanwhile
+        return;
+    }
+    int i = ds1820_next;
+    ds1820_next = -1;       // the round ends here unless there is another probe
+    int temp_ds = temp_probe[i]->temperatureRaw();    // 1/16 degC
+    if (temp_ds == DS1820::invalid_raw) {
+        printf("%ld: DS1820 %d failed temperature conversion :-(\n", uptime_sec, i);
+        return;
+    }
+    else if (temp_ds == -4) {
+        // reject bad temp readings (0 counts converted to -0.25degC)
+        printf("%ld: DS1820 %d bad temp (likely not connected) :-(\n", uptime_sec, i);
+        return;
+    }
+    // hand to the report-by-exception filter as is, it's only scaled when formatted
+    rbe.update(sig_temp[i], temp_ds);
+    char temp_str[16];
+    fmt_sixteenths(temp_str, temp_ds, TEMP_DECIMALS);
+    printf("%ld: DS1820 %d measures %soC\n", uptime_sec, i, temp_str);
+    sprintf(oled_msg_line3, "DS1820 %d = %soC", i, temp_str);
+    if (i + 1 < num_ds1820) {
+        ds1820_next = i + 1;
+        scheduler.schedule(task_onewire, 0);
+    }
+}
+
+unsigned long now_ms() {
+    return monotonic_ms() - supervisor_epoch_ms;
+}
+
+bool link_up(EthernetInterface &wiz) {
+    return wiz.getPHYCFGR() & PHYCFGR_LNK_ON;
+}
+
+void chip_init(EthernetInterface &wiz) {
+    // chip layer: reset the w5500 (it was at power up, so not on the first run), MAC, local broker
+    if (supervisor.stats(NET_CHIP).outages) {
+        printf("%ld: Resetting wiznet...\n", uptime_sec);
+        wiz.reset();
+    }
     wiz.init(mac_addr);
-    if (wiz.connect(NET_TIMEOUT_MS) != 0) {
-        printf("%ld: DHCP failed :-(\n", uptime_sec);
-        sprintf(oled_msg_line1, "%s", "DHCP failed :-(");
-        sprintf(oled_msg_line2, "IP: --");
-        return false;
+    if (EDGE_BROKER_PORT && edge.begin(EDGE_BROKER_PORT)) {
+        printf("%ld: Local broker on port %d\n", uptime_sec, EDGE_BROKER_PORT);
     }
-    printf("%ld: IP: %s\n", uptime_sec, wiz.getIPAddress());
-    sprintf(oled_msg_line2, "IP: %s", wiz.getIPAddress());
-    return true;
 }
 
-bool mqtt_init(MQTTNetwork &mqttNet, MQTT::Client<MQTTNetwork, Countdown> &client) {
-    // TCP connect to broker
-    printf("%ld: Connecting to MQTT broker...\n", uptime_sec);
-    if (mqttNet.connect((char*)mqtt_broker, mqtt_port, NET_TIMEOUT_MS) != MQTT::SUCCESS) {
-        printf("%ld: Couldn't connect TCP socket to broker %s :-(\n", uptime_sec, mqtt_broker);
+bool mqtt_open(MQTTSession &session, int broker) {
+    // TCP connect to a broker of the list, a failure counts against its health
+    const BrokerAddress &addr = broker_list[broker];
+    session.net.disconnect();       // the socket of a previous attempt, if still open
+    session.broker = -1;
+    printf("%ld: Connecting to MQTT broker %s (health %d)...\n", uptime_sec, addr.host, broker_list.healthOf(broker));
+    if (session.net.connect(addr.host, addr.port, NET_TIMEOUT_MS) != MQTT::SUCCESS) {
+        printf("%ld: Couldn't connect TCP socket to broker %s :-(\n", uptime_sec, addr.host);
         sprintf(oled_msg_line1, "%s", "Couldn't connect MQTT");
-        conn_failures++;  // record this as a connection failure in case we need to reset the Wiznet
+        broker_list.connectFailed(broker);
         return false;
     }
-    // Client connect to broker
+    session.broker = broker;
+    return true;
+}
+
+bool mqtt_connect(MQTTSession &session) {
+    // Client connect to the broker the session's socket is open to, its health follows the outcome
+    const char* host = brokers[session.broker].host;
     MQTTPacket_connectData conn_data = MQTTPacket_connectData_initializer;
     MQTTPacket_willOptions lwt = MQTTPacket_willOptions_initializer;
     lwt.topicName.cstring = lwt_topic;
@@ -266,16 +723,85 @@ bool mqtt_init(MQTTNetwork &mqttNet, MQTT::Client<MQTTNetwork, Countdown> &clien
     lwt.retained = true;
     conn_data.willFlag = 1;
     conn_data.will = lwt;
-    conn_data.MQTTVersion = 3;
+    conn_data.MQTTVersion = MQTT_VERSION;
     conn_data.keepAliveInterval = MQTT_KEEPALIVE;
     conn_data.clientID.cstring = mqtt_clientid;
-    if (client.connect(conn_data) != MQTT::SUCCESS) {
-        printf("%ld: MQTT Client couldn't connect to broker %s :-(\n", uptime_sec, mqtt_broker);
+    // the OTA stream handler before the CONNECT, so it doesn't limit packets to the read buffer
+    session.client.setMessageHandler(topic_sub, message_handler);
+    session.client.setStreamHandler(topic_sub, ota_stream);
+    if (session.client.connect(conn_data) != MQTT::SUCCESS) {
+        printf("%ld: MQTT Client couldn't connect to broker %s :-(\n", uptime_sec, host);
         sprintf(oled_msg_line1, "%s", "Couldn't connect MQTT");
-        conn_failures++;  // record this as a connection failure in case we need to reset the Wiznet
+        broker_list.connectFailed(session.broker);
+        session.broker = -1;
         return false;
     }
-    printf("%ld: Connected to broker %s :-)\n", uptime_sec, mqtt_broker);
+    printf("%ld: Connected to broker %s :-)\n", uptime_sec, host);
+    broker_list.connected(session.broker);
+    return true;
+}
+
+void mqtt_lost(MQTTSession &session) {
+    // a session is down (missed keepalive, unacked publishes, or its setup failed): count it against
+    // its broker and free the socket
+    if (session.broker >= 0) {
+        printf("%ld: Lost broker %s\n", uptime_sec, brokers[session.broker].host);
+        broker_list.lost(session.broker);
+        session.broker = -1;
+    }
+    if (session.client.isConnected()) {
+        session.client.disconnect();
+    }
+    session.net.disconnect();
+}
+
+void mqtt_down() {
+    // the active session is gone, and its TCP connection with it
+    mqtt_lost(*active);
+    supervisor.down(NET_TCP, now_ms());
+    supervisor.down(NET_MQTT, now_ms());
+#if MQTT_WARM_STANDBY
+    if (standby->client.isConnected()) {
+        supervisor.retryNow(NET_TCP, now_ms());    // the standby takes over, no new connection to spread
+    }
+#endif
+}
+
+void report_recovery(MQTTClient &client) {
+    // per layer outages and recovery times, "<layer>:<outages>/<last ms>/<longest ms>", layers with outages only
+    char message[72];
+    int len = 0;
+    for (int i = 0; i < NET_LAYERS; i++) {
+        const NetSupervisor::Stats &stats = supervisor.stats(i);
+        if (stats.outages == 0) {
+            continue;
+        }
+        char entry[48];     // layer names are a few chars
+        int n = 0;
+        if (len) {
+            entry[n++] = ',';
+        }
+        n += strlen(strcpy(entry + n, NetSupervisor::name(i)));
+        entry[n++] = ':';
+        n += fmt_uint(entry + n, stats.outages);
+        entry[n++] = '/';
+        n += fmt_uint(entry + n, stats.last_ms);
+        entry[n++] = '/';
+        n += fmt_uint(entry + n, stats.max_ms);
+        if (len + n >= (int)sizeof(message)) {
+            break;      // no room for this layer
+        }
+        memcpy(message + len, entry, n);
+        len += n;
+    }
+    message[len] = '\0';
+    printf("%ld: Recovery: %s\n", uptime_sec, message);
+    publish(client, TOPIC_RECOVERY, message, len);
+}
+
+bool mqtt_session(MQTTSession &session) {
+    // set up a connected session to take over: subscriptions and the online announcement
+    MQTTClient &client = session.client;
     sprintf(oled_msg_line1, "%s", "Connected to Broker :-)");
     // Subscribe to topic
     if (client.subscribe(topic_sub, MQTT::QOS1, message_handler) != MQTT::SUCCESS) {
@@ -284,28 +810,299 @@ bool mqtt_init(MQTTNetwork &mqttNet, MQTT::Client<MQTTNetwork, Countdown> &clien
         return false;
     }
     printf("%ld: Subscribed to %s\n", uptime_sec, topic_sub);
+    if (EDGE_BRIDGE_DOWN[0] && client.subscribe(EDGE_BRIDGE_DOWN, MQTT::QOS0, edge_bridge_down) != MQTT::SUCCESS) {
+        printf("%ld: MQTT Client couldn't subscribe to bridged topic %s :-(\n", uptime_sec, EDGE_BRIDGE_DOWN);
+    }
     // Node online message
-    publish(client, "version", VERSION, true);
-    publish(client, "IPAddress", mqttNet.getIPAddress(), true);
-    publish_num(client, "online", 1, true);
-    publish_num(client, "inputs", NUM_INPUTS, true);
-    publish_num(client, "outputs", NUM_OUTPUTS, true);
-    publish_num(client, "ds1820", num_ds1820, true);
-    conn_failures = 0;   // remember to reset this on success
+    publish(client, TOPIC_VERSION, VERSION);
+    publish(client, TOPIC_IPADDRESS, session.net.getIPAddress());
+    publish_num(client, TOPIC_ONLINE, 1);
+    publish_num(client, TOPIC_INPUTS, NUM_INPUTS);
+    publish_num(client, TOPIC_OUTPUTS, NUM_OUTPUTS);
+    publish_num(client, TOPIC_DS1820, num_ds1820);
+    rbe.restart(uptime_sec, fleet_phase);   // stagger the integrity refresh of everything over the new session
+    input_edge_pending = false;     // edges while offline say nothing about the publish latency
+    return true;
+}
+
+bool networking_init(EthernetInterface &wiz) {
+    // IP layer: DHCP, for a new lease or to renew the current one
+    printf("%ld: Start networking...\n", uptime_sec);
+    if (wiz.connect(NET_TIMEOUT_MS) != 0) {
+        printf("%ld: DHCP failed :-(\n", uptime_sec);
+        sprintf(oled_msg_line1, "%s", "DHCP failed :-(");
+        return false;
+    }
+    uint32_t lease = wiz.getLeaseTime();
+    lease_renew_sec = lease && lease != 0xFFFFFFFF ? uptime_sec + lease / 2 : 0;     // 0 = infinite
+    lease_expiry_sec = uptime_sec + lease;
+    if (strcmp(ip_address, wiz.getIPAddress()) != 0) {
+        if (ip_address[0]) {
+            printf("%ld: IP changed from %s\n", uptime_sec, ip_address);
+            mqtt_down();    // the connection was from the old address
+        }
+        snprintf(ip_address, sizeof(ip_address), "%s", wiz.getIPAddress());
+    }
+    printf("%ld: IP: %s lease %lus\n", uptime_sec, ip_address, (unsigned long)lease);
+    sprintf(oled_msg_line2, "IP: %s", ip_address);
     return true;
-} 
+}
+
+void lease_renew(EthernetInterface &wiz) {
+    // renew the DHCP lease from half way through it, the IP layer only goes down once it has expired
+    if (lease_renew_sec == 0 || (long)(uptime_sec - lease_renew_sec) < 0) {
+        return;
+    }
+    if ((long)(uptime_sec - lease_expiry_sec) >= 0) {
+        printf("%ld: DHCP lease expired :-(\n", uptime_sec);
+        lease_renew_sec = 0;
+        supervisor.down(NET_IP, now_ms());
+        return;
+    }
+    if (!networking_init(wiz)) {
+        lease_renew_sec = uptime_sec + (lease_expiry_sec - uptime_sec) / 2 + 1;    // again half way to expiry
+    }
+}
+
+unsigned long standby_retry() {
+    // when to try the standby again, jittered so a fleet doesn't retry a failed broker in step
+    return uptime_sec + MQTT_STANDBY_RETRY_SEC / 2 + supervisor.random() % MQTT_STANDBY_RETRY_SEC;
+}
+
+bool mqtt_tcp() {
+    // TCP layer: take over the warm standby's connection if it is up, else open one to the healthiest broker
+#if MQTT_WARM_STANDBY
+    if (standby->client.isConnected()) {
+        MQTTSession* promoted = standby;
+        standby = active;
+        active = promoted;
+        standby_retry_sec = standby_retry();   // the failed broker gets time to come back
+        printf("%ld: Failing over to standby broker %s\n", uptime_sec, brokers[active->broker].host);
+        return true;
+    }
+#endif
+    return mqtt_open(*active, broker_list.pick());
+}
+
+bool mqtt_init() {
+    // MQTT layer: CONNECT (a promoted standby already is), then set up the session
+    return (active->client.isConnected() || mqtt_connect(*active)) && mqtt_session(*active);
+}
+
+#if MQTT_WARM_STANDBY
+void standby_poll() {
+    // keep the warm standby connected to the next healthiest broker, with its own keepalive running
+    if (standby->client.isConnected()) {
+        standby->client.poll();
+        if (!standby->client.isConnected()) {
+            mqtt_lost(*standby);
+            standby_retry_sec = standby_retry();
+        }
+        return;
+    }
+    if ((long)(uptime_sec - standby_retry_sec) < 0) {
+        return;
+    }
+    standby_retry_sec = standby_retry();
+    int broker = broker_list.pick(active->broker);
+    if (broker >= 0 && mqtt_open(*standby, broker) && mqtt_connect(*standby)) {
+        printf("%ld: Standby connected to broker %s\n", uptime_sec, brokers[broker].host);
+    }
+}
+#endif
+
+void supervise(EthernetInterface &wiz) {
+    // notice layers that went down, then work on the lowest layer down (one step per pass)
+    if (supervisor.isUp(NET_CHIP) && supervisor.isUp(NET_LINK) != link_up(wiz)) {
+        // link checks back off (they lead to a W5500 reset), but a link coming back is taken at once
+        if (supervisor.isUp(NET_LINK)) {
+            printf("%ld: Link down :-(\n", uptime_sec);
+            sprintf(oled_msg_line1, "%s", "Link down :-(");
+            supervisor.down(NET_LINK, now_ms());
+        }
+        else if (supervisor.up(NET_LINK, now_ms())) {
+            printf("%ld: link recovered in %lu ms\n", uptime_sec, (unsigned long)supervisor.stats(NET_LINK).last_ms);
+        }
+    }
+    if (supervisor.isUp(NET_MQTT) && !active->client.isConnected()) {
+        mqtt_down();
+    }
+    if (supervisor.isUp(NET_LINK) && supervisor.isUp(NET_IP)) {
+        lease_renew(wiz);
+    }
+    int layer = supervisor.next(now_ms());
+    bool ok = true;
+    switch (layer) {
+        case NET_CHIP:
+            mqtt_down();
+#if MQTT_WARM_STANDBY
+            mqtt_lost(*standby);
+#endif
+            chip_init(wiz);
+            for (int i = NET_LINK; i < NET_LAYERS; i++) {
+                supervisor.down(i, now_ms());      // the reset took everything above with it
+            }
+            break;
+        case NET_LINK:
+            ok = link_up(wiz);
+            break;
+        case NET_IP:
+            ok = networking_init(wiz);
+            break;
+        case NET_TCP:
+            ok = mqtt_tcp();
+            break;
+        case NET_MQTT:
+            ok = mqtt_init();
+            if (!ok) {
+                mqtt_down();    // a broker that refused or dropped the session has closed the socket too
+            }
+            break;
+        default:
+            break;
+    }
+    if (layer >= 0) {
+        if (!ok) {
+            int redo = supervisor.failed(layer, now_ms());
+            if (redo >= 0) {
+                printf("%ld: %s keeps failing, redoing %s\n", uptime_sec, NetSupervisor::name(layer), NetSupervisor::name(redo));
+            }
+        }
+        else if (supervisor.up(layer, now_ms())) {
+            printf("%ld: %s recovered in %lu ms\n", uptime_sec, NetSupervisor::name(layer), (unsigned long)supervisor.stats(layer).last_ms);
+            if (layer == NET_MQTT) {
+                report_recovery(active->client);
+            }
+        }
+    }
+    connected_net = supervisor.isUp(NET_LINK) && supervisor.isUp(NET_IP);
+    connected_mqtt = supervisor.ready();
+}
+
+void sample_io() {
+    // input sampling task: inputs, outputs and uptime into the report-by-exception filter
+    read_inputs();
+    read_outputs();
+    rbe.update(sig_uptime, uptime_sec);
+}
+
+void net_io() {
+    // network task: the connection layers, local clients, commands, MQTT acks and keepalive
+    supervise(*ethernet);
+    if(!connected_net) {
+        // network isn't connected
+        led = IO_OFF;
+    }
+    else {
+        edge.poll(uptime_sec);      // local clients are served whether or not the central broker is up
+        run_commands();
+        if (uptime_sec >= broker_recover_sec) {
+            broker_list.recover();
+            broker_recover_sec = uptime_sec + BROKER_RECOVER_SEC;
+        }
+        if(connected_mqtt) {
+            report_ota(active->client);
+            bridge_publish(active->client);
+            active->client.poll();      // acks, received commands and keepalive, never waits for the network
+#if MQTT_WARM_STANDBY
+            standby_poll();
+#endif
+        }
+    }
+    scheduler.setPeriod(task_net, connected_mqtt ? NET_POLL_MS : NET_OFFLINE_POLL_MS);
+}
+
+void report_tasks() {
+    // per task "<task>:<load %>/<longest run ms>/<deadline misses>" since the last report
+    char message[72];
+    int len = 0;
+    uint32_t period_us = scheduler.statsPeriodUs();
+    for (int i = 0; i < scheduler.count(); i++) {
+        const TaskScheduler::Stats &stats = scheduler.stats(i);
+        unsigned long load = period_us ? (unsigned long)((uint64_t)stats.run_us * 1000 / period_us) : 0;    // 0.1%
+        if (stats.misses) {
+            printf("%ld: Task %s missed %u deadline(s), started up to %lu ms late\n", uptime_sec, scheduler.name(i),
+                   stats.misses, (unsigned long)stats.max_late_us / 1000);
+        }
+        char entry[48];     // task names are a few chars
+        int n = 0;
+        if (len) {
+            entry[n++] = ',';
+        }
+        n += strlen(strcpy(entry + n, scheduler.name(i)));
+        entry[n++] = ':';
+        n += fmt_fixed(entry + n, load, 1);
+        entry[n++] = '/';
+        n += fmt_uint(entry + n, stats.max_run_us / 1000);
+        entry[n++] = '/';
+        n += fmt_uint(entry + n, stats.misses);
+        if (len + n >= (int)sizeof(message)) {
+            break;      // no room for this task
+        }
+        memcpy(message + len, entry, n);
+        len += n;
+    }
+    message[len] = '\0';
+    scheduler.resetStats();
+    printf("%ld: Tasks: %s\n", uptime_sec, message);
+    printf("%ld: Input edge to publish: last %lu us, longest %lu us\n", uptime_sec,
+           (unsigned long)input_latency_us, (unsigned long)input_latency_max_us);
+    input_latency_max_us = 0;
+    if (connected_mqtt) {
+        publish(active->client, TOPIC_TASKS, message, len);
+    }
+}
+
+void telemetry() {
+    // telemetry task: report-by-exception publishes, and the task stats now and then
+    if ((long)(uptime_sec - sched_report_sec) >= 0) {
+        sched_report_sec = uptime_sec + SCHED_REPORT_SEC;
+        report_tasks();
+    }
+    if (connected_mqtt) {
+        publish_changes(active->client);
+    }
+}
+
+void tasks_init() {
+    // highest priority first, the 1-Wire task only runs when woken every 30 seconds
+    task_inputs = scheduler.add(sample_io, "in", 0, INPUT_SAMPLE_MS, 2 * INPUT_SAMPLE_MS);
+    task_net = scheduler.add(net_io, "net", 1, NET_OFFLINE_POLL_MS, 100);
+    task_telemetry = scheduler.add(telemetry, "pub", 2, TELEMETRY_MS, 100);
+    task_display = scheduler.add(update_oled, "oled", 3, 1000, 500);
+    task_onewire = scheduler.add(read_ds1820, "1w", 4, 0, 1000);
+}
+
+void sched_wake() {
+    // nothing to do, the interrupt itself ends the sleep
+}
+
+void idle() {
+    // sleep (WFI) until the next task is due, or an interrupt wakes one
+    int32_t idle_us = scheduler.idleUs();
+    if (idle_us == 0) {
+        return;
+    }
+    if (idle_us > 0) {
+        sched_wakeup.once(&sched_wake, (idle_us + 999) / 1000);
+    }
+    core_util_critical_section_enter();
+    if (!scheduler.woken()) {
+        sleep();    // a pending interrupt ends it, even with interrupts off
+    }
+    core_util_critical_section_exit();
+}
 
 
 void every_30sec() {
     // no waits or blocking routines here please!
-    flag_publish_inputs = true;
-    flag_publish_outputs = true;
-    flag_read_ds1820 = true;
+    scheduler.wake(task_onewire);
 }
 
-void every_15sec() {
-    // no waits or blocking routines here please!
-    flag_publish_info = true;
+void start_30sec() {
+    // the 30 second jobs start at this controller's phase
+    tick_30sec.attach(&every_30sec, 29500);
+    every_30sec();
 }
 
 void every_second() {
@@ -315,7 +1112,6 @@ void every_second() {
         led = !led;
     }
     wd.kick();       // kick the dog before the timeout
-    flag_update_oled = true;
 }
 
 void every_500ms() {
@@ -328,6 +1124,7 @@ void every_500ms() {
 
 int main(void)
 {
+    FirmwareUpdate::applyPending();     // install a firmware update received before the reset, if any
     wd.start(WATCHDOG_TIMEOUT_MS);
 
     printf("\n===========\n%ld: Welcome! Controller: %s\n", uptime_sec, CONTROLLER_NAME);
@@ -335,19 +1132,28 @@ int main(void)
     printf("%ld: Inputs: %d Outputs: %d\n", uptime_sec, NUM_INPUTS, NUM_OUTPUTS);
     EthernetInterface wiz(PB_15, PB_14, PB_13, PB_12, PB_11); // SPI2 with PB_11 reset
 
-    MQTTNetwork mqttNetwork(&wiz);
-    MQTT::Client<MQTTNetwork, Countdown> client(mqttNetwork, NET_TIMEOUT_MS);
+    ethernet = &wiz;
+    MQTTSession first(&wiz);
+    active = &first;
+#if MQTT_WARM_STANDBY
+    MQTTSession second(&wiz);
+    standby = &second;
+#endif
 
-    tick_500ms.attach(&every_500ms, 0.5);
-    tick_1sec.attach(&every_second, 1.0);
-    tick_15sec.attach(&every_15sec, 15.1);
-    tick_30sec.attach(&every_30sec, 29.5);
+    tasks_init();       // before the tickers, which wake tasks
+    tick_500ms.attach(&every_500ms, 500);
+    tick_1sec.attach(&every_second, 1000);
+    tick_30sec_phase.once(&start_30sec, 29500 * fleet_phase / 256);
 
-    // pull high all inputs
+    // pull high all inputs, then interrupt on their edges (read_inputs() reads them all first)
     for(int i=0; i<NUM_INPUTS; i++) {
         inputs[i].mode(PullUp);
         input_state[i] = 1;
     }
+    for(int i=0; i<NUM_IRQ_INPUTS; i++) {
+        input_irq[i].rise(callback(input_rise, &input_irq[i]));
+        input_irq[i].fall(callback(input_fall, &input_irq[i]));
+    }
     //pulse all outputs
     for(int i=0; i<NUM_OUTPUTS; i++) {
         outputs[i] = 1;
@@ -367,6 +1173,11 @@ int main(void)
         }
     }
     printf("%ld: DS1820: Found %d device(s)\n", uptime_sec, num_ds1820);
+    rbe_init();
+    edge.route(topic_sub, edge_command);
+    if (EDGE_BRIDGE_UP[0]) {
+        edge.route(EDGE_BRIDGE_UP, edge_bridge_up);
+    }
     
     // Initialise OLED display
     oled_i2c.init();
@@ -375,56 +1186,15 @@ int main(void)
     
     wd.kick();
 
+    uint32_t seed = 0;
+    for (int i = 0; i < 6; i++) {
+        seed = seed * 31 + mac_addr[i];
+    }
+    supervisor.seed(seed);      // every controller its own reconnect jitter
+    supervisor_epoch_ms = monotonic_ms();
     while(1) {
-
-        if(!connected_net) {
-            // network isn't connected
-            led = IO_OFF;
-            connected_mqtt = false;   // if we've no net connection, mqtt ain't connected either
-            connected_net = networking_init(wiz);
-        }
-        else {
-            if(!connected_mqtt) {
-                // not connected to broker
-                connected_mqtt = mqtt_init(mqttNetwork, client);
-                if (conn_failures > 3) {      // wiznet could be bad, re-initialise
-                    printf("%ld: Too many connection failures! Resetting wiznet...\n", uptime_sec);
-                    connected_net = false;
-                    conn_failures = 0;
-                }
-            }
-            else {
-                // we're connected, do stuff!
-                read_inputs(client);
-                if(flag_publish_info) {
-                    publish_info(client);
-                    flag_publish_info = false;
-                }
-                else if (flag_update_oled) {
-                    update_oled();
-                    flag_update_oled = false;
-                }
-                else if (flag_publish_inputs) {
-                    publish_inputs(client);
-                    flag_publish_inputs = false;
-                }
-                else if (flag_publish_outputs) {
-                    publish_outputs(client);
-                    flag_publish_outputs = false;
-                }
-                else if (flag_read_ds1820) {
-                    read_ds1820(client);
-                    flag_read_ds1820 = false;
-                }
-                connected_mqtt = client.isConnected();
-            }
-            // printf("%ld: DEBUG: MQTT connected: %d\n", uptime_sec, connected_mqtt);        
-            client.yield(LOOP_SLEEP_MS);  // pause a while, yawn......
-        }
-        if (flag_update_oled) {
-            update_oled();
-            flag_update_oled = false;
+        if (!scheduler.run()) {
+            idle();
         }
-        ThisThread::sleep_for(LOOP_SLEEP_MS);
     }
 }
@@ -0,0 +1,101 @@
+// CommandRouter dispatch cost per command, against the handler it replaced (topic and payload copied,
+// then compared with strcmp / strncmp and parsed with strtoul / atoi).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "CommandRouter.h"
+#include "HostTest.h"
+
+static volatile uint32_t sink;      // keeps the work from being optimized away
+
+static void outputs_command(const CommandArgs &args) {
+    sink += args.values[0] ^ args.values[1];
+}
+
+static void output_command(const CommandArgs &args) {
+    sink += args.index + args.values[0];
+}
+
+// main.cpp's table
+static const Command commands[] = {
+    {"outputs",     command_parse_numbers,  outputs_command},
+    {"output%u",    command_parse_bool,     output_command},
+};
+
+static CommandRouter router("cmnd/ctl01/", commands, sizeof(commands) / sizeof(commands[0]));
+
+// the previous message_handler, less its printf and OLED updates (and freeing the payload copy)
+static void copying_handler(MQTTString &topic, const char* payload, int payloadlen) {
+    char name[topic.lenstring.len + 1];
+    sprintf(name, "%.*s", topic.lenstring.len, topic.lenstring.data);
+    char* text = new char[payloadlen + 1];
+    sprintf(text, "%.*s", payloadlen, payload);
+    char* sub_topic = name + strlen("cmnd/ctl01/");
+    if (!strcmp(sub_topic, "outputs")) {
+        char* end;
+        uint32_t mask = strtoul(text, &end, 0);
+        uint32_t value = *end == ',' ? strtoul(end + 1, &end, 0) : 0;
+        sink += mask ^ value;
+    } else if (!strncmp(sub_topic, "output", 6)) {
+        int output_num = atoi(sub_topic + 6);
+        sink += output_num + !strncmp(text, "1", 1);
+    }
+    delete[] text;
+}
+
+static MQTTString lenstring(const char* text) {
+    MQTTString s = MQTTString_initializer;
+    s.lenstring.data = (char*)text;
+    s.lenstring.len = strlen(text);
+    return s;
+}
+
+int main() {
+    struct {
+        const char* topic;
+        const char* payload;
+    } messages[] = {
+        {"cmnd/ctl01/output7", "1"},
+        {"cmnd/ctl01/outputs", "0x00C,0x004"},
+        {"cmnd/ctl01/outputs", "0x001,0x001,500"},
+    };
+    const int n = 2000000;
+
+    // the router gets them right first
+    MQTTString topic = lenstring("cmnd/ctl01/output7");
+    sink = 0;
+    CHECK(router.dispatch(topic, "1", 1) == COMMAND_OK && sink == 8);
+    topic = lenstring("cmnd/ctl01/outputs");
+    CHECK(router.dispatch(topic, "0x00C,0x004", 11) == COMMAND_OK && sink == 8 + 8);
+    CHECK(router.dispatch(topic, "0x00C,", 6) == COMMAND_BAD_ARGS);
+    // numbers over 32 bits are rejected, not wrapped
+    CommandArgs args;
+    CHECK(command_parse_numbers("0xFFFFFFFF,4294967295", 21, args) && args.count == 2 &&
+          args.values[0] == UINT32_MAX && args.values[1] == UINT32_MAX);
+    CHECK(command_parse_numbers("0x00000001FF", 12, args) && args.values[0] == 0x1FF);
+    CHECK(!command_parse_numbers("0x1FFFFFFFF", 11, args));
+    CHECK(!command_parse_numbers("0x00C,4294967296", 16, args));
+    CHECK(!command_parse_numbers("0x00C,0x00C,10000000000", 23, args));
+    topic = lenstring("cmnd/ctl01/outputx");
+    CHECK(router.dispatch(topic, "1", 1) == COMMAND_NOT_FOUND);
+
+    printf("per command                   router  copying handler\n");
+    for (auto &m : messages) {
+        MQTTString topic = lenstring(m.topic);
+        int len = strlen(m.payload);
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++) {
+            router.dispatch(topic, m.payload, len);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++) {
+            copying_handler(topic, m.payload, len);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        printf("%-8s %-16s %6.1f ns  %12.1f ns\n", m.topic + 11, m.payload,
+               std::chrono::duration<double, std::nano>(t1 - t0).count() / n,
+               std::chrono::duration<double, std::nano>(t2 - t1).count() / n);
+    }
+    return failures != 0;
+}
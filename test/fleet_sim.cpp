@@ -0,0 +1,246 @@
+// Fleet simulation: N controllers, each with the firmware's NetSupervisor, BrokerList and ReportByException,
+// stepped every 10 ms the way supervise() and net_io() in main.cpp do (without the warm standby), against a
+// primary and a backup broker that go down and come back. Reports each broker's peak TCP connect, CONNECT
+// and publish rates per second, how long the fleet took to be connected again, and where the sessions
+// ended up: on the backup after the primary failed, back on the primary once it has recovered.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "NetSupervisor.h"
+#include "BrokerList.h"
+#include "ReportByException.h"
+#include "HostTest.h"
+
+#define STEP_MS 10
+#define SIM_SEC 600
+#define BROKER_RECOVER_SEC 60       // as main.cpp
+
+static const BrokerAddress addresses[] = {{"primary", 1883}, {"backup", 1883}};
+static const int num_brokers = 2;
+
+struct Broker {
+    bool up;
+    int sessions;
+    int tcp[SIM_SEC];               // per second
+    int connects[SIM_SEC];
+    int publishes[SIM_SEC];
+};
+
+struct Node {
+    Node() : brokers(addresses, num_brokers), broker(-1), tcp_broker(-1), recover_sec(BROKER_RECOVER_SEC) {
+    }
+
+    NetSupervisor supervisor;
+    BrokerList brokers;
+    ReportByException<8> rbe;
+    int broker;                     // the session's, -1 = none
+    int tcp_broker;                 // TCP connected to, before the CONNECT
+    unsigned long recover_sec;
+    uint8_t phase;
+    int sig_uptime;
+};
+
+enum BrokerEvent {BROKER_DOWN, BROKER_UP, BROKER_RESTART};
+
+struct Scenario {
+    const char* name;
+    struct {
+        int sec;                    // 0 = no more events
+        int broker;
+        BrokerEvent event;          // down and restart drop the broker's sessions
+    } events[3];
+    int ends_on;                    // the broker every session is on at the end
+};
+
+static Broker brokers[num_brokers];
+
+static uint8_t bitReversed(uint8_t b) {
+    uint8_t r = 0;
+    for (int i = 0; i < 8; i++) {
+        r |= ((b >> i) & 1) << (7 - i);
+    }
+    return r;
+}
+
+// mqtt_down(): the session is gone, and its TCP connection with it
+static void sessionDown(Node &node, unsigned long now_ms) {
+    if (node.broker >= 0) {
+        node.brokers.lost(node.broker);
+        brokers[node.broker].sessions--;
+        node.broker = -1;
+    }
+    node.tcp_broker = -1;
+    node.supervisor.down(NET_TCP, now_ms);
+    node.supervisor.down(NET_MQTT, now_ms);
+}
+
+static void step(Node &node, unsigned long now_ms) {
+    unsigned long sec = now_ms / 1000;
+    int layer = node.supervisor.next(now_ms);
+    bool ok = true;
+    switch (layer) {
+        case NET_CHIP:
+        case NET_LINK:
+        case NET_IP:
+            break;              // the LAN is fine, only brokers go away
+        case NET_TCP: {
+            int b = node.brokers.pick();
+            brokers[b].tcp[sec]++;
+            ok = brokers[b].up;
+            if (ok) {
+                node.tcp_broker = b;
+            } else {
+                node.brokers.connectFailed(b);
+            }
+            break;
+        }
+        case NET_MQTT: {
+            int b = node.tcp_broker;
+            brokers[b].connects[sec]++;
+            ok = brokers[b].up;
+            if (ok) {
+                node.brokers.connected(b);
+                node.broker = b;
+                brokers[b].sessions++;
+                brokers[b].publishes[sec] += 6;     // the online announcement
+                node.rbe.restart(sec, node.phase);
+            } else {
+                node.brokers.connectFailed(b);
+                sessionDown(node, now_ms);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    if (layer >= 0) {
+        if (ok) {
+            node.supervisor.up(layer, now_ms);
+        } else {
+            node.supervisor.failed(layer, now_ms);
+        }
+    }
+    if (sec >= node.recover_sec) {
+        node.brokers.recover();
+        node.recover_sec = sec + BROKER_RECOVER_SEC;
+    }
+    if (node.broker >= 0 && now_ms % 100 == 0) {
+        int id;
+        for (int k = 0; k < 4 && (id = node.rbe.poll(sec)) >= 0; k++) {
+            node.rbe.reported(id, sec);
+            brokers[node.broker].publishes[sec]++;
+        }
+    }
+}
+
+static void run(int n, const Scenario &s) {
+    memset(brokers, 0, sizeof(brokers));
+    for (int b = 0; b < num_brokers; b++) {
+        brokers[b].up = true;
+    }
+    std::vector<Node> nodes(n);
+    for (int i = 0; i < n; i++) {
+        Node &node = nodes[i];
+        // as main(): the jitter seeded from the MAC, the fleet phase from the controller number
+        uint8_t mac[6] = {0x00, 0x08, 0xDC, 0x00, (uint8_t)(i >> 8), (uint8_t)i};
+        uint32_t seed = 0;
+        for (int k = 0; k < 6; k++) {
+            seed = seed * 31 + mac[k];
+        }
+        node.supervisor.seed(seed);
+        node.phase = bitReversed(i);
+        node.rbe.add(0, 0, 0, 30);                  // the IO banks
+        node.rbe.add(1, 0, 0, 30);
+        for (int k = 0; k < 3; k++) {
+            node.rbe.add(2 + k, 2, 5, 60);          // temperatures
+        }
+        node.sig_uptime = node.rbe.add(5, RBE_REFRESH_ONLY, 0, 15);
+        node.supervisor.up(NET_CHIP, 0);
+        node.supervisor.up(NET_LINK, 0);
+        node.supervisor.up(NET_IP, 0);
+    }
+    int reconnect_sec = 0;          // longest time from a broker event to every node having a session again
+    int since = -1;
+    const auto* event = s.events;
+    for (unsigned long t = 0; t < SIM_SEC * 1000UL; t += STEP_MS) {
+        int sec = t / 1000;
+        if (event->sec && t == event->sec * 1000UL) {
+            Broker &broker = brokers[event->broker];
+            broker.up = event->event != BROKER_DOWN;
+            if (event->event != BROKER_UP) {
+                for (auto &node : nodes) {
+                    if (node.broker == event->broker) {
+                        sessionDown(node, t);
+                    }
+                }
+            }
+            since = sec;
+            event++;
+        }
+        for (auto &node : nodes) {
+            if (t % 100 == 0) {
+                node.rbe.update(0, 0x1FD);          // sampled all along, also while offline
+                node.rbe.update(1, 0);
+                for (int k = 0; k < 3; k++) {
+                    node.rbe.update(2 + k, 320);
+                }
+                node.rbe.update(node.sig_uptime, sec);
+            }
+            step(node, t);
+        }
+        if (brokers[0].sessions + brokers[1].sessions == n) {
+            if (since >= 0 && sec - since > reconnect_sec) {
+                reconnect_sec = sec - since;
+            }
+            since = -1;
+        } else if (since < 0) {
+            since = 0;              // power up
+        }
+    }
+    printf("%-30s N=%-4d", s.name, n);
+    for (int b = 0; b < num_brokers; b++) {
+        int tcp = 0, connects = 0, publishes = 0;
+        for (int i = 0; i < SIM_SEC; i++) {
+            tcp = brokers[b].tcp[i] > tcp ? brokers[b].tcp[i] : tcp;
+            connects = brokers[b].connects[i] > connects ? brokers[b].connects[i] : connects;
+            publishes = brokers[b].publishes[i] > publishes ? brokers[b].publishes[i] : publishes;
+        }
+        printf(" | %-7s %4d %4d %5d %4d", addresses[b].host, tcp, connects, publishes, brokers[b].sessions);
+    }
+    int steady = 0;
+    for (int i = SIM_SEC - 60; i < SIM_SEC; i++) {
+        steady += brokers[0].publishes[i] + brokers[1].publishes[i];
+    }
+    printf(" | %3d s %5d/s\n", reconnect_sec, steady / 60);
+
+    // everyone gets a session, on the broker expected, in a few seconds and with the CONNECTs spread
+    // rather than one burst
+    CHECK(brokers[s.ends_on].sessions == n);
+    CHECK(reconnect_sec <= 10);
+    for (int b = 0; b < num_brokers; b++) {
+        for (int i = 0; i < SIM_SEC; i++) {
+            CHECK(brokers[b].connects[i] <= n / 3);
+        }
+    }
+}
+
+int main() {
+    const Scenario scenarios[] = {
+        {"power up together",           {}, 0},
+        {"primary restart",             {{120, 0, BROKER_RESTART}}, 1},
+        {"primary down 5 s",            {{120, 0, BROKER_DOWN}, {125, 0, BROKER_UP}}, 1},
+        {"primary down 120 s",          {{120, 0, BROKER_DOWN}, {240, 0, BROKER_UP}}, 1},
+        {"back to primary",             {{120, 0, BROKER_DOWN}, {240, 0, BROKER_UP}, {400, 1, BROKER_RESTART}}, 0},
+    };
+    const int sizes[] = {100, 500};
+    printf("%-30s %-6s | broker peak/s: tcp CONNECT publish, sessions at the end | all connected, mean publish rate\n",
+           "", "");
+    for (int n : sizes) {
+        for (auto &s : scenarios) {
+            run(n, s);
+        }
+    }
+    return failures != 0;
+}
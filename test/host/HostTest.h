@@ -0,0 +1,43 @@
+#ifndef _HOST_TEST_H_
+#define _HOST_TEST_H_
+
+// What every host test and benchmark shares: CHECK, which counts failures for main() to return, and
+// HostTimer, the MQTT and MQTT-SN clients' Timer on the host's steady clock.
+
+#include <stdio.h>
+#include <chrono>
+
+static int failures = 0;
+
+#define CHECK(x) do { if (!(x)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+class HostTimer {
+public:
+    HostTimer() {
+    }
+
+    HostTimer(int ms) {
+        countdown_ms(ms);
+    }
+
+    void countdown_ms(long ms) {
+        end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    }
+
+    void countdown(int seconds) {
+        countdown_ms(seconds * 1000L);
+    }
+
+    bool expired() {
+        return left_ms() <= 0;
+    }
+
+    int left_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point end;
+};
+
+#endif // _HOST_TEST_H_
@@ -0,0 +1,118 @@
+#ifndef _HOST_MBED_H_
+#define _HOST_MBED_H_
+
+// Stand-ins for the parts of mbed OS the tested headers use, to build them on the host (see ../Makefile).
+// Flash is memory the test maps at the STM32F103 flash address.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+inline void core_util_critical_section_enter() {
+}
+
+inline void core_util_critical_section_exit() {
+}
+
+namespace mbed {
+
+/** Flash of an STM32F103: 1 KB sectors, programmed in words. Counts erases and programs.
+ */
+class FlashIAP {
+public:
+    int init() {
+        return 0;
+    }
+
+    int deinit() {
+        return 0;
+    }
+
+    int erase(uint32_t addr, uint32_t size) {
+        if (addr % 1024 || size != 1024 || addr < get_flash_start() || addr + size > get_flash_start() + flash_size) {
+            return -1;
+        }
+        memset((void*)(uintptr_t)addr, 0xFF, size);
+        erases++;
+        return 0;
+    }
+
+    int program(const void* buffer, uint32_t addr, uint32_t size) {
+        if (size % get_page_size() || addr < get_flash_start() || addr + size > get_flash_start() + flash_size) {
+            return -1;
+        }
+        uint8_t* flash = (uint8_t*)(uintptr_t)addr;
+        for (uint32_t i = 0; i < size; i++) {
+            if (flash[i] != 0xFF) {
+                return -1;      // not erased
+            }
+        }
+        memcpy(flash, buffer, size);
+        programs++;
+        return 0;
+    }
+
+    uint32_t get_page_size() const {
+        return 4;
+    }
+
+    uint32_t get_sector_size(uint32_t addr) const {
+        return 1024;
+    }
+
+    uint32_t get_flash_start() const {
+        return 0x08000000;
+    }
+
+    uint32_t get_flash_size() const {
+        return flash_size;
+    }
+
+    static inline uint32_t flash_size = 0x20000;
+    static inline int erases = 0;
+    static inline int programs = 0;
+};
+
+enum crc_polynomial_t {
+    POLY_32BIT_ANSI = 0x04C11DB7
+};
+
+/** CRC-32 as zlib's, bitwise
+ */
+template<uint32_t polynomial, int width>
+class MbedCRC {
+public:
+    int32_t compute_partial_start(uint32_t* crc) {
+        *crc = 0xFFFFFFFFU;
+        return 0;
+    }
+
+    int32_t compute_partial(const void* buffer, size_t size, uint32_t* crc) {
+        const uint8_t* data = (const uint8_t*)buffer;
+        for (size_t i = 0; i < size; i++) {
+            *crc ^= data[i];
+            for (int k = 0; k < 8; k++) {
+                *crc = (*crc >> 1) ^ (0xEDB88320U & (0U - (*crc & 1)));
+            }
+        }
+        return 0;
+    }
+
+    int32_t compute_partial_stop(uint32_t* crc) {
+        *crc ^= 0xFFFFFFFFU;
+        return 0;
+    }
+
+    int32_t compute(const void* buffer, size_t size, uint32_t* crc) {
+        compute_partial_start(crc);
+        compute_partial(buffer, size, crc);
+        return compute_partial_stop(crc);
+    }
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+#endif // _HOST_MBED_H_
@@ -0,0 +1,145 @@
+// MQTT::Client bytes on the wire, MQTT 3.1.1 against MQTT 5 with topic aliases: the controller's five
+// telemetry topics published for a number of rounds (QoS 1) to a scripted broker.
+
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "MQTTClient.h"
+#include "HostTest.h"
+
+// answers each packet the client writes, and counts the client's bytes
+class ScriptedBroker {
+public:
+    ScriptedBroker(int version) : version(version), sent(0), alias_max(10) {
+    }
+
+    int read(unsigned char* buffer, int len, int timeout) {
+        if ((int)in.size() < len) {
+            return 0;
+        }
+        for (int i = 0; i < len; i++) {
+            buffer[i] = in.front();
+            in.pop_front();
+        }
+        return len;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout) {
+        sent += len;
+        last.assign(buffer, buffer + len);
+        int i = 1;
+        while (buffer[i++] & 0x80) {
+        }
+        switch (buffer[0] >> 4) {
+            case CONNECT:
+                if (version == 5) {
+                    answer({0x20, 6, 0, 0, 3, 0x22, 0, alias_max});   // Topic Alias Maximum
+                } else {
+                    answer({0x20, 2, 0, 0});
+                }
+                break;
+            case PUBLISH:
+                if ((buffer[0] >> 1) & 3) {
+                    int id = i + 2 + (buffer[i] << 8 | buffer[i + 1]);
+                    answer({0x40, 2, buffer[id], buffer[id + 1]});
+                }
+                break;
+            case SUBSCRIBE:
+                if (version == 5) {
+                    answer({0x90, 4, buffer[2], buffer[3], 0, 1});
+                } else {
+                    answer({0x90, 3, buffer[2], buffer[3], 1});
+                }
+                break;
+            case UNSUBSCRIBE:
+                if (version == 5) {
+                    answer({0xB0, 4, buffer[2], buffer[3], 0, 0});
+                } else {
+                    answer({0xB0, 2, buffer[2], buffer[3]});
+                }
+                break;
+        }
+        return len;
+    }
+
+    int version;
+    size_t sent;
+    unsigned char alias_max;
+    std::vector<unsigned char> last;
+
+private:
+    void answer(std::vector<unsigned char> packet) {
+        in.insert(in.end(), packet.begin(), packet.end());
+    }
+
+    std::deque<unsigned char> in;
+};
+
+typedef MQTT::Client<ScriptedBroker, HostTimer> Client;
+typedef MQTT::PublishTopic<32> Topic;
+
+static constexpr Topic topics[] = {
+    {"stat/ctl01/inputbank", MQTT::QOS1},
+    {"stat/ctl01/outputbank", MQTT::QOS1},
+    {"stat/ctl01/probetemp0", MQTT::QOS1},
+    {"stat/ctl01/probetemp1", MQTT::QOS1},
+    {"stat/ctl01/uptime", MQTT::QOS1},
+};
+static const char* payloads[] = {"0x1FD,0x002,17", "0x004,0x004,3", "21.06", "19.94", "12345"};
+static const int num_topics = sizeof(topics) / sizeof(topics[0]);
+
+static void handler(MQTT::MessageData &) {
+}
+
+struct Result {
+    size_t connect;         // CONNECT, SUBSCRIBE and UNSUBSCRIBE
+    size_t first;           // the first round, the aliases are set up
+    size_t total;           // all publishes
+};
+
+static Result run(int version, int rounds) {
+    Result result = {0, 0, 0};
+    ScriptedBroker broker(version);
+    Client client(broker, 1000);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = version;
+    data.clientID.cstring = (char*)"ctl01";
+    CHECK(client.connect(data) == MQTT::SUCCESS);
+    MQTT::subackData suback;
+    CHECK(client.subscribe("cmnd/ctl01/+", MQTT::QOS1, handler, suback) == MQTT::SUCCESS);
+    CHECK(client.unsubscribe("cmnd/ctl01/+") == MQTT::SUCCESS);
+    CHECK(client.isConnected());
+    result.connect = broker.sent;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_topics; i++) {
+            if (client.publish(topics[i], payloads[i], strlen(payloads[i])) != MQTT::SUCCESS) {
+                printf("FAIL publish, MQTT %d round %d\n", version, r);
+                failures++;
+                return result;
+            }
+            if (version == 5 && r > 0) {
+                CHECK(broker.last[2] == 0 && broker.last[3] == 0);     // no topic, the alias
+            }
+        }
+        if (r == 0) {
+            result.first = broker.sent - result.connect;
+        }
+    }
+    result.total = broker.sent - result.connect;
+    return result;
+}
+
+int main() {
+    const int rounds = 100;
+    Result v3 = run(4, rounds);
+    Result v5 = run(5, rounds);
+    int publishes = rounds * num_topics;
+    printf("%d publishes of %d topics      connect  first round  total  per publish\n", publishes, num_topics);
+    printf("MQTT 3.1.1                      %5zu  %11zu  %5zu  %11.1f\n", v3.connect, v3.first, v3.total,
+           (double)v3.total / publishes);
+    printf("MQTT 5, topic aliases           %5zu  %11zu  %5zu  %11.1f\n", v5.connect, v5.first, v5.total,
+           (double)v5.total / publishes);
+    CHECK(v5.total < v3.total);
+    return failures != 0;
+}
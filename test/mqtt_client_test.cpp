@@ -0,0 +1,103 @@
+// MQTT::Client blocking QoS 1 publish: a PUBACK only completes the publish with its packet id. Acks of
+// other packet ids are passed over, a publish left unacked is kept and resent with DUP on reconnect.
+
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "MQTTClient.h"
+#include "HostTest.h"
+
+// answers a QoS 1 publish with the PUBACKs of other packet ids first, as set
+class ScriptedBroker {
+public:
+    ScriptedBroker() : other_acks(0), ack(true) {
+    }
+
+    int read(unsigned char* buffer, int len, int timeout) {
+        if ((int)in.size() < len) {
+            return 0;
+        }
+        for (int i = 0; i < len; i++) {
+            buffer[i] = in.front();
+            in.pop_front();
+        }
+        return len;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout) {
+        int i = 1;
+        while (buffer[i++] & 0x80) {
+        }
+        switch (buffer[0] >> 4) {
+            case CONNECT:
+                answer({0x20, 2, 0, 0});
+                break;
+            case PUBLISH: {
+                int id = i + 2 + (buffer[i] << 8 | buffer[i + 1]);
+                publishes.push_back((buffer[0] & 0x08) << 13 | buffer[id] << 8 | buffer[id + 1]);    // DUP, id
+                for (int k = 0; k < other_acks; k++) {
+                    answer({0x40, 2, (unsigned char)(buffer[id] ^ 0x80), buffer[id + 1]});
+                }
+                if (ack) {
+                    answer({0x40, 2, buffer[id], buffer[id + 1]});
+                }
+                break;
+            }
+        }
+        return len;
+    }
+
+    int other_acks;
+    bool ack;
+    std::vector<int> publishes;
+
+private:
+    void answer(std::vector<unsigned char> packet) {
+        in.insert(in.end(), packet.begin(), packet.end());
+    }
+
+    std::deque<unsigned char> in;
+};
+
+// a persistent session, with room to keep two publishes for resending
+typedef MQTT::PacketArena<100, 100, 2 * 64> Arena;
+typedef MQTT::Client<ScriptedBroker, HostTimer, 100, 5, Arena> Client;
+
+#define DUP 0x10000
+
+int main() {
+    ScriptedBroker broker;
+    Client client(broker, 200);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.clientID.cstring = (char*)"ctl01";
+    data.cleansession = 0;
+    CHECK(client.connect(data) == MQTT::SUCCESS);
+    char payload[] = "21.06";
+    unsigned short id;
+
+    // acked, after the acks of two other publishes
+    broker.other_acks = 2;
+    CHECK(client.publish("stat/ctl01/probetemp0", payload, 5, id, MQTT::QOS1) == MQTT::SUCCESS);
+    CHECK(broker.publishes.size() == 1 && broker.publishes[0] == id);
+    CHECK(client.isConnected());
+
+    // only other publishes' acks: no ack of its own before the timeout, and the session is closed
+    broker.other_acks = 1;
+    broker.ack = false;
+    CHECK(client.publish("stat/ctl01/probetemp0", payload, 5, id, MQTT::QOS1) == MQTT::FAILURE);
+    CHECK(!client.isConnected());
+
+    // kept, resent with DUP on reconnect, and acked this time
+    broker.other_acks = 0;
+    broker.ack = true;
+    broker.publishes.clear();
+    CHECK(client.connect(data) == MQTT::SUCCESS);
+    CHECK(broker.publishes.size() == 1 && broker.publishes[0] == (DUP | id));
+    CHECK(client.disconnect() == MQTT::SUCCESS);
+    broker.publishes.clear();
+    CHECK(client.connect(data) == MQTT::SUCCESS);       // nothing left to resend
+    CHECK(broker.publishes.empty());
+    printf("mqtt_client_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
@@ -0,0 +1,249 @@
+// MQTTSN::Client over UDP on the loopback, against an MQTT-SN gateway stand-in in a thread: SEARCHGW and
+// GWINFO, QoS -1 before connecting, CONNECT, REGISTER, QoS 0 and QoS 1 (the first PUBACK is dropped, so
+// the publish is resent with DUP), keepalive pings, ADVERTISE and DISCONNECT.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MQTTSNClient.h"
+#include "HostTest.h"
+
+static sockaddr_in loopback(int port) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// MQTTSNNetwork on POSIX sockets; a broadcast goes to the gateway port on the loopback
+class HostNetwork {
+public:
+    HostNetwork(int gatewayPort) : fd(socket(AF_INET, SOCK_DGRAM, 0)), all(loopback(gatewayPort)) {
+        memset(&gateway, 0, sizeof(gateway));
+    }
+
+    ~HostNetwork() {
+        close(fd);
+    }
+
+    int read(unsigned char* buffer, int len, int timeout) {
+        pollfd p = {fd, POLLIN, 0};
+        if (::poll(&p, 1, timeout) <= 0) {
+            return -1;
+        }
+        socklen_t size = sizeof(sender);
+        return recvfrom(fd, buffer, len, 0, (sockaddr*)&sender, &size);
+    }
+
+    int write(unsigned char* buffer, int len, int timeout) {
+        return sendto(fd, buffer, len, 0, (sockaddr*)&gateway, sizeof(gateway));
+    }
+
+    int broadcast(unsigned char* buffer, int len, int timeout) {
+        return sendto(fd, buffer, len, 0, (sockaddr*)&all, sizeof(all));
+    }
+
+    void useSender() {
+        gateway = sender;
+    }
+
+private:
+    int fd;
+    sockaddr_in gateway, sender, all;
+};
+
+// answers as a gateway would, and logs what it got
+class Gateway {
+public:
+    Gateway() : fd(socket(AF_INET, SOCK_DGRAM, 0)), dropped(false) {
+        sockaddr_in addr = loopback(0);
+        bind(fd, (sockaddr*)&addr, sizeof(addr));
+        socklen_t size = sizeof(addr);
+        getsockname(fd, (sockaddr*)&addr, &size);
+        port = ntohs(addr.sin_port);
+    }
+
+    ~Gateway() {
+        close(fd);
+    }
+
+    void run() {
+        unsigned char d[512];
+        sockaddr_in from;
+        while (true) {
+            pollfd p = {fd, POLLIN, 0};
+            if (::poll(&p, 1, 10000) <= 0) {
+                log("timeout");
+                return;
+            }
+            socklen_t size = sizeof(from);
+            int n = recvfrom(fd, d, sizeof(d), 0, (sockaddr*)&from, &size);
+            if (n < 2 || d[0] != n) {
+                log("bad length");
+                continue;
+            }
+            unsigned char* b = d + 2;
+            char text[128];
+            switch (d[1]) {
+                case MQTTSN::MQTTSN_SEARCHGW:
+                    snprintf(text, sizeof(text), "SEARCHGW %d", b[0]);
+                    reply(from, MQTTSN::MQTTSN_GWINFO, {7});
+                    break;
+                case MQTTSN::MQTTSN_CONNECT:
+                    snprintf(text, sizeof(text), "CONNECT %02x %d %d %.*s", b[0], b[1], b[2] << 8 | b[3], n - 6,
+                             (char*)b + 4);
+                    reply(from, MQTTSN::MQTTSN_CONNACK, {0});
+                    break;
+                case MQTTSN::MQTTSN_REGISTER: {
+                    std::string name((char*)b + 4, n - 6);
+                    int id = topics.count(name) ? topics[name] : (topics[name] = topics.size() + 1);
+                    snprintf(text, sizeof(text), "REGISTER %s %d", name.c_str(), id);
+                    reply(from, MQTTSN::MQTTSN_REGACK, {0, (unsigned char)id, b[2], b[3], 0});
+                    break;
+                }
+                case MQTTSN::MQTTSN_PUBLISH: {
+                    int qos = (b[0] >> 5) & 3;
+                    snprintf(text, sizeof(text), "PUBLISH %02x %d %d %.*s", b[0], b[1] << 8 | b[2],
+                             b[3] << 8 | b[4], n - 7, (char*)b + 5);
+                    if (qos == 1 && !dropped) {
+                        dropped = true;     // lost: the client has to resend
+                    } else if (qos == 1) {
+                        reply(from, MQTTSN::MQTTSN_PUBACK, {b[1], b[2], b[3], b[4], 0});
+                    }
+                    if (n - 7 == 9 && memcmp(b + 5, "advertise", 9) == 0) {
+                        reply(from, MQTTSN::MQTTSN_ADVERTISE, {9, 0x03, 0x84});
+                    }
+                    break;
+                }
+                case MQTTSN::MQTTSN_PINGREQ:
+                    snprintf(text, sizeof(text), "PINGREQ");
+                    reply(from, MQTTSN::MQTTSN_PINGRESP, {});
+                    break;
+                case MQTTSN::MQTTSN_DISCONNECT:
+                    log("DISCONNECT");
+                    reply(from, MQTTSN::MQTTSN_DISCONNECT, {});
+                    return;
+                default:
+                    snprintf(text, sizeof(text), "type %02x", d[1]);
+                    break;
+            }
+            log(text);
+        }
+    }
+
+    std::vector<std::string> take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> got;
+        got.swap(events);
+        return got;
+    }
+
+    int port;
+
+private:
+    void reply(const sockaddr_in &to, int type, std::vector<unsigned char> body) {
+        body.insert(body.begin(), {(unsigned char)(body.size() + 2), (unsigned char)type});
+        sendto(fd, body.data(), body.size(), 0, (const sockaddr*)&to, sizeof(to));
+    }
+
+    void log(const char* text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(text);
+    }
+
+    int fd;
+    bool dropped;
+    std::map<std::string, int> topics;
+    std::mutex mutex;
+    std::vector<std::string> events;
+};
+
+typedef MQTTSN::Client<HostNetwork, HostTimer> Client;
+
+static int results = 0;
+static int last_rc = 99;
+
+static void done(MQTTSN::ResultData &result) {
+    results++;
+    last_rc = result.rc;
+}
+
+// keep the client polled for ms
+static void pollFor(Client &client, int ms) {
+    HostTimer timer(ms);
+    while (!timer.expired()) {
+        CHECK(client.poll() == MQTTSN::SUCCESS);
+        usleep(1000);
+    }
+}
+
+int main() {
+    Gateway gateway;
+    std::thread thread(&Gateway::run, &gateway);
+    HostNetwork network(gateway.port);
+    Client client(network, 500);
+    client.setResultHandler(done);
+    unsigned short temp, humidity;
+
+    // no gateway yet
+    CHECK(client.publish(Client::shortTopic("t1"), MQTTSN::TOPIC_SHORT, "x", 1, MQTTSN::QOS_MINUS1) == MQTTSN::FAILURE);
+    CHECK(client.searchGateway(1) == MQTTSN::SUCCESS && client.gatewayId() == 7);
+    // QoS -1 before connecting, QoS 0 needs a connection
+    CHECK(client.publish(5, MQTTSN::TOPIC_PREDEFINED, "21.5", 4, MQTTSN::QOS_MINUS1) == MQTTSN::SUCCESS);
+    CHECK(client.publish(5, MQTTSN::TOPIC_PREDEFINED, "21.5", 4, MQTTSN::QOS0) == MQTTSN::FAILURE);
+    CHECK(client.connect("ctl01", 1) == MQTTSN::SUCCESS);
+    CHECK(client.registerTopic("stat/ctl01/probetemp0", temp) == MQTTSN::SUCCESS && temp == 1);
+    CHECK(client.registerTopic("stat/ctl01/humidity", humidity) == MQTTSN::SUCCESS && humidity == 2);
+    CHECK(client.publish(temp, MQTTSN::TOPIC_NORMAL, "21.56", 5, MQTTSN::QOS0) == MQTTSN::SUCCESS);
+    CHECK(client.publish(humidity, MQTTSN::TOPIC_NORMAL, "48", 2, MQTTSN::QOS1) == MQTTSN::SUCCESS);
+    CHECK(client.publish(humidity, MQTTSN::TOPIC_NORMAL, "49", 2, MQTTSN::QOS1) == MQTTSN::BUSY);
+    HostTimer timer(MQTTSN_RETRY_MS * 2);
+    while (!timer.expired() && results == 0) {
+        client.poll();
+        usleep(1000);
+    }
+    CHECK(results == 1 && last_rc == MQTTSN::SUCCESS);
+    std::vector<std::string> got = gateway.take();
+    const char* expected[] = {
+        "SEARCHGW 1",
+        "PUBLISH 61 5 0 21.5",
+        "CONNECT 04 1 1 ctl01",
+        "REGISTER stat/ctl01/probetemp0 1",
+        "REGISTER stat/ctl01/humidity 2",
+        "PUBLISH 00 1 0 21.56",
+        "PUBLISH 20 2 3 48",
+        "PUBLISH a0 2 3 48",       // DUP
+    };
+    CHECK(got.size() == sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < got.size() && i < sizeof(expected) / sizeof(expected[0]); i++) {
+        if (got[i] != expected[i]) {
+            printf("FAIL gateway got \"%s\", expected \"%s\"\n", got[i].c_str(), expected[i]);
+            failures++;
+        }
+    }
+
+    // keepalive 1 s: pings while idle; an ADVERTISE from the gateway doesn't upset anything
+    CHECK(client.publish(Client::shortTopic("t1"), MQTTSN::TOPIC_SHORT, "advertise", 9, MQTTSN::QOS0) == MQTTSN::SUCCESS);
+    pollFor(client, 2500);
+    CHECK(client.isConnected());
+    got = gateway.take();
+    CHECK(got.size() >= 3 && got[0] == "PUBLISH 02 29745 0 advertise" && got[1] == "PINGREQ");
+    client.disconnect();
+    CHECK(!client.isConnected());
+    thread.join();
+    got = gateway.take();
+    CHECK(got.size() == 1 && got[0] == "DISCONNECT");
+    printf("mqttsn_interop_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
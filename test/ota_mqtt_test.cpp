@@ -0,0 +1,225 @@
+// A firmware update over MQTT, as main.cpp takes it: the frames arrive as PUBLISHes on cmnd/<name>/ota, those
+// bigger than the 100 byte read buffer in pieces through the stream handler, the rest through the message
+// handler, and each status goes back on stat/<name>/ota before the sender goes on. The flash is memory mapped
+// as in ota_test.
+
+#include "mbed.h"
+#include "FirmwareUpdate.h"
+#include "MQTTClient.h"
+#include <sys/mman.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "HostTest.h"
+
+#define FLASH_START 0x08000000
+#define FLASH_SIZE 0x20000
+
+typedef std::vector<uint8_t> Bytes;
+
+// MQTT 5 as main.cpp: takes the frames it is given as PUBLISHes, answers the client's CONNECT, SUBSCRIBE
+// and status publishes, and hands what is queued over at most segment bytes per read, as TCP may
+class ScriptedBroker {
+public:
+    ScriptedBroker() : segment(1000), acks(0), next_id(1) {
+    }
+
+    int read(unsigned char* buffer, int len, int timeout) {
+        int n = len < (int)in.size() ? len : (int)in.size();
+        n = n < segment ? n : segment;
+        for (int i = 0; i < n; i++) {
+            buffer[i] = in.front();
+            in.pop_front();
+        }
+        return n;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout) {
+        int i = 1;
+        while (buffer[i++] & 0x80) {
+        }
+        switch (buffer[0] >> 4) {
+            case CONNECT:
+                answer({0x20, 3, 0, 0, 0});
+                break;
+            case SUBSCRIBE:
+                answer({0x90, 4, buffer[2], buffer[3], 0, 1});
+                break;
+            case PUBLISH: {
+                int topic_len = buffer[i] << 8 | buffer[i + 1];
+                std::string topic((const char*)buffer + i + 2, topic_len);
+                int id = i + 2 + topic_len;
+                int payload = id + 2 + 1;               // no properties
+                statuses.push_back(topic + " " + std::string((const char*)buffer + payload, len - payload));
+                answer({0x40, 2, buffer[id], buffer[id + 1]});
+                break;
+            }
+            case PUBACK:
+                acks++;
+                break;
+        }
+        return len;
+    }
+
+    void publish(const char* topic, const Bytes &payload, int qos) {
+        int topic_len = strlen(topic);
+        int rem_len = 2 + topic_len + (qos ? 2 : 0) + 1 + payload.size();
+        std::vector<unsigned char> packet{(unsigned char)(0x30 | qos << 1)};
+        do {
+            packet.push_back((rem_len & 0x7F) | (rem_len > 0x7F ? 0x80 : 0));
+            rem_len >>= 7;
+        } while (rem_len > 0);
+        packet.push_back(0);
+        packet.push_back(topic_len);
+        packet.insert(packet.end(), topic, topic + topic_len);
+        if (qos) {
+            packet.push_back(next_id >> 8);
+            packet.push_back(next_id++);
+        }
+        packet.push_back(0);                            // no properties
+        packet.insert(packet.end(), payload.begin(), payload.end());
+        answer(packet);
+    }
+
+    int segment;
+    int acks;                                           // PUBACKs of the frames
+    std::vector<std::string> statuses;                  // "<topic> <payload>" of the client's publishes
+
+private:
+    void answer(std::vector<unsigned char> packet) {
+        in.insert(in.end(), packet.begin(), packet.end());
+    }
+
+    std::deque<unsigned char> in;
+    unsigned short next_id;
+};
+
+typedef MQTT::PacketArena<100, 100, 0> Arena;           // main.cpp's MQTT_READ_BUF, MQTT_SEND_BUF
+typedef MQTT::Client<ScriptedBroker, HostTimer, 100, 5, Arena> Client;
+
+static const char topic_ota[] = "cmnd/ctl01/ota";
+static constexpr MQTT::PublishTopic<32> stat_ota("stat/ctl01/ota", MQTT::QOS1);
+
+static FirmwareUpdate ota;
+static int commands;                                    // other commands, left to the command queue
+static int streamed, pieces, offset_errors;             // frames and pieces through the stream handler
+static int next_offset;
+
+// main.cpp's message_handler and ota_stream
+static void message_handler(MQTT::MessageData& md) {
+    MQTT::Message &message = md.message;
+    if (MQTTPacket_equals(&md.topicName, (char*)topic_ota)) {
+        ota.receive((const uint8_t*)message.payload, message.payloadlen, 0, message.payloadlen);
+        return;
+    }
+    commands++;
+}
+
+static void ota_stream(MQTT::StreamData& sd) {
+    if (MQTTPacket_equals(&sd.topicName, (char*)topic_ota)) {
+        ota.receive((const uint8_t*)sd.message.payload, sd.message.payloadlen, sd.offset, sd.total);
+    }
+    offset_errors += sd.offset != (sd.offset == 0 ? 0 : next_offset);
+    next_offset = sd.offset + sd.message.payloadlen;
+    pieces++;
+    streamed += next_offset == sd.total;
+}
+
+static uint32_t crc32(const Bytes &data) {
+    MbedCRC<POLY_32BIT_ANSI, 32> crc;
+    uint32_t value;
+    crc.compute(data.data(), data.size(), &value);
+    return value;
+}
+
+static Bytes beginFrame(uint32_t size, uint32_t crc, int chunk, int window) {
+    return Bytes{'B', (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size,
+                 (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc,
+                 (uint8_t)(chunk >> 8), (uint8_t)chunk, (uint8_t)window};
+}
+
+static Bytes dataFrame(const Bytes &image, int seq, int chunk) {
+    size_t start = (size_t)seq * chunk;
+    size_t end = start + chunk < image.size() ? start + chunk : image.size();
+    Bytes frame(3 + end - start);
+    frame[0] = 'D';
+    frame[1] = (uint8_t)(seq >> 8);
+    frame[2] = (uint8_t)seq;
+    memcpy(frame.data() + 3, image.data() + start, end - start);
+    return frame;
+}
+
+// the main loop until the broker has the next status: poll, and publish the status as report_ota does
+static std::string nextStatus(Client &client, ScriptedBroker &broker) {
+    size_t seen = broker.statuses.size();
+    for (int n = 0; n < 100 && broker.statuses.size() == seen; n++) {
+        CHECK(client.poll() == MQTT::SUCCESS);
+        const char* status = ota.takeStatus();
+        if (status != NULL) {
+            CHECK(client.startPublish(stat_ota, status, strlen(status)) > 0);     // its packet id
+        }
+    }
+    return broker.statuses.size() > seen ? broker.statuses.back() : "";
+}
+
+int main() {
+    void* flash = mmap((void*)FLASH_START, FLASH_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (flash == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(flash, 0x5A, FLASH_SIZE);    // not erased
+
+    // 300 byte chunks, streamed; the last is 50 bytes and fits the read buffer
+    Bytes image(30050);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)((i * 13 + 5) ^ (i >> 7));
+    }
+    const int chunk = 300, window = 8;
+    int chunks = (image.size() + chunk - 1) / chunk;
+
+    ScriptedBroker broker;
+    Client client(broker, 1000);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 5;
+    data.clientID.cstring = (char*)"ctl01";
+    // the stream handler before the CONNECT, as main.cpp
+    CHECK(client.setMessageHandler("cmnd/ctl01/+", message_handler) == MQTT::SUCCESS);
+    CHECK(client.setStreamHandler("cmnd/ctl01/+", ota_stream) == MQTT::SUCCESS);
+    CHECK(client.connect(data) == MQTT::SUCCESS);
+    CHECK(client.subscribe("cmnd/ctl01/+", MQTT::QOS1, message_handler) == MQTT::SUCCESS);
+    broker.segment = 64;
+
+    // the sender waits for each status before it goes on: ready, then receiving every window, verified
+    broker.publish(topic_ota, beginFrame(image.size(), crc32(image), chunk, window), 1);
+    CHECK(nextStatus(client, broker) == "stat/ctl01/ota ready,0");
+    for (int seq = 0; seq < chunks; seq++) {
+        broker.publish(topic_ota, dataFrame(image, seq, chunk), seq % 2);
+        if (seq == 10) {
+            broker.publish("cmnd/ctl01/output1", Bytes{'1'}, 1);
+        }
+        if ((seq + 1) % window == 0 || seq + 1 == chunks) {
+            CHECK(nextStatus(client, broker) == "stat/ctl01/ota receiving," + std::to_string(seq + 1));
+        }
+    }
+    broker.publish(topic_ota, Bytes{'E'}, 1);
+    CHECK(nextStatus(client, broker) == "stat/ctl01/ota verified," + std::to_string(chunks));
+    CHECK(ota.state() == FirmwareUpdate::OTA_VERIFIED);
+    CHECK(broker.statuses.size() == 2 + (size_t)(chunks + window - 1) / window);
+
+    // every full chunk streamed in pieces, in order; the command and the QoS 1 frames acked
+    CHECK(streamed == chunks - 1 && offset_errors == 0);
+    CHECK(pieces > 2 * streamed);
+    CHECK(commands == 1);
+    CHECK(broker.acks == 1 + chunks / 2 + 1 + 1);       // begin, odd chunks, the command, end
+    CHECK(client.isConnected());
+
+    // staged in the upper half, with its install record
+    CHECK(memcmp((const void*)(uintptr_t)(FLASH_START + FLASH_SIZE / 2), image.data(), image.size()) == 0);
+    FlashIAP flash_iap;
+    uint32_t stage_addr, record_addr;
+    CHECK(FirmwareUpdate::pending(flash_iap, stage_addr, record_addr) == image.size());
+    printf("ota_mqtt_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
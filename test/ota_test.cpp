@@ -0,0 +1,191 @@
+// FirmwareUpdate: frames fed whole and in pieces, lost chunks, the staged image and its install record.
+// The flash is memory mapped at 0x08000000; the running image ends at 0x08007800 (linker symbols set by
+// the Makefile).
+
+#include "mbed.h"
+#include "FirmwareUpdate.h"
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include "HostTest.h"
+
+#define FLASH_START 0x08000000
+#define FLASH_SIZE 0x20000
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::string status;      // the last one
+static int receiving;           // "receiving" statuses
+
+static uint32_t crc32(const Bytes &data) {
+    MbedCRC<POLY_32BIT_ANSI, 32> crc;
+    uint32_t value;
+    crc.compute(data.data(), data.size(), &value);
+    return value;
+}
+
+// feed a frame in pieces of up to piece bytes, as the stream handler does, and take the status
+static void feed(FirmwareUpdate &ota, const Bytes &frame, int piece) {
+    int offset = 0;
+    do {
+        int len = (int)frame.size() - offset < piece ? (int)frame.size() - offset : piece;
+        ota.receive(frame.data() + offset, len, offset, frame.size());
+        offset += len;
+    } while (offset < (int)frame.size());
+    const char* s;
+    while ((s = ota.takeStatus()) != NULL) {
+        status = s;
+        receiving += status.compare(0, 9, "receiving") == 0;
+    }
+}
+
+static Bytes beginFrame(uint32_t size, uint32_t crc, int chunk, int window) {
+    return Bytes{'B', (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size,
+                 (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc,
+                 (uint8_t)(chunk >> 8), (uint8_t)chunk, (uint8_t)window};
+}
+
+static Bytes dataFrame(const Bytes &image, int seq, int chunk) {
+    size_t start = (size_t)seq * chunk;
+    size_t end = start + chunk < image.size() ? start + chunk : image.size();
+    Bytes frame(3 + end - start);
+    frame[0] = 'D';
+    frame[1] = (uint8_t)(seq >> 8);
+    frame[2] = (uint8_t)seq;
+    memcpy(frame.data() + 3, image.data() + start, end - start);
+    return frame;
+}
+
+static void send(FirmwareUpdate &ota, const Bytes &image, int chunk, int window) {
+    int chunks = (image.size() + chunk - 1) / chunk;
+    feed(ota, beginFrame(image.size(), crc32(image), chunk, window), 5);
+    for (int seq = 0; seq < chunks; seq++) {
+        feed(ota, dataFrame(image, seq, chunk), seq % 2 ? 1000 : 37);     // whole, or in pieces
+    }
+    feed(ota, Bytes{'E'}, 1);
+}
+
+static void testUpdate() {
+    // an image of odd size, in chunks that don't line up with the program buffer
+    Bytes image(40001);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)((i * 7 + 3) ^ (i >> 8));
+    }
+    const int chunk = 300, window = 8;
+    int chunks = (image.size() + chunk - 1) / chunk;
+    FirmwareUpdate ota;
+    receiving = 0;
+    FlashIAP::erases = FlashIAP::programs = 0;
+    feed(ota, beginFrame(image.size(), crc32(image), chunk, window), 5);
+    CHECK(status == "ready,0");
+    for (int seq = 0; seq < chunks; seq++) {
+        if (seq == 20) {
+            // 20 and 21 lost: one resend, then the later chunks are skipped until 20 comes
+            feed(ota, dataFrame(image, 22, chunk), 64);
+            CHECK(status == "resend,20");
+            status.clear();
+            feed(ota, dataFrame(image, 23, chunk), 64);
+            CHECK(status.empty());
+        }
+        feed(ota, dataFrame(image, seq, chunk), seq % 2 ? 1000 : 37);
+    }
+    CHECK(status == "receiving," + std::to_string(chunks));
+    CHECK(receiving == (chunks + window - 1) / window);
+    feed(ota, Bytes{'E'}, 1);
+    CHECK(status == "verified," + std::to_string(chunks));
+    CHECK(ota.state() == FirmwareUpdate::OTA_VERIFIED);
+
+    // staged in the upper half, programmed once, erased a sector at a time as the writes got there
+    uint32_t stage = FLASH_START + FLASH_SIZE / 2;
+    CHECK(memcmp((const void*)(uintptr_t)stage, image.data(), image.size()) == 0);
+    CHECK(FlashIAP::erases == (int)(image.size() + 1023) / 1024 + 1);      // and the record's sector
+    CHECK(FlashIAP::programs == (int)(image.size() + OTA_PROGRAM_BUF - 1) / OTA_PROGRAM_BUF + 1);
+
+    FlashIAP flash;
+    uint32_t stage_addr, record_addr;
+    CHECK(FirmwareUpdate::pending(flash, stage_addr, record_addr) == image.size());
+    CHECK(stage_addr == stage && record_addr == FLASH_START + FLASH_SIZE - 1024);
+    const uint32_t* record = (const uint32_t*)(uintptr_t)record_addr;
+    CHECK(record[0] == OTA_MAGIC && record[1] == image.size() && record[2] == crc32(image));
+
+    // a staged image that no longer matches its record is forgotten
+    *(uint8_t*)(uintptr_t)(stage + 1000) ^= 1;
+    CHECK(FirmwareUpdate::pending(flash, stage_addr, record_addr) == 0);
+    CHECK(record[0] == 0xFFFFFFFF);
+    CHECK(FirmwareUpdate::pending(flash, stage_addr, record_addr) == 0);
+}
+
+static void testFailures() {
+    Bytes image(1000, 0x55);
+    FirmwareUpdate ota;
+    FlashIAP flash;
+    uint32_t stage_addr, record_addr;
+
+    // the CRC doesn't match what arrived: no record
+    feed(ota, beginFrame(128, 1234, 64, 4), 100);
+    feed(ota, dataFrame(image, 0, 64), 100);
+    feed(ota, dataFrame(image, 1, 64), 100);
+    feed(ota, Bytes{'E'}, 1);
+    CHECK(status == "failed,2");
+    CHECK(ota.state() == FirmwareUpdate::OTA_FAILED);
+    CHECK(FirmwareUpdate::pending(flash, stage_addr, record_addr) == 0);
+
+    // a begin clears the record of an image staged before
+    send(ota, image, 100, 4);
+    CHECK(status == "verified,10");
+    feed(ota, beginFrame(image.size(), crc32(image), 100, 4), 100);
+    CHECK(status == "ready,0");
+    CHECK(FirmwareUpdate::pending(flash, stage_addr, record_addr) == 0);
+
+    // a chunk longer than announced, then abort
+    Bytes longer = dataFrame(image, 0, 100);
+    longer.push_back(0);
+    feed(ota, longer, 30);
+    CHECK(status == "resend,0");
+    feed(ota, Bytes{'A'}, 1);
+    CHECK(status == "idle,0");
+    CHECK(ota.state() == FirmwareUpdate::OTA_IDLE);
+
+    // bigger than the staging area, a bad chunk size or window
+    feed(ota, beginFrame(FLASH_SIZE / 2, 0, 64, 4), 100);
+    CHECK(status == "failed,0");
+    feed(ota, beginFrame(100, 0, 0, 4), 100);
+    CHECK(status == "failed,0");
+    feed(ota, beginFrame(100, 0, 64, 0), 100);
+    CHECK(status == "failed,0");
+
+    // data before a begin is ignored
+    FirmwareUpdate idle;
+    status.clear();
+    feed(idle, dataFrame(image, 0, 100), 100);
+    CHECK(status.empty() && idle.state() == FirmwareUpdate::OTA_IDLE);
+}
+
+static void testImageEnd() {
+    // a 56 KB part: the upper half would start below the end of the running firmware
+    Bytes image(1000, 0xAA);
+    FlashIAP::flash_size = 0xE000;
+    FirmwareUpdate ota;
+    feed(ota, beginFrame(image.size(), crc32(image), 100, 4), 100);
+    CHECK(status == "failed,0");
+    // 60 KB: the running firmware ends where the upper half starts
+    FlashIAP::flash_size = 0xF000;
+    send(ota, image, 100, 4);
+    CHECK(status == "verified,10");
+    FlashIAP::flash_size = FLASH_SIZE;
+}
+
+int main() {
+    void* flash = mmap((void*)FLASH_START, FLASH_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (flash == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(flash, 0x5A, FLASH_SIZE);    // not erased
+    testUpdate();
+    testFailures();
+    testImageEnd();
+    printf("ota_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
@@ -0,0 +1,132 @@
+// QuadratureDecoder on recorded edge sequences: clean turns both ways, contact bounce, missed states,
+// acceleration, and counts read from a 16 bit encoder mode timer (wrapping) against the edge decoder.
+// The recordings are generated with rand() from srand(1), in this order, so the counts below are theirs.
+
+#include <stdlib.h>
+#include "QuadratureDecoder.h"
+#include "HostTest.h"
+
+static const int clockwise[4] = {0, 2, 3, 1};      // the states a clockwise turn goes through, A << 1 | B
+
+static int edge(QuadratureDecoder &d, int phase, uint32_t now_us) {
+    int s = clockwise[phase];
+    return d.update(s >> 1, s & 1, now_us);
+}
+
+static void testCleanTurns() {
+    // 100 detents one way, 100 back, 10 times over; a detent per cycle and per half cycle
+    for (int per_detent = 2; per_detent <= 4; per_detent += 2) {
+        QuadratureDecoder d(per_detent);
+        d.reset(0, 0);
+        int phase = 0, cw = 0, ccw = 0;
+        uint32_t t = 0;
+        for (int i = 0; i < 4000; i++) {
+            int dir = (i / 400) % 2 ? -1 : 1;
+            phase = (phase + dir + 4) % 4;
+            int r = edge(d, phase, t += 5000);
+            cw += r > 0;
+            ccw += r < 0;
+            if (i == 399) {
+                CHECK(d.position() == 400 / per_detent);
+            }
+        }
+        CHECK(d.position() == 0);
+        CHECK(cw == 2000 / per_detent && ccw == 2000 / per_detent);
+        CHECK(d.errors() == 0);
+    }
+}
+
+static void testBounce() {
+    // 1000 detents clockwise, every edge chatters 0-5 times before it settles
+    QuadratureDecoder d(4);
+    d.reset(0, 0);
+    int phase = 0;
+    uint32_t t = 0;
+    for (int i = 0; i < 4000; i++) {
+        int prev = phase;
+        phase = (phase + 1) % 4;
+        for (int k = rand() % 6; k > 0; k--) {
+            edge(d, phase, t += 50);
+            edge(d, prev, t += 50);
+        }
+        edge(d, phase, t += 3000);
+    }
+    CHECK(d.position() == 1000);
+    CHECK(d.errors() == 0);
+}
+
+static void testMissedStates() {
+    // 1 in 50 states not seen, both switches change at once: an error, and the 2 quarter steps are lost.
+    // Two misses back to back look like a step back, not an error
+    QuadratureDecoder d(4);
+    d.reset(0, 0);
+    int phase = 0, missed = 0;
+    uint32_t t = 0;
+    for (int i = 0; i < 4000; i++) {
+        phase = (phase + 1) % 4;
+        if (rand() % 50 == 0) {
+            missed++;
+            continue;
+        }
+        edge(d, phase, t += 1000);
+    }
+    CHECK(missed == 84);
+    CHECK(d.errors() == 76);
+    CHECK(d.position() == 958);
+}
+
+static void testAcceleration() {
+    // up to 5x within 10 ms: detents 20 ms apart move 1 each, 2 ms apart 1 + 4 * 8 / 10 = 4 each
+    QuadratureDecoder d(4);
+    d.reset(0, 0);
+    d.setAcceleration(10000, 5);
+    int phase = 0;
+    uint32_t t = 0;
+    for (int i = 0; i < 40; i++) {
+        phase = (phase + 1) % 4;
+        edge(d, phase, t += 5000);
+    }
+    CHECK(d.position() == 10);
+    for (int i = 0; i < 40; i++) {
+        phase = (phase + 1) % 4;
+        edge(d, phase, t += 500);
+    }
+    CHECK(d.position() == 10 + 40);
+}
+
+static void testTimerCounts() {
+    // the same turns counted by a 16 bit timer in encoder mode, read at random times as mRotaryEncoder::Get()
+    // does (the difference since the last read, as an int16_t), end at the edge decoder's position
+    QuadratureDecoder edges(4), timer(4);
+    edges.reset(0, 0);
+    uint16_t count = 0xFF00, last = count;     // wraps at once, and again every 64K net quarter steps
+    int phase = 0, wraps = 0;
+    uint32_t t = 0;
+    for (int i = 0; i < 100000; i++) {
+        int dir = rand() % 3 ? 1 : -1;
+        phase = (phase + dir + 4) % 4;
+        uint16_t before = count;
+        count += dir;
+        wraps += (dir > 0 && count < before) || (dir < 0 && count > before);
+        edge(edges, phase, t += 1000);
+        if (rand() % 7 == 0) {
+            timer.addCounts((int16_t)(count - last), t);
+            last = count;
+        }
+    }
+    timer.addCounts((int16_t)(count - last), t);
+    CHECK(wraps > 0);
+    CHECK(timer.position() == edges.position());
+    CHECK(edges.position() == 8259);
+}
+
+int main() {
+    srand(1);
+    testCleanTurns();
+    testBounce();
+    testMissedStates();
+    testAcceleration();
+    testTimerCounts();
+    printf("quadrature_decoder_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
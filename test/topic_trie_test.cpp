@@ -0,0 +1,136 @@
+// MQTT::TopicTrie: filters subscribed and unsubscribed for ever in a fixed pool, and matching against a
+// plain filter by filter match, with the pool compacted along the way.
+
+#include "MQTTTopicTrie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "HostTest.h"
+
+static std::vector<std::string> levels(const std::string &topic) {
+    std::vector<std::string> out;
+    size_t start = 0, sep;
+    while ((sep = topic.find('/', start)) != std::string::npos) {
+        out.push_back(topic.substr(start, sep - start));
+        start = sep + 1;
+    }
+    out.push_back(topic.substr(start));
+    return out;
+}
+
+// MQTT 3.1.1 section 4.7, level by level
+static bool matches(const std::string &filter, const std::string &topic) {
+    std::vector<std::string> f = levels(filter), t = levels(topic);
+    if (topic[0] == '$' && (f[0] == "+" || f[0] == "#")) {
+        return false;
+    }
+    for (size_t i = 0; i < f.size(); i++) {
+        if (f[i] == "#") {
+            return true;
+        }
+        if (i == t.size() || (f[i] != "+" && f[i] != t[i])) {
+            return false;
+        }
+    }
+    return f.size() == t.size();
+}
+
+static void testSubscribeCycles() {
+    // the local broker's trie: 12 filters
+    MQTT::TopicTrie<12 * 4, 12 * 12> trie;
+    CHECK(trie.insert("cmnd/ctl01/#", 0));
+    CHECK(trie.insert("stat/+/online", 1));
+    char filter[64];
+    for (int cycle = 0; cycle < 10000; cycle++) {
+        // hmi clients come and go, each with filters of their own
+        int n = 2 + cycle % 9;
+        for (int i = 2; i < n; i++) {
+            snprintf(filter, sizeof(filter), "tele/hmi%d/panel%d/+", cycle, i);
+            if (!trie.insert(filter, i)) {
+                printf("FAIL insert %s, cycle %d\n", filter, cycle);
+                failures++;
+                return;
+            }
+        }
+        int handlers[12];
+        CHECK(trie.match("cmnd/ctl01/output3", 18, handlers, 12) == 1 && handlers[0] == 0);
+        snprintf(filter, sizeof(filter), "tele/hmi%d/panel%d/x", cycle, n - 1);
+        CHECK(n == 2 || (trie.match(filter, strlen(filter), handlers, 12) == 1 && handlers[0] == n - 1));
+        for (int i = 2; i < n; i++) {
+            snprintf(filter, sizeof(filter), "tele/hmi%d/panel%d/+", cycle, i);
+            CHECK(cycle % 2 ? trie.remove(filter) : trie.removeHandler(i));
+        }
+    }
+    CHECK(trie.find("stat/+/online") == 1);
+}
+
+static void testRandom() {
+    // small pool, compacted often; levels shared between filters and as parts of each other
+    const char* words[] = {"a", "b", "ab", "ba", "abc", "cab", "bc", "c", "+", "#", "$SYS", ""};
+    const int num_words = sizeof(words) / sizeof(words[0]);
+    MQTT::TopicTrie<40, 48> trie;
+    std::vector<std::string> filters(16);      // by handler id, "" = free
+    srand(1);
+    for (int step = 0; step < 200000; step++) {
+        int h = rand() % filters.size();
+        if (filters[h].empty()) {
+            std::string filter;
+            int depth = 1 + rand() % 4;
+            for (int d = 0; d < depth; d++) {
+                std::string word = words[rand() % num_words];
+                if (word == "#" && d < depth - 1) {
+                    word = "+";
+                }
+                if (rand() % 8 == 0) {
+                    word += std::to_string(rand() % 50);      // text of its own
+                }
+                filter += (d ? "/" : "") + word;
+            }
+            if (std::find(filters.begin(), filters.end(), filter) != filters.end()) {
+                continue;
+            }
+            if (trie.insert(filter.c_str(), h)) {
+                filters[h] = filter;
+            }
+        } else {
+            CHECK(trie.find(filters[h].c_str()) == h);
+            CHECK(step % 2 ? trie.remove(filters[h].c_str()) : trie.removeHandler(h));
+            CHECK(trie.find(filters[h].c_str()) == -1);
+            filters[h].clear();
+        }
+        std::string topic;
+        int depth = 1 + rand() % 4;
+        for (int d = 0; d < depth; d++) {
+            const char* word = words[rand() % num_words];
+            topic += (d ? "/" : "") + std::string(word[0] == '+' || word[0] == '#' ? "a" : word);
+        }
+        int handlers[16];
+        int count = trie.match(topic.c_str(), topic.size(), handlers, 16);
+        std::vector<int> got(handlers, handlers + count), want;
+        for (size_t i = 0; i < filters.size(); i++) {
+            if (!filters[i].empty() && matches(filters[i], topic)) {
+                want.push_back(i);
+            }
+        }
+        std::sort(got.begin(), got.end());
+        if (got != want) {
+            printf("FAIL match %s, step %d: %d filters, %zu expected\n", topic.c_str(), step, count, want.size());
+            failures++;
+            return;
+        }
+    }
+    // every filter out, the whole pool is free again
+    for (size_t i = 0; i < filters.size(); i++) {
+        CHECK(filters[i].empty() || trie.remove(filters[i].c_str()));
+    }
+    CHECK(trie.insert("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa0", 0));
+}
+
+int main() {
+    testSubscribeCycles();
+    testRandom();
+    printf("topic_trie_test: %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}